@@ -0,0 +1,103 @@
+#include "LockMachine.h"
+
+static void enterLockState(LockMachine* m, LockState state, unsigned long at) {
+  LockState from = m->state;
+  m->state = state;
+  m->stateAt = at;
+  if (m->listener) m->listener(from, state, at);
+}
+
+// now is at least d ms past t. Signed, so a time stamped after now (an
+// edge the ISR logged after the caller read millis()) isn't a huge
+// unsigned gap that counts as long overdue.
+static bool elapsed(unsigned long now, unsigned long t, uint32_t d) {
+  return (long)(now - t) >= (long)d;
+}
+
+// Time in the current state before its timed transition, 0 if none
+static uint32_t stateDuration(const LockMachine* m) {
+  switch (m->state) {
+    case LOCK_SETTLE:    return m->timing.settleMs;
+    case LOCK_ENERGISED: return m->timing.energisedMs;
+    case LOCK_RELEASE:   return m->timing.releaseMs;
+    default:             return 0;
+  }
+}
+
+static void onLidChange(LockMachine* m, bool closed, unsigned long at) {
+  if (closed && m->state == LOCK_IDLE) {
+    enterLockState(m, LOCK_SETTLE, at);
+  } else if (!closed && m->state == LOCK_SETTLE) {
+    enterLockState(m, LOCK_IDLE, at);
+  }
+}
+
+void lockBegin(LockMachine* m, const LockTiming& timing, LockListener listener, int switchLevel) {
+  m->timing = timing;
+  m->listener = listener;
+  m->state = LOCK_IDLE;
+  m->stateAt = 0;
+  m->backendOn = false;
+  m->steadyLevel = m->edgeLevel = switchLevel;
+  m->edgeAt = 0;
+  m->debouncePending = false;
+}
+
+void lockSwitchEdge(LockMachine* m, unsigned long at, int level) {
+  m->edgeLevel = level;
+  m->edgeAt = at;
+  m->debouncePending = true;
+}
+
+bool lockBackend(LockMachine* m, bool on, unsigned long now) {
+  if (on == m->backendOn) return false;
+  m->backendOn = on;
+  if (on && m->state != LOCK_HOLD) {
+    enterLockState(m, LOCK_HOLD, now);
+  } else if (!on && m->state == LOCK_HOLD) {
+    enterLockState(m, LOCK_RELEASE, now);
+  }
+  return true;
+}
+
+void lockUpdate(LockMachine* m, unsigned long now) {
+  // Debounced level change, taken at the moment it became steady. A
+  // level that bounced back to the steady one is no change.
+  if (m->debouncePending && elapsed(now, m->edgeAt, m->timing.debounceMs)) {
+    m->debouncePending = false;
+    if (m->edgeLevel != m->steadyLevel) {
+      m->steadyLevel = m->edgeLevel;
+      onLidChange(m, m->steadyLevel == 0, m->edgeAt + m->timing.debounceMs);
+    }
+  }
+
+  // Timed transitions, each anchored to the previous one's deadline
+  uint32_t duration;
+  while ((duration = stateDuration(m)) && elapsed(now, m->stateAt, duration)) {
+    unsigned long at = m->stateAt + duration;
+    switch (m->state) {
+      case LOCK_SETTLE:    enterLockState(m, LOCK_ENERGISED, at); break;
+      case LOCK_ENERGISED: enterLockState(m, LOCK_RELEASE, at);   break;
+      default:             enterLockState(m, LOCK_IDLE, at);      break;
+    }
+  }
+}
+
+long lockNextWakeMs(const LockMachine* m, unsigned long now) {
+  long wait = -1;
+  uint32_t duration = stateDuration(m);
+  if (duration) {
+    long left = (long)(m->stateAt + duration - now);
+    wait = left > 0 ? left : 0;
+  }
+  if (m->debouncePending) {
+    long left = (long)(m->edgeAt + m->timing.debounceMs - now);
+    if (left < 0) left = 0;
+    if (wait < 0 || left < wait) wait = left;
+  }
+  return wait;
+}
+
+bool lockRelayOn(LockState state) {
+  return state == LOCK_ENERGISED || state == LOCK_HOLD;
+}
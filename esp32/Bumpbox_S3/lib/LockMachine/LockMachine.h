@@ -0,0 +1,63 @@
+/*
+ * Lid switch debouncer and solenoid lock state machine, free of Arduino
+ * and FreeRTOS so it runs on the host (test/test_lock, env:native).
+ * lockTask feeds it switch edges, backend changes and the time, and
+ * drives the relay from its transitions.
+ *
+ *   IDLE --lid closed--> SETTLE --settleMs--> ENERGISED
+ *   SETTLE --lid lifted--> IDLE   (no lock pulse for a lid that bounced open)
+ *   ENERGISED --energisedMs--> RELEASE --releaseMs--> IDLE
+ *   any --backend ON--> HOLD --backend OFF--> RELEASE
+ *
+ * The relay is on in ENERGISED and HOLD. A backend unlock preempts a
+ * local cycle at once instead of after it. Timed transitions happen at
+ * the state's entry time plus its duration, not when the caller gets
+ * round to it, so a late wake-up doesn't stretch the next state.
+ */
+#pragma once
+
+#include <stdint.h>
+
+enum LockState { LOCK_IDLE, LOCK_SETTLE, LOCK_ENERGISED, LOCK_HOLD, LOCK_RELEASE };
+
+struct LockTiming {
+  uint32_t debounceMs;   // Switch level must hold this long to count
+  uint32_t settleMs;     // Lid closed → relay on
+  uint32_t energisedMs;  // Local lock pulse
+  uint32_t releaseMs;    // Relay off → ready for another cycle
+};
+
+// Called on every transition; at is when it took effect (ms)
+typedef void (*LockListener)(LockState from, LockState to, unsigned long at);
+
+struct LockMachine {
+  LockTiming timing;
+  LockListener listener;
+  LockState state;
+  unsigned long stateAt;      // Entry time of state (ms)
+  bool backendOn;
+  // Switch, as read from the pin (LOW = closed, lid down)
+  int steadyLevel;
+  int edgeLevel;              // Level after the last edge
+  unsigned long edgeAt;
+  bool debouncePending;       // Edge seen, level not yet steady for debounceMs
+};
+
+void lockBegin(LockMachine* m, const LockTiming& timing, LockListener listener, int switchLevel);
+
+// Switch edge at time at, with the level sampled then. Every edge
+// restarts the debounce window, even one that samples the level we
+// already have (the transition in between was missed).
+void lockSwitchEdge(LockMachine* m, unsigned long at, int level);
+
+// Backend solenoid state; returns false if it didn't change
+bool lockBackend(LockMachine* m, bool on, unsigned long now);
+
+// Debounced lid changes and timed transitions due by now
+void lockUpdate(LockMachine* m, unsigned long now);
+
+// ms until lockUpdate() has something to do, or -1 if only an input can
+// change anything
+long lockNextWakeMs(const LockMachine* m, unsigned long now);
+
+bool lockRelayOn(LockState state);
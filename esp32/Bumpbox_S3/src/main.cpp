@@ -2,6 +2,8 @@
 #include <WiFi.h>
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
+#include <WifiManager.h>  // esp32/lib: link manager shared with the camera
+#include <LockMachine.h>  // lib/: switch debounce + lock states (host-tested)
 
 // ====================== CONFIGURATION ======================
 const char* WIFI_SSID     = "Galaxy S23 Ultra E934";
@@ -9,54 +11,180 @@ const char* WIFI_PASSWORD = "passswoed";
 
 const char* SOLENOID_STATE_URL = "http://bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com/api/solenoid/state";
 // const char* SOLENOID_STATE_URL = "http://10.252.191.158:8080/api/solenoid/state";
+const char* SOLENOID_ACK_URL   = "http://bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com/api/solenoid/ack";
+const char* BACKEND_HOST    = "bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com";
+const uint16_t BACKEND_PORT = 80;
+const char* PUSH_PATH    = "/api/solenoid/stream";  // SSE solenoid state stream
+const char* NTP_SERVER_1 = "pool.ntp.org";          // Wall clock for unlock latency acks
+const char* NTP_SERVER_2 = "time.google.com";
 
 #define SWITCH_PIN     21    // Microswitch NO terminal
 #define RELAY_PIN      16    // Relay IN pin
 #define DEBOUNCE_MS    50    // Debounce time (ms)
 #define LID_DELAY_MS   500   // Wait for lid to fully settle on switch (ms)
 #define SOLENOID_ON_MS 2000  // How long solenoid stays active (ms)
-#define POLL_INTERVAL  5000  // Poll backend every 5 seconds
+#define RELEASE_MS     250   // After de-energising: let the plunger drop before another cycle (ms)
+#define POLL_INTERVAL  5000  // Poll backend every 5 seconds while the push stream is down
+#define RECONCILE_INTERVAL 60000 // Poll this often while it's up, in case an event was lost
+#define PUSH_CONNECT_MS 3000 // TCP connect timeout for the push stream
+#define PUSH_RETRY_MS  5000  // Reconnect interval while the push stream is down
+#define PUSH_IDLE_MS   45000 // Server pings every 15 s; silence this long = dead link
+#define NVS_NAMESPACE  "bumpbox"
+#define LOCK_CORE      1     // Switch + relay task (WiFi and HTTP run on loop())
+#define LOCK_STACK_SIZE 4096
 
 #define RELAY_ON  LOW
 #define RELAY_OFF HIGH
 
+#define SWITCH_RING    32    // Switch edges buffered between the ISR and lockTask (power of 2)
+
 // ====================== GLOBALS ======================
-int lastSteadyState      = HIGH;
-int lastFlickerableState = HIGH;
-int currentState;
-unsigned long lastDebounceTime = 0;
 unsigned long lastPollTime = 0;
-bool solenoidBackendOn = false;
+volatile bool solenoidBackendOn = false;  // Set by push/polling (loop), acted on by lockTask
+volatile uint32_t backendSeq = 0;         // Server's change counter for solenoidBackendOn
+volatile uint32_t appliedSeq = 0;         // lockTask: last backend change acted on...
+volatile unsigned long appliedAt = 0;     // ...and when (millis, relay edge)
+TaskHandle_t lockTaskHandle = NULL;
+
+// Push channel (SSE) state
+WiFiClient pushClient;
+bool pushReady = false;       // Headers OK, events flowing
+bool pushHeadersOk = false;
+unsigned long pushLastAttempt = 0;
+unsigned long pushLastData = 0;
+String pushLine;
+
+// ====================== BACKEND STATE ======================
+
+/*
+ * The backend pushes solenoid changes over a long-lived SSE stream, so an
+ * unlock after a Stripe checkout arrives in one network hop. Polling
+ * SOLENOID_STATE_URL is the fallback while the stream is down and an
+ * occasional reconciliation while it's up. Each change carries the
+ * server's seq; once lockTask has acted on it the controller acks it
+ * with the relay time, and the server logs the unlock latency.
+ */
+unsigned long backendChangedAt = 0;  // When the pending change was received (millis)
+uint32_t ackSeq = 0;                 // Change waiting to be acked, 0 = none
+
+// New backend state from push or poll: hand it to lockTask
+void applyBackendState(bool on, uint32_t seq, const char* via) {
+  if (on == solenoidBackendOn) return;
+  backendChangedAt = millis();
+  backendSeq = seq;  // Before the state, lockTask reads them the other way round
+  solenoidBackendOn = on;
+  xTaskNotifyGive(lockTaskHandle);
+  ackSeq = seq;
+  Serial.printf("[Backend] Solenoid state changed to: %s (%s)\n", on ? "ON" : "OFF", via);
+}
+
+// Tell the backend when the relay acted on the last change
+void sendSolenoidAck() {
+  if (!ackSeq || appliedSeq != ackSeq || !wifiLinkUp()) return;
+  unsigned long relayMillis = appliedAt;
+  int64_t wallMs = wallClockMs();
+  int64_t relayAt = wallMs ? wallMs - (int64_t)(millis() - relayMillis) : 0;
+
+  char body[96];
+  snprintf(body, sizeof(body), "{\"seq\":%u,\"relayAt\":%lld,\"eventToRelayMs\":%lu}",
+           (unsigned)ackSeq, (long long)relayAt, relayMillis - backendChangedAt);
+  ackSeq = 0;
+
+  HTTPClient http;
+  http.begin(SOLENOID_ACK_URL);
+  http.addHeader("Content-Type", "application/json");
+  http.setTimeout(2000);
+  http.POST(body);
+  http.end();
+}
+
+// HTTP/1.0 keeps the body free of chunked framing: just "data:" lines
+// and ": ping" heartbeats
+void connectPushChannel() {
+  pushLastAttempt = millis();
+  if (!pushClient.connect(BACKEND_HOST, BACKEND_PORT, PUSH_CONNECT_MS)) return;
+
+  pushClient.setNoDelay(true);
+  pushClient.printf("GET %s HTTP/1.0\r\n"
+                    "Host: %s\r\n"
+                    "Accept: text/event-stream\r\n\r\n",
+                    PUSH_PATH, BACKEND_HOST);
+  pushReady = false;
+  pushHeadersOk = false;
+  pushLastData = millis();
+  pushLine = "";
+}
+
+void closePushChannel(const char* reason) {
+  pushClient.stop();
+  if (pushReady) {
+    Serial.printf("[Push] Disconnected (%s) — falling back to polling\n", reason);
+    lastPollTime = millis() - POLL_INTERVAL - 1;  // Reconcile now
+  }
+  pushReady = false;
+}
+
+void handlePushLine(const String& line) {
+  if (!pushReady) {
+    if (line.startsWith("HTTP/")) {
+      pushHeadersOk = line.indexOf(" 200") > 0;
+    } else if (line.length() == 0) {
+      if (!pushHeadersOk) {
+        closePushChannel("bad status");
+        return;
+      }
+      pushReady = true;
+      Serial.println("[Push] Solenoid stream connected");
+    }
+    return;
+  }
+
+  if (!line.startsWith("data:")) return;  // ": ping" heartbeat etc.
 
-// ====================== WIFI ======================
-void connectWiFi() {
-  Serial.print("[WiFi] Connecting to ");
-  Serial.println(WIFI_SSID);
+  JsonDocument doc;
+  if (deserializeJson(doc, line.substring(5))) {
+    Serial.println("[Push] Bad event payload");
+    return;
+  }
+  applyBackendState(doc["solenoidOn"] | false, doc["seq"] | 0, "push");
+}
 
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+// Service the push stream (non-blocking)
+void checkPushChannel() {
+  if (!pushClient.connected()) {
+    if (pushReady) closePushChannel("socket closed");
+    if (millis() - pushLastAttempt > PUSH_RETRY_MS) connectPushChannel();
+    return;
+  }
 
-  unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    if (millis() - start > 15000) {
-      Serial.println("\n[WiFi] Connection timed out!");
-      return;
+  while (pushClient.available()) {
+    char c = pushClient.read();
+    pushLastData = millis();
+    if (c == '\n') {
+      if (pushLine.endsWith("\r")) pushLine.remove(pushLine.length() - 1);
+      handlePushLine(pushLine);
+      pushLine = "";
+    } else if (pushLine.length() < 256) {
+      pushLine += c;
     }
-    delay(500);
-    Serial.print(".");
   }
 
-  Serial.println();
-  Serial.print("[WiFi] Connected! IP: ");
-  Serial.println(WiFi.localIP());
+  if (millis() - pushLastData > PUSH_IDLE_MS) closePushChannel("heartbeat timeout");
+}
+
+// Link up: open the stream and reconcile now; link down: drop the stream
+void onBackendLinkChange(LinkEvent event) {
+  if (event == LINK_UP) {
+    pushLastAttempt = millis() - PUSH_RETRY_MS - 1;
+    lastPollTime = millis() - RECONCILE_INTERVAL - 1;
+  } else {
+    closePushChannel("WiFi down");
+  }
 }
 
 // ====================== POLLING ======================
 void checkSolenoidState() {
-  if (WiFi.status() != WL_CONNECTED) {
-    connectWiFi();
-    return;
-  }
+  if (!wifiLinkUp()) return;  // wifiService() is reconnecting
 
   HTTPClient http;
   http.begin(SOLENOID_STATE_URL);
@@ -65,23 +193,11 @@ void checkSolenoidState() {
   int httpCode = http.GET();
   if (httpCode == 200) {
     String payload = http.getString();
-    StaticJsonDocument<128> doc;
+    JsonDocument doc;
     DeserializationError error = deserializeJson(doc, payload);
 
     if (!error) {
-      bool newState = doc["solenoidOn"] | false;
-      if (newState != solenoidBackendOn) {
-        solenoidBackendOn = newState;
-        Serial.printf("[Backend] Solenoid state changed to: %s\n", solenoidBackendOn ? "ON" : "OFF");
-        
-        if (solenoidBackendOn) {
-          Serial.println("[Action] Activating solenoid from backend trigger...");
-          digitalWrite(RELAY_PIN, RELAY_ON);
-        } else {
-          Serial.println("[Action] Deactivating solenoid from backend trigger...");
-          digitalWrite(RELAY_PIN, RELAY_OFF);
-        }
-      }
+      applyBackendState(doc["solenoidOn"] | false, doc["seq"] | 0, "poll");
     }
   } else {
     Serial.printf("[HTTP] GET failed, error: %s\n", http.errorToString(httpCode).c_str());
@@ -89,6 +205,108 @@ void checkSolenoidState() {
   http.end();
 }
 
+// ====================== LOCK STATE MACHINE ======================
+
+// Debounce and lock states live in lib/LockMachine (unit-tested on the
+// host, test/test_lock); lockTask owns the instance and the relay.
+LockMachine lock;
+
+// Log each transition and drive the relay for the state entered
+void onLockTransition(LockState from, LockState to, unsigned long at) {
+  switch (to) {
+    case LOCK_SETTLE:
+      Serial.println("Switch closed — waiting for lid to settle...");
+      break;
+    case LOCK_IDLE:
+      if (from == LOCK_SETTLE) Serial.println("Lid lifted before it settled — not locking.");
+      break;
+    case LOCK_ENERGISED:
+      Serial.println("Activating solenoid (Local)...");
+      break;
+    case LOCK_HOLD:
+      Serial.println("[Action] Activating solenoid from backend trigger...");
+      break;
+    case LOCK_RELEASE:
+      Serial.println(from == LOCK_HOLD ? "[Action] Deactivating solenoid from backend trigger..."
+                                       : "Solenoid deactivated (Local).");
+      break;
+  }
+  digitalWrite(RELAY_PIN, lockRelayOn(to) ? RELAY_ON : RELAY_OFF);
+}
+
+// ====================== SWITCH INPUT ======================
+
+/*
+ * The microswitch interrupts on every edge. The ISR timestamps the edge
+ * into a single-producer/single-consumer ring and wakes lockTask, which
+ * debounces from those timestamps, so lid detection doesn't depend on
+ * how often anything polls and the task sleeps between events. If the
+ * ring overflows (a badly chattering contact), the task resyncs from
+ * the pin.
+ */
+struct SwitchEdge {
+  unsigned long at;  // millis()
+  uint8_t level;
+};
+
+SwitchEdge switchRing[SWITCH_RING];
+volatile uint32_t switchHead = 0;  // Written by the ISR only
+volatile uint32_t switchTail = 0;  // Written by lockTask only
+volatile bool switchOverflow = false;
+
+void IRAM_ATTR onSwitchEdge() {
+  uint32_t head = switchHead;
+  if (head - switchTail == SWITCH_RING) {
+    switchOverflow = true;
+  } else {
+    switchRing[head % SWITCH_RING] = { millis(), (uint8_t)digitalRead(SWITCH_PIN) };
+    __sync_synchronize();   // Slot stores land before the head that publishes them
+    switchHead = head + 1;
+  }
+
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(lockTaskHandle, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+// Drain the ring into the debouncer; the edge time, not the wake-up
+// time, decides when the level counts as steady
+void readSwitchEdges() {
+  while (switchTail != switchHead) {
+    __sync_synchronize();  // Read the slot only after seeing the head that published it
+    SwitchEdge edge = switchRing[switchTail % SWITCH_RING];
+    switchTail = switchTail + 1;
+    lockSwitchEdge(&lock, edge.at, edge.level);
+  }
+  if (switchOverflow) {
+    switchOverflow = false;
+    lockSwitchEdge(&lock, millis(), digitalRead(SWITCH_PIN));
+  }
+}
+
+// Switch + relay, off loop() so a slow backend poll can't hold the relay
+// past its deadline. Highest priority on its core; sleeps until a switch
+// edge, a backend change or the next debounce/lock deadline.
+void lockTask(void* param) {
+  const LockTiming timing = { DEBOUNCE_MS, LID_DELAY_MS, SOLENOID_ON_MS, RELEASE_MS };
+  lockBegin(&lock, timing, onLockTransition, digitalRead(SWITCH_PIN));
+  attachInterrupt(digitalPinToInterrupt(SWITCH_PIN), onSwitchEdge, CHANGE);
+
+  for (;;) {
+    readSwitchEdges();
+    unsigned long now = millis();  // After the drain: no edge is stamped later than now
+
+    if (lockBackend(&lock, solenoidBackendOn, now)) {
+      appliedAt = now;
+      appliedSeq = backendSeq;  // After appliedAt: loop reads them the other way round
+    }
+    lockUpdate(&lock, now);
+
+    long wait = lockNextWakeMs(&lock, now);
+    ulTaskNotifyTake(pdTRUE, wait < 0 ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+  }
+}
+
 // ====================== SETUP & LOOP ======================
 void setup() {
   Serial.begin(115200);
@@ -96,43 +314,24 @@ void setup() {
   pinMode(RELAY_PIN, OUTPUT);
   digitalWrite(RELAY_PIN, RELAY_OFF); // Solenoid OFF at boot
 
-  connectWiFi();
-  Serial.println("[Ready] Monitoring switch and polling backend...");
+  xTaskCreatePinnedToCore(lockTask, "lock", LOCK_STACK_SIZE, NULL, 2, &lockTaskHandle, LOCK_CORE);
+
+  onLinkChange(onBackendLinkChange);
+  wifiBegin(WIFI_SSID, WIFI_PASSWORD, NVS_NAMESPACE, NTP_SERVER_1, NTP_SERVER_2);  // Connects in the background; the switch works offline
+  Serial.println("[Ready] Monitoring switch, listening for backend state (polling as fallback)...");
 }
 
 void loop() {
-  // 1. Backend Polling
-  if (millis() - lastPollTime > POLL_INTERVAL) {
-    lastPollTime = millis();
-    checkSolenoidState();
-  }
+  wifiService();
 
-  // 2. Physical Switch Logic (Local Override/Trigger)
-  currentState = digitalRead(SWITCH_PIN);
+  if (wifiLinkUp()) checkPushChannel();
 
-  if (currentState != lastFlickerableState) {
-    lastDebounceTime = millis();
-    lastFlickerableState = currentState;
-  }
-
-  if ((millis() - lastDebounceTime) > DEBOUNCE_MS) {
-    // Switch CLOSED → lid pressed down (HIGH → LOW)
-    if (lastSteadyState == HIGH && currentState == LOW) {
-      Serial.println("Switch closed — waiting for lid to settle...");
-      delay(LID_DELAY_MS);
-
-      Serial.println("Activating solenoid (Local)...");
-      digitalWrite(RELAY_PIN, RELAY_ON);   // Solenoid ON
-      delay(SOLENOID_ON_MS);               // Hold for 2 seconds
-      
-      // Return to backend state if it was OFF
-      if (!solenoidBackendOn) {
-        digitalWrite(RELAY_PIN, RELAY_OFF);
-        Serial.println("Solenoid deactivated (Local).");
-      } else {
-        Serial.println("Solenoid remains ON (Backend active).");
-      }
-    }
-    lastSteadyState = currentState;
+  // Backend polling: fallback while the stream is down, reconciliation
+  // while it's up (switch and relay run in lockTask)
+  if (millis() - lastPollTime > (pushReady ? RECONCILE_INTERVAL : POLL_INTERVAL)) {
+    lastPollTime = millis();
+    checkSolenoidState();
   }
+  sendSolenoidAck();
+  delay(2);  // Bounds push event latency; the core idles the rest
 }
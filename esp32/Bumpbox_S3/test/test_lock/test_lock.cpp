@@ -0,0 +1,181 @@
+/*
+ * Host tests for lib/LockMachine: replays switch and backend traces
+ * through the same loop lockTask runs and checks relay edges to the ms.
+ *
+ *   pio test -e native
+ */
+#include <unity.h>
+#include <LockMachine.h>
+#include <limits.h>
+#include <vector>
+
+// Same values as main.cpp's CONFIGURATION
+static const LockTiming TIMING = { 50, 500, 2000, 250 };  // debounce, settle, energised, release
+static const int HIGH = 1, LOW = 0;                       // Switch open / closed (lid down)
+
+struct Event {
+  unsigned long at;
+  bool backend;  // false: switch edge, value = level sampled by the ISR
+  int value;     // true: backend solenoid state
+};
+
+struct RelayEdge {
+  unsigned long at;
+  bool on;
+};
+
+static LockMachine m;
+static unsigned long T;                  // Simulated millis()
+static bool relayOn;
+static std::vector<RelayEdge> relay;     // When lockTask drove the relay pin
+static std::vector<unsigned long> transitionAt;
+
+static void onTransition(LockState, LockState to, unsigned long at) {
+  transitionAt.push_back(at);
+  if (lockRelayOn(to) != relayOn) {
+    relayOn = !relayOn;
+    relay.push_back({ T, relayOn });
+  }
+}
+
+void setUp() {
+  T = 0;
+  relayOn = false;
+  relay.clear();
+  transitionAt.clear();
+  lockBegin(&m, TIMING, onTransition, HIGH);
+}
+
+void tearDown() {}
+
+// lockTask's loop: wakes on every event (the ISR / backend notify) and
+// on the deadline lockNextWakeMs() asks for, until `until`
+static void replay(const std::vector<Event>& events, unsigned long until) {
+  size_t i = 0;
+  bool backendOn = false;
+  for (;;) {
+    for (; i < events.size() && events[i].at <= T; i++) {
+      if (events[i].backend) backendOn = events[i].value;
+      else lockSwitchEdge(&m, events[i].at, events[i].value);
+    }
+    lockBackend(&m, backendOn, T);
+    lockUpdate(&m, T);
+
+    long wait = lockNextWakeMs(&m, T);
+    unsigned long next = wait < 0 ? ULONG_MAX : T + wait;
+    if (i < events.size() && events[i].at < next) next = events[i].at;
+    if (next > until) break;
+    T = next;
+  }
+}
+
+static void assertRelay(const std::vector<RelayEdge>& expected) {
+  TEST_ASSERT_EQUAL_size_t(expected.size(), relay.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT32(expected[i].at, relay[i].at);
+    TEST_ASSERT_EQUAL(expected[i].on, relay[i].on);
+  }
+}
+
+// Bouncy close: steady 50 ms after the last bounce, relay 500 ms later
+// for 2000 ms, then a 250 ms release before the next cycle
+void test_lid_close_pulses_relay() {
+  replay({ { 1000, false, LOW }, { 1003, false, HIGH }, { 1007, false, LOW } }, 10000);
+  assertRelay({ { 1557, true }, { 3557, false } });
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_UINT32(3807, m.stateAt);
+}
+
+void test_bounce_back_is_no_change() {
+  replay({ { 1000, false, LOW }, { 1020, false, HIGH } }, 10000);
+  assertRelay({});
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_size_t(0, transitionAt.size());
+}
+
+void test_lid_lifted_while_settling_does_not_lock() {
+  replay({ { 1000, false, LOW }, { 1300, false, HIGH } }, 10000);
+  assertRelay({});
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_UINT32(1350, m.stateAt);
+}
+
+// An edge that samples the level we already have (the ISR missed the
+// transition in between) still restarts the debounce window
+void test_same_level_edge_restarts_debounce() {
+  replay({ { 1000, false, LOW }, { 1040, false, LOW } }, 10000);
+  assertRelay({ { 1590, true }, { 3590, false } });
+}
+
+void test_backend_unlock_preempts_settle() {
+  replay({ { 1000, false, LOW }, { 1200, true, 1 }, { 4000, true, 0 } }, 10000);
+  assertRelay({ { 1200, true }, { 4000, false } });
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_UINT32(4250, m.stateAt);
+}
+
+void test_backend_on_during_local_pulse_holds() {
+  replay({ { 1000, false, LOW }, { 2000, true, 1 }, { 6000, true, 0 } }, 10000);
+  assertRelay({ { 1550, true }, { 6000, false } });
+}
+
+void test_backend_hold_and_release() {
+  replay({ { 500, true, 1 }, { 900, true, 0 } }, 5000);
+  assertRelay({ { 500, true }, { 900, false } });
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_UINT32(1150, m.stateAt);
+}
+
+// A late wake-up runs every overdue transition at its own deadline
+void test_late_update_keeps_deadlines() {
+  lockSwitchEdge(&m, 1000, LOW);
+  lockUpdate(&m, 9000);
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_size_t(4, transitionAt.size());
+  TEST_ASSERT_EQUAL_UINT32(1050, transitionAt[0]);  // SETTLE
+  TEST_ASSERT_EQUAL_UINT32(1550, transitionAt[1]);  // ENERGISED
+  TEST_ASSERT_EQUAL_UINT32(3550, transitionAt[2]);  // RELEASE
+  TEST_ASSERT_EQUAL_UINT32(3800, transitionAt[3]);  // IDLE
+}
+
+// An edge the ISR stamped after lockTask read millis() is not overdue:
+// it waits out its debounce window like any other, and the relay pulse
+// keeps its full length
+void test_edge_stamped_after_now() {
+  lockSwitchEdge(&m, 1001, LOW);
+  T = 1000;
+  lockUpdate(&m, T);
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+  TEST_ASSERT_EQUAL_size_t(0, transitionAt.size());
+  TEST_ASSERT_EQUAL(51, lockNextWakeMs(&m, T));
+
+  replay({}, 10000);
+  assertRelay({ { 1551, true }, { 3551, false } });
+  TEST_ASSERT_EQUAL(LOCK_IDLE, m.state);
+}
+
+void test_next_wake() {
+  TEST_ASSERT_EQUAL(-1, lockNextWakeMs(&m, 0));
+  lockSwitchEdge(&m, 1000, LOW);
+  TEST_ASSERT_EQUAL(50, lockNextWakeMs(&m, 1000));
+  TEST_ASSERT_EQUAL(0, lockNextWakeMs(&m, 1080));  // Overdue: wake now
+  lockUpdate(&m, 1050);
+  TEST_ASSERT_EQUAL(LOCK_SETTLE, m.state);
+  TEST_ASSERT_EQUAL(500, lockNextWakeMs(&m, 1050));
+  TEST_ASSERT_EQUAL(300, lockNextWakeMs(&m, 1250));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_lid_close_pulses_relay);
+  RUN_TEST(test_bounce_back_is_no_change);
+  RUN_TEST(test_lid_lifted_while_settling_does_not_lock);
+  RUN_TEST(test_same_level_edge_restarts_debounce);
+  RUN_TEST(test_backend_unlock_preempts_settle);
+  RUN_TEST(test_backend_on_during_local_pulse_holds);
+  RUN_TEST(test_backend_hold_and_release);
+  RUN_TEST(test_late_update_keeps_deadlines);
+  RUN_TEST(test_edge_stamped_after_now);
+  RUN_TEST(test_next_wake);
+  return UNITY_END();
+}
@@ -0,0 +1,73 @@
+#include "FrameAnalysis.h"
+
+uint32_t gradientEnergy(const uint8_t* luma, int width, int height) {
+  if (width < 2 || height < 2) return 0;
+
+  uint64_t sum = 0;
+  for (int y = 0; y < height - 1; y++) {
+    const uint8_t* row  = luma + y * width;
+    const uint8_t* next = row + width;
+    for (int x = 0; x < width - 1; x++) {
+      int dx = row[x + 1] - row[x];
+      int dy = next[x] - row[x];
+      sum += dx * dx + dy * dy;
+    }
+  }
+  return sum / ((uint32_t)(width - 1) * (height - 1));
+}
+
+bool differenceHash(const uint8_t* luma, int width, int height, uint64_t* hash) {
+  if (width < 9 || height < 8) return false;
+
+  uint32_t grid[8][9];
+  for (int gy = 0; gy < 8; gy++) {
+    for (int gx = 0; gx < 9; gx++) {
+      int x0 = gx * width / 9,  x1 = (gx + 1) * width / 9;
+      int y0 = gy * height / 8, y1 = (gy + 1) * height / 8;
+      uint32_t sum = 0;
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) sum += luma[y * width + x];
+      }
+      grid[gy][gx] = sum / ((x1 - x0) * (y1 - y0));
+    }
+  }
+
+  uint64_t h = 0;
+  for (int gy = 0; gy < 8; gy++) {
+    for (int gx = 0; gx < 8; gx++) {
+      h = (h << 1) | (grid[gy][gx] > grid[gy][gx + 1] ? 1 : 0);
+    }
+  }
+  *hash = h;
+  return true;
+}
+
+void downscaleBgr(const uint8_t* bgr, int width, int height, int factor, uint8_t* out, int channels) {
+  int outW = width / factor;
+  int outH = height / factor;
+  uint32_t area = factor * factor;
+
+  for (int oy = 0; oy < outH; oy++) {
+    for (int ox = 0; ox < outW; ox++) {
+      uint32_t b = area / 2, g = area / 2, r = area / 2;  // Round to nearest
+      for (int y = 0; y < factor; y++) {
+        const uint8_t* px = bgr + ((oy * factor + y) * width + ox * factor) * 3;
+        for (int x = 0; x < factor; x++, px += 3) {
+          b += px[0];
+          g += px[1];
+          r += px[2];
+        }
+      }
+      b /= area;
+      g /= area;
+      r /= area;
+      if (channels == 3) {
+        *out++ = b;
+        *out++ = g;
+        *out++ = r;
+      } else {
+        *out++ = (r + 2 * g + b) >> 2;
+      }
+    }
+  }
+}
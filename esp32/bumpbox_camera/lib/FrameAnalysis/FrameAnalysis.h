@@ -0,0 +1,41 @@
+/*
+ * Scoring kernels over a decimated luma plane (one byte per pixel,
+ * row-major), as main.cpp decodes it straight from the JPEG: sharpness
+ * for burst selection and a difference hash for change detection. Plus
+ * the box downscale that derives such planes from pixels an upload has
+ * already decoded. Plain C++, host-tested and benchmarked in
+ * test/test_frame_analysis (env:native).
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Burst scoring: mean squared gradient (Tenengrad-style), the mean of
+ * dx² + dy² over the plane. Blur and half-lit frames score low. 0 for a
+ * plane smaller than 2x2.
+ */
+uint32_t gradientEnergy(const uint8_t* luma, int width, int height);
+
+/*
+ * Change detection: 64-bit difference hash. The plane is box-averaged
+ * down to a 9x8 grid and each bit records whether a cell is brighter
+ * than its right neighbour. Robust to small exposure shifts; a few bits
+ * flip for noise, many for a different item. false for a plane smaller
+ * than the grid.
+ */
+bool differenceHash(const uint8_t* luma, int width, int height, uint64_t* hash);
+
+/*
+ * Box-average a BGR888 image down by factor: each output pixel is the
+ * rounded mean of a factor x factor block, as a 1/factor JPEG decode
+ * gives. out is (width / factor) x (height / factor), BGR888 for
+ * channels 3 or luma, (R + 2G + B) / 4, for channels 1. Edge pixels
+ * that don't fill a whole block are dropped.
+ */
+void downscaleBgr(const uint8_t* bgr, int width, int height, int factor, uint8_t* out, int channels);
+
+// Bits that differ between two hashes (0-64)
+inline int hashDistance(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
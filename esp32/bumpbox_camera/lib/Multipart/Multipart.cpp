@@ -0,0 +1,52 @@
+#include "Multipart.h"
+
+#include <string.h>
+
+bool MultipartBody::add(const uint8_t* data, size_t len) {
+  if (segCount == MAX_SEGMENTS) return false;
+  segs[segCount]  = data;
+  sizes[segCount] = len;
+  segCount++;
+  total += len;
+  return true;
+}
+
+bool MultipartBody::add(const char* s) {
+  return add((const uint8_t*)s, strlen(s));
+}
+
+int MultipartBody::peek() const {
+  if (pos >= total) return -1;
+  uint8_t b;
+  copyAt(pos, &b, 1);
+  return b;
+}
+
+int MultipartBody::read() {
+  int b = peek();
+  if (b >= 0) pos++;
+  return b;
+}
+
+size_t MultipartBody::read(uint8_t* out, size_t len) {
+  size_t n = copyAt(pos, out, len);
+  pos += n;
+  return n;
+}
+
+// Copy up to len bytes starting at body offset `at`, crossing segments
+size_t MultipartBody::copyAt(size_t at, uint8_t* out, size_t len) const {
+  size_t copied = 0;
+  for (int i = 0; i < segCount && copied < len; i++) {
+    if (at >= sizes[i]) {
+      at -= sizes[i];
+      continue;
+    }
+    size_t n = sizes[i] - at;
+    if (n > len - copied) n = len - copied;
+    memcpy(out + copied, segs[i] + at, n);
+    copied += n;
+    at = 0;
+  }
+  return copied;
+}
@@ -0,0 +1,58 @@
+/*
+ * Multipart/form-data framing for image uploads, and a cursor over a
+ * body made of referenced segments (preamble, JPEG, trailer, or several
+ * parts for a batch). main.cpp's MultipartBodyStream wraps it as the
+ * Stream HTTPClient pulls from, so each JPEG goes onto the socket
+ * straight from its frame buffer. Plain C++, host-tested in
+ * test/test_multipart (env:native).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MULTIPART_BOUNDARY "----BumpBoxESP32Boundary"
+
+// Part header for a JPEG in form field `field` (a string literal)
+#define MULTIPART_JPEG_HEAD(field)                                          \
+  "--" MULTIPART_BOUNDARY "\r\n"                                            \
+  "Content-Disposition: form-data; name=\"" field "\"; filename=\"capture.jpg\"\r\n" \
+  "Content-Type: image/jpeg\r\n\r\n"
+
+// Between two parts, and after the last one
+#define MULTIPART_SEPARATOR "\r\n"
+#define MULTIPART_TAIL "\r\n--" MULTIPART_BOUNDARY "--\r\n"
+
+/*
+ * Segments are referenced, not copied: they must outlive the body.
+ */
+class MultipartBody {
+public:
+  static const int MAX_SEGMENTS = 16;  // Batch: (part head, JPEG) per frame + tail
+
+  MultipartBody() : segCount(0), total(0), pos(0) {}
+
+  // False (and nothing added) once MAX_SEGMENTS are in
+  bool add(const uint8_t* data, size_t len);
+  bool add(const char* s);
+
+  size_t size() const { return total; }
+  size_t position() const { return pos; }
+  size_t available() const { return total - pos; }
+
+  // Next byte without consuming it, or -1 at the end
+  int peek() const;
+  int read();
+
+  // Up to len bytes, crossing segments; returns the count (0 at the end)
+  size_t read(uint8_t* out, size_t len);
+
+private:
+  const uint8_t* segs[MAX_SEGMENTS];
+  size_t sizes[MAX_SEGMENTS];
+  int segCount;
+  size_t total;
+  size_t pos;
+
+  size_t copyAt(size_t at, uint8_t* out, size_t len) const;
+};
@@ -0,0 +1,37 @@
+#include "Preclassifier.h"
+
+#include <math.h>
+
+void preclassFillInput(const uint8_t* bgr, int srcW, int srcH,
+                       int8_t* input, int inW, int inH, int inC, PreclassQuant q) {
+  // One quantized value per byte value, instead of a divide and a round
+  // per input element
+  int8_t lut[256];
+  for (int v = 0; v < 256; v++) {
+    long n = lroundf(v / 255.0f / q.scale) + q.zeroPoint;
+    lut[v] = (int8_t)(n < -128 ? -128 : n > 127 ? 127 : n);
+  }
+
+  for (int y = 0; y < inH; y++) {
+    const uint8_t* row = bgr + (y * srcH / inH) * srcW * 3;
+    for (int x = 0; x < inW; x++) {
+      const uint8_t* px = row + (x * srcW / inW) * 3;
+      if (inC == 1) {
+        *input++ = lut[(px[2] + 2 * px[1] + px[0]) >> 2];
+      } else {
+        *input++ = lut[px[2]];
+        *input++ = lut[px[1]];
+        *input++ = lut[px[0]];
+      }
+    }
+  }
+}
+
+int preclassBest(const int8_t* scores, int count, PreclassQuant q, float* confidence) {
+  int best = 0;
+  for (int i = 1; i < count; i++) {
+    if (scores[i] > scores[best]) best = i;
+  }
+  *confidence = (scores[best] - q.zeroPoint) * q.scale;
+  return best;
+}
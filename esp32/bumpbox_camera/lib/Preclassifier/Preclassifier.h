@@ -0,0 +1,31 @@
+/*
+ * The pre-classifier's own side of inference: filling the model's int8
+ * input from a decoded frame and reading the winning label back out.
+ * The model itself runs in TFLite Micro (main.cpp, BUMPBOX_PRECLASSIFIER
+ * builds). Plain C++, host-tested and benchmarked in test/test_preclassifier
+ * (env:native).
+ *
+ * Input contract (esp32/README.md): each channel is normalised to [0,1]
+ * as v / 255, then quantized with the input tensor's scale and zero
+ * point. RGB inputs get R, G, B in that order; a one-channel input gets
+ * luma, (R + 2G + B) / 4.
+ */
+#pragma once
+
+#include <stdint.h>
+
+// A tensor's affine int8 quantization: real = (q - zeroPoint) * scale
+struct PreclassQuant {
+  float scale;
+  int zeroPoint;
+};
+
+/*
+ * Nearest-neighbour scale of a srcW x srcH BGR888 frame (as esp_jpg_decode
+ * writes it) into an NHWC int8 input of inW x inH x inC, inC 1 or 3.
+ */
+void preclassFillInput(const uint8_t* bgr, int srcW, int srcH,
+                       int8_t* input, int inW, int inH, int inC, PreclassQuant q);
+
+// Index of the highest of count int8 scores, and its real value
+int preclassBest(const int8_t* scores, int count, PreclassQuant q, float* confidence);
@@ -0,0 +1,196 @@
+#include "Spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPOOL_PATH_MAX 48
+
+int64_t spoolAgeMs(const SpoolStamp& then, const SpoolStamp& now) {
+  if (then.bootId == now.bootId) return (uint32_t)(now.capturedMs - then.capturedMs);
+  if (then.capturedWallMs && now.capturedWallMs && now.capturedWallMs >= then.capturedWallMs) {
+    return now.capturedWallMs - then.capturedWallMs;
+  }
+  return -1;
+}
+
+void Spool::path(uint32_t seq, char* out, size_t len) const {
+  snprintf(out, len, "%s/%08lu.cap", dir, (unsigned long)seq);
+}
+
+struct ListState {
+  Spool* spool;
+  SpoolFs* fs;
+  const char* dir;
+  bool any;
+};
+
+void Spool::onListed(void* ctx, const char* name, size_t size) {
+  ListState* state = (ListState*)ctx;
+  Spool* s = state->spool;
+
+  char* end;
+  uint32_t seq = strtoul(name, &end, 10);
+  if (end == name || strcmp(end, ".cap") != 0) {  // Leftover temp file from a power cut
+    char stray[SPOOL_PATH_MAX];
+    snprintf(stray, sizeof(stray), "%s/%s", state->dir, name);
+    state->fs->remove(stray);
+    return;
+  }
+  if (!state->any || seq < s->headSeq) s->headSeq = seq;
+  if (!state->any || seq >= s->tailSeq) s->tailSeq = seq + 1;
+  state->any = true;
+  s->entries++;
+  s->used += size;
+}
+
+void Spool::begin() {
+  headSeq = tailSeq = entries = 0;
+  used = 0;
+  fs.mkdir(dir);
+
+  ListState state = { this, &fs, dir, false };
+  fs.list(dir, onListed, &state);
+  isReady = true;
+}
+
+// Step head over numbers with no file (a write that failed)
+void Spool::skipGaps() {
+  char p[SPOOL_PATH_MAX];
+  for (; headSeq < tailSeq; headSeq++) {
+    path(headSeq, p, sizeof(p));
+    if (fs.exists(p)) break;
+  }
+  if (headSeq == tailSeq) {
+    entries = 0;
+    used = 0;
+  }
+}
+
+// Delete the oldest entry
+void Spool::pop() {
+  skipGaps();
+  if (!entries) return;
+
+  char p[SPOOL_PATH_MAX];
+  path(headSeq++, p, sizeof(p));
+  long size = fs.size(p);
+  fs.remove(p);
+  entries--;
+  used -= size > 0 && (size_t)size < used ? (size_t)size : used;
+  if (!entries) used = 0;
+}
+
+void Spool::drop(SpoolDrop why) {
+  skipGaps();
+  if (!entries) return;
+  if (onDrop) onDrop(why, headSeq);
+  pop();
+}
+
+bool Spool::push(const SpoolStamp& stamp, uint16_t width, uint16_t height, const uint8_t* jpg, size_t len) {
+  if (!isReady) return false;
+
+  size_t size = sizeof(SpoolHeader) + len;
+  if (size > maxBytes) return false;
+  while (entries && (entries >= maxFiles ||
+                     used + size > maxBytes ||
+                     fs.usedBytes() + size + SPOOL_FS_RESERVE > fs.totalBytes())) {
+    drop(SPOOL_EVICTED);
+  }
+  if (!entries) headSeq = tailSeq;
+
+  SpoolHeader header;
+  memset(&header, 0, sizeof(header));  // No stray padding bytes on flash
+  header.magic = SPOOL_MAGIC;
+  header.len = (uint32_t)len;
+  header.stamp = stamp;
+  header.width = width;
+  header.height = height;
+  char p[SPOOL_PATH_MAX], tmp[SPOOL_PATH_MAX + 4];
+  path(tailSeq, p, sizeof(p));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", p);
+  if (!fs.write(tmp, (const uint8_t*)&header, sizeof(header), jpg, len) || !fs.rename(tmp, p)) {
+    fs.remove(tmp);
+    return false;
+  }
+
+  tailSeq++;
+  entries++;
+  used += size;
+  return true;
+}
+
+// Read entry seq; a missing, short or foreign file is unreadable
+bool Spool::load(uint32_t seq, SpoolEntry* entry) {
+  char p[SPOOL_PATH_MAX];
+  path(seq, p, sizeof(p));
+  long size = fs.size(p);
+
+  entry->seq = seq;
+  entry->jpg = NULL;
+  SpoolHeader& h = entry->header;
+  bool valid = size >= (long)sizeof(h) &&
+               fs.read(p, 0, (uint8_t*)&h, sizeof(h)) == sizeof(h) &&
+               h.magic == SPOOL_MAGIC &&
+               h.len == (size_t)size - sizeof(h) &&
+               (entry->jpg = (uint8_t*)malloc(h.len ? h.len : 1)) != NULL &&
+               fs.read(p, sizeof(h), entry->jpg, h.len) == h.len;
+  if (!valid) {
+    free(entry->jpg);
+    entry->jpg = NULL;
+  }
+  return valid;
+}
+
+bool Spool::drainOne(SpoolSender send, void* ctx) {
+  skipGaps();
+  if (!entries) return true;
+
+  SpoolEntry entry;
+  if (!load(headSeq, &entry)) {
+    drop(SPOOL_UNREADABLE);
+    return true;
+  }
+
+  SpoolResult result = send(ctx, &entry, 1);
+  free(entry.jpg);
+
+  if (result == SPOOL_RETRY) return false;
+  if (result == SPOOL_REJECTED) drop(SPOOL_DROPPED_REJECTED);
+  else pop();
+  return true;
+}
+
+bool Spool::drainBatch(int maxFrames, size_t maxBatchBytes, SpoolSender send, void* ctx) {
+  skipGaps();
+  if (entries < 2 || maxFrames < 2) return drainOne(send, ctx);
+
+  SpoolEntry* batch = (SpoolEntry*)malloc(maxFrames * sizeof(SpoolEntry));
+  if (!batch) return drainOne(send, ctx);
+
+  int count = 0;
+  size_t bytes = 0;
+  for (uint32_t seq = headSeq; seq < tailSeq && count < maxFrames; seq++) {
+    if (!load(seq, &batch[count])) break;  // Gap or bad entry: stop the batch here
+    if (count && bytes + batch[count].header.len > maxBatchBytes) {
+      free(batch[count].jpg);
+      break;
+    }
+    bytes += batch[count].header.len;
+    count++;
+  }
+
+  SpoolResult result = SPOOL_RETRY;
+  if (count > 1) result = send(ctx, batch, count);
+  for (int i = 0; i < count; i++) free(batch[i].jpg);
+  free(batch);
+
+  if (count < 2) return drainOne(send, ctx);
+  if (result == SPOOL_RETRY) return false;
+  for (int i = 0; i < count; i++) {
+    if (result == SPOOL_REJECTED) drop(SPOOL_DROPPED_REJECTED);
+    else pop();
+  }
+  return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * Offline store-and-forward queue for frames the network couldn't take.
+ * Entries are files numbered head..tail-1 in one directory, each a
+ * SpoolHeader followed by the JPEG, written to a temp name and renamed
+ * so a power cut never leaves a half-written entry in the queue. Space
+ * is bounded by a file count and a byte budget; the oldest entry is
+ * evicted first. Entries drain oldest-first.
+ *
+ * Plain C++ over the small SpoolFs interface: main.cpp backs it with
+ * LittleFS, test/test_spool (env:native) with an in-memory filesystem
+ * that can lose power and corrupt files. Not thread-safe; main.cpp
+ * only touches it from the upload task.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPOOL_MAGIC 0x32505342   // "BSP2" (BSP1 entries had no boot ID or wall clock)
+#define SPOOL_FS_RESERVE 8192    // Flash left free for the filesystem's own blocks
+
+// When a frame was taken. Uptime means nothing once the camera has
+// restarted, so it is kept with the boot it counts from and, if SNTP had
+// synced, the wall clock.
+struct SpoolStamp {
+  uint32_t bootId;         // Random per boot
+  uint32_t capturedMs;     // millis() at capture, in that boot
+  int64_t capturedWallMs;  // Epoch ms at capture, or 0 if the clock wasn't set
+};
+
+// Age in ms of a frame stamped then, as of now; -1 if it can't be told
+// (taken in an earlier boot, and one of the two has no wall clock)
+int64_t spoolAgeMs(const SpoolStamp& then, const SpoolStamp& now);
+
+struct SpoolHeader {
+  uint32_t magic;
+  uint32_t len;          // JPEG bytes after the header
+  SpoolStamp stamp;
+  uint16_t width;
+  uint16_t height;
+};
+
+// The filesystem calls Spool needs. Paths are absolute.
+class SpoolFs {
+public:
+  virtual ~SpoolFs() {}
+
+  typedef void (*ListFn)(void* ctx, const char* name, size_t size);
+
+  virtual bool mkdir(const char* dir) = 0;
+  // fn for every file in dir, with its name (no directory part)
+  virtual void list(const char* dir, ListFn fn, void* ctx) = 0;
+  virtual bool exists(const char* path) = 0;
+  // Bytes in path, or -1 if it can't be opened
+  virtual long size(const char* path) = 0;
+  virtual bool remove(const char* path) = 0;
+  virtual bool rename(const char* from, const char* to) = 0;
+  // Create or truncate path and write head then data; false on a short write
+  virtual bool write(const char* path, const uint8_t* head, size_t headLen,
+                     const uint8_t* data, size_t dataLen) = 0;
+  // Up to len bytes from offset; returns the count read
+  virtual size_t read(const char* path, size_t offset, uint8_t* out, size_t len) = 0;
+  virtual size_t usedBytes() = 0;
+  virtual size_t totalBytes() = 0;
+};
+
+// Entry handed to a SpoolSender; jpg is malloc'd and freed by Spool
+struct SpoolEntry {
+  uint32_t seq;
+  SpoolHeader header;
+  uint8_t* jpg;
+};
+
+enum SpoolResult {
+  SPOOL_SENT,      // Server took it: entry removed
+  SPOOL_RETRY,     // Network or server-side failure: entry kept
+  SPOOL_REJECTED   // Server refused it for good: entry removed
+};
+
+// Upload count entries (oldest first) as one request
+typedef SpoolResult (*SpoolSender)(void* ctx, const SpoolEntry* entries, int count);
+
+// Entries dropped without reaching the server
+enum SpoolDrop { SPOOL_EVICTED, SPOOL_UNREADABLE, SPOOL_DROPPED_REJECTED };
+typedef void (*SpoolDropListener)(SpoolDrop why, uint32_t seq);
+
+class Spool {
+public:
+  Spool(SpoolFs& fs, const char* dir, uint32_t maxFiles, size_t maxBytes)
+    : fs(fs), dir(dir), maxFiles(maxFiles), maxBytes(maxBytes), onDrop(NULL),
+      isReady(false), headSeq(0), tailSeq(0), entries(0), used(0) {}
+
+  // Rebuild the queue from the files the last boot left, removing
+  // leftover temp files. Call once the filesystem is mounted.
+  void begin();
+  void setDropListener(SpoolDropListener listener) { onDrop = listener; }
+
+  bool ready() const { return isReady; }
+  uint32_t count() const { return entries; }
+  size_t bytes() const { return used; }
+  uint32_t head() const { return headSeq; }
+  uint32_t tail() const { return tailSeq; }
+
+  // Append a frame, evicting the oldest entries to make room. False if
+  // it can't be stored (too big, not ready, or the write failed).
+  bool push(const SpoolStamp& stamp, uint16_t width, uint16_t height, const uint8_t* jpg, size_t len);
+
+  // Send the oldest entry. False if it failed in a way worth retrying
+  // (the entry stays); a rejected or unreadable entry is dropped.
+  bool drainOne(SpoolSender send, void* ctx);
+
+  // Send the oldest few entries (up to maxFrames / maxBatchBytes) as one
+  // request; same return as drainOne(). Stops at a gap or an unreadable
+  // entry, and with fewer than two to send falls back to drainOne().
+  bool drainBatch(int maxFrames, size_t maxBatchBytes, SpoolSender send, void* ctx);
+
+private:
+  SpoolFs& fs;
+  const char* dir;
+  uint32_t maxFiles;
+  size_t maxBytes;
+  SpoolDropListener onDrop;
+
+  bool isReady;
+  uint32_t headSeq;
+  uint32_t tailSeq;
+  uint32_t entries;
+  size_t used;
+
+  void path(uint32_t seq, char* out, size_t len) const;
+  void skipGaps();
+  void pop();
+  void drop(SpoolDrop why);
+  bool load(uint32_t seq, SpoolEntry* entry);
+  static void onListed(void* ctx, const char* name, size_t size);
+};
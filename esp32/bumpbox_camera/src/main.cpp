@@ -8,13 +8,35 @@
  * Backend:  POST /detect-object (multipart/form-data)
  *
  * Trigger:  Button on GPIO 13  OR  type 'c' in Serial Monitor
+ *
+ * Optional: build with -DBUMPBOX_PRECLASSIFIER (env esp32cam-preclassifier)
+ * for the on-device classifier; its model is src/preclassifier_model.h.
  */
 
 #include <Arduino.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
+#include <WiFiServer.h>
+#include <Preferences.h>
+#include <LittleFS.h>
 #include "esp_camera.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+#include <rom/crc.h>
 #include <ArduinoJson.h>
+#include <WifiManager.h>  // esp32/lib: link manager shared with the S3
+#include <Multipart.h>    // lib/: upload body framing (host-tested)
+#include <Spool.h>        // lib/: offline capture queue (host-tested)
+#include <FrameAnalysis.h> // lib/: sharpness and change-detection kernels (host-tested)
+#ifdef BUMPBOX_PRECLASSIFIER
+#include <TensorFlowLite_ESP32.h>
+#include "tensorflow/lite/micro/all_ops_resolver.h"
+#include "tensorflow/lite/micro/micro_error_reporter.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "preclassifier_model.h"  // g_preclassifier_model, PRECLASSIFIER_LABELS[_COUNT]
+#include <Preclassifier.h>        // lib/: model input fill and scoring (host-tested)
+#endif
 
 // ====================== CONFIGURATION ======================
 // -- WiFi (change these!) --
@@ -24,11 +46,17 @@ const char* WIFI_PASSWORD = "passswoed";    // <-- Change this
 // -- Server --
 // server URL (change IP if your computer's local IP changes)
 // const char* SERVER_URL = "http://10.252.191.158:8080/detect-object";
-// const char* POLL_TRIGGER_URL = "http://10.252.191.158:8080/api/locker/capture-trigger";
+// const char* BACKEND_HOST = "10.252.191.158";
+// const uint16_t BACKEND_PORT = 8080;
 const char* SERVER_URL = "http://bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com/detect-object";
-const char* POLL_TRIGGER_URL = "http://bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com/api/locker/capture-trigger";
+const char* BACKEND_HOST    = "bumpbox-env-1.eba-43hmmxwt.ap-southeast-1.elasticbeanstalk.com";
+const uint16_t BACKEND_PORT = 80;
+const char* PUSH_PATH         = "/api/locker/trigger-stream";   // SSE trigger stream
+const char* POLL_TRIGGER_PATH = "/api/locker/capture-trigger";  // Long-poll fallback
 const char* LOCKER_ID  = "locker1";  // Locker identifier
 const bool  USE_MOCK   = false;  // true = test without Google Vision API
+const char* NTP_SERVER_1 = "pool.ntp.org";     // Wall clock for trace timestamps
+const char* NTP_SERVER_2 = "time.google.com";
 
 // -- Pins --
 #define BUTTON_PIN     13   // Trigger button (connect to GND)
@@ -54,74 +82,431 @@ const bool  USE_MOCK   = false;  // true = test without Google Vision API
 #define PCLK_GPIO_NUM     22
 
 // -- Camera settings --
-#define FRAME_SIZE    FRAMESIZE_VGA  // 640x480
+#define FRAME_SIZE    FRAMESIZE_VGA  // 640x480 — best setting the tuner may use
 #define JPEG_QUALITY  12             // 0-63, lower = better quality
+#define FB_COUNT_PSRAM 3             // PSRAM frame ring (also bounds the upload pipeline)
+#define BURST_SIZE     3             // Lit frames per capture; sharpest is uploaded (1 = off)
+#define SHARPNESS_SCALE JPG_SCALE_4X // Luma decimation for scoring (VGA → 160x120)
+#define UNCHANGED_MAX_BITS 6         // dHash distance (of 64) still counted as "same contents"
+#define THUMB_MAX_WIDTH   400        // Detection thumbnail: scale the frame down to at most this
+#define THUMB_QUALITY     80         // fmt2jpg quality (0-100, higher = better)
+#define ROI_QUALITY       85         // fmt2jpg quality for the cropped full frame
+#define NVS_NAMESPACE     "bumpbox"  // Per-device settings (Preferences)
+
+// -- Adaptive capture tuning --
+#define MAX_UPLOAD_BYTES  1000000    // Server (multer) file size limit
+#define UPLOAD_TARGET_MS  3000       // Aim to get a frame onto the wire within this
+#define MIN_RATE_SAMPLE   16384      // Smaller bodies fit in the TCP send buffer — don't time them
+#define OVERSIZE_RETRIES  2          // Re-grabs at lower settings before giving up on a frame
+
+// -- On-device pre-classifier (BUMPBOX_PRECLASSIFIER builds only) --
+#define PRECLASS_MIN_CONF  0.80f     // Report the device label (and skip Vision) at or above this
+#define PRECLASS_ARENA_KB  192       // TFLite Micro tensor arena, in PSRAM
+
+// -- Offline spool (LittleFS) --
+#define SPOOL_DIR         "/spool"
+#define SPOOL_MAX_FILES   24         // Oldest captures are evicted past this...
+#define SPOOL_MAX_BYTES   (640 * 1024) // ...or this (huge_app.csv leaves ~960 KB of flash FS)
+#define SPOOL_RETRY_MS    10000      // Wait after a failed drain before trying again
+
+// -- Batch upload (several pending frames, one request / one Vision call) --
+#define BATCH_MAX_FRAMES  4
+#define BATCH_MAX_BYTES   (512 * 1024)
 
 // -- Timing --
 #define DEBOUNCE_MS       300
-#define WIFI_TIMEOUT_MS   15000
 #define HTTP_TIMEOUT_MS   15000
-#define FLASH_WARMUP_MS   150
-#define POLL_INTERVAL_MS  2000  // Poll trigger endpoint every 2 seconds
+#define FLASH_WARMUP_MS   150   // Armed mode: frames this long after flash-on count as lit
+#define SETTLE_MAX_MS     800   // Cold capture: hard cap on waiting for exposure to converge
+#define SETTLE_EXP_TOL    3     // % change in AEC exposure still counted as "settled"
+#define SETTLE_LEN_TOL    8     // % change in JPEG size (fallback when AEC isn't readable)
+#define ARM_TIMEOUT_MS    60000 // Armed mode (flash on, sensor streaming) auto-disarms after this
+#define POLL_INTERVAL_MS  2000  // Min gap between polls that return immediately
+#define POLL_TIMEOUT_MS   5000  // Grace on top of the long-poll wait
+#define LONG_POLL_WAIT_S  25    // Server holds each poll open this long
+#define PUSH_CONNECT_MS   3000  // TCP connect timeout for push stream / long poll
+#define PUSH_RETRY_MS     5000  // Reconnect interval while the push stream is down
+#define PUSH_IDLE_MS      45000 // Server pings every 15 s; silence this long = dead link
+
+// -- Metrics --
+#define METRICS_PORT      9100  // Prometheus scrape target: http://<camera-ip>:9100/metrics
+
+// -- Tasks --
+#define CAPTURE_CORE      1     // APP_CPU: triggers, camera, flash
+#define NETWORK_CORE      0     // PRO_CPU: uploads, next to the WiFi stack
+#define TASK_STACK_SIZE   8192
+#define METRICS_STACK_SIZE 6144
 
 // ====================== GLOBALS ======================
 unsigned long lastButtonPress = 0;
+
+// Per-stage latency spans (see LATENCY SPANS). Each capture carries its
+// own spans from trigger to result; all of them also feed the histograms.
+enum Stage {
+  STAGE_SETTLE,   // Cold capture: flash on → exposure converged
+  STAGE_FRAME,    // Trigger → frame in hand (settle, burst pick)
+  STAGE_QUEUE,    // Queued → upload task picked it up
+  STAGE_DECODE,   // The upload's one JPEG decode (ROI crop, or thumbnail scale)
+  STAGE_CROP,     // ROI crop re-encode
+  STAGE_HASH,     // dHash for change detection
+  STAGE_THUMB,    // Thumbnail downscale + encode
+  STAGE_CONNECT,  // TCP connect (only when the keep-alive socket is gone)
+  STAGE_SEND,     // Request body onto the socket
+  STAGE_SERVER,   // Last body byte → response headers (server + RTT)
+  STAGE_PARSE,    // Response JSON parse
+  STAGE_DETECT,   // Trigger → detection result on the device
+  STAGE_COUNT
+};
+
+struct CaptureTiming {
+  int64_t triggeredUs;
+  int64_t queuedUs;
+  uint32_t us[STAGE_COUNT];  // 0 = stage didn't run
+  // End-to-end trace (see TRACING): ID from the backend trigger, or a
+  // device one; wall-clock ms, 0 until SNTP has synced
+  char traceId[40];
+  int64_t triggerWallMs;
+  int64_t capturedWallMs;
+  bool armed;                // Frame came from the armed ring (see ARMED MODE)
+};
+
+// Status blink priority: a higher one cuts the pattern playing on that LED short
+enum LedPriority { LED_INFO, LED_WARN, LED_ERROR };
+
+// Capture → upload queue entry
+struct UploadJob {
+  camera_fb_t* fb;
+  CaptureTiming timing;
+};
+
+// Trigger task → capture task: a backend capture trigger or arm request
+struct BackendEvent {
+  bool arm;          // Arm request (sell flow expected) rather than a capture
+  char traceId[40];  // Capture: the trigger's trace ID ("" if it had none)
+};
+
+// Counters for /metrics (the rest it reads from existing stats)
+uint32_t pollFailures     = 0;  // Connect failures, timeouts, non-200s
+uint32_t pushDisconnects  = 0;
+uint32_t triggersDropped  = 0;  // Pipeline full
+uint32_t captureFailures  = 0;  // No frame, or none within the upload limit
+uint32_t uploadsOk        = 0;
+uint32_t uploadsFailed    = 0;
+uint64_t uploadBytes      = 0;  // Request bodies sent (images + multipart framing)
+static const uint32_t FRAME_BUCKET_BYTES[] = { 10000, 20000, 50000, 100000, 200000, 500000, 1000000 };
+static const int FRAME_BUCKETS = sizeof(FRAME_BUCKET_BYTES) / sizeof(FRAME_BUCKET_BYTES[0]) + 1;
+uint32_t frameSizeCounts[FRAME_BUCKETS];
+uint64_t frameSizeSum     = 0;
+
+CaptureTiming* captureTiming = NULL;  // Capture task: spans of the capture in progress
+CaptureTiming* uploadTiming  = NULL;  // Upload task: spans of the frame being uploaded
+char pendingTraceId[40] = "";         // Capture task: trace ID of the trigger just received
+
+// Capture → upload pipeline. Frames travel as camera_fb_t* (no copy);
+// frameSlots counts driver buffers not held by the pipeline, so a
+// capture only starts when the driver still has a buffer to fill.
+QueueHandle_t uploadQueue;
+QueueHandle_t backendEvents;   // Push and poll triggers, off the network core
+SemaphoreHandle_t frameSlots;
+SemaphoreHandle_t flashMutex;  // Flash LED: capture illumination vs. status blinks
+int fbCount = 1;
+
+// Armed mode: flash stays on and the sensor keeps streaming into the
+// driver's PSRAM frame ring, so a trigger takes the newest lit frame
+volatile bool captureArmed = false;
+unsigned long armedAt = 0;
+int64_t armedSettledUs = 0;     // Frames started after this are fully lit
+
+// Trigger → frame latency, per path
+uint32_t coldCaptures  = 0;
+uint32_t armedCaptures = 0;
+int64_t coldLatencyUs  = 0;     // Sums, for the averages in printCaptureStats()
+int64_t armedLatencyUs = 0;
+
+/*
+ * Closed-loop frame size / JPEG quality. Rungs are ordered by expected
+ * JPEG size; after every capture the tuner compares the frame against
+ * the upload budget (server limit, and what the measured uplink can move
+ * within UPLOAD_TARGET_MS) and moves one rung down if it was over, or
+ * one rung up if it used less than half. The top rung is the configured
+ * FRAME_SIZE / JPEG_QUALITY (the frame buffers are sized for it).
+ */
+struct CaptureRung {
+  framesize_t frameSize;
+  int quality;
+};
+
+static const CaptureRung CAPTURE_LADDER[] = {
+  { FRAMESIZE_SVGA, 10 }, { FRAMESIZE_SVGA, 14 },
+  { FRAMESIZE_VGA,  10 }, { FRAMESIZE_VGA,  12 }, { FRAMESIZE_VGA, 16 }, { FRAMESIZE_VGA, 22 },
+  { FRAMESIZE_CIF,  16 }, { FRAMESIZE_CIF,  24 },
+  { FRAMESIZE_QVGA, 20 }, { FRAMESIZE_QVGA, 30 },
+};
+static const int CAPTURE_RUNGS = sizeof(CAPTURE_LADDER) / sizeof(CAPTURE_LADDER[0]);
+
+// Adaptive capture tuning: current rung of CAPTURE_LADDER and the
+// measured uplink rate (EWMA, written by the upload task)
+int captureRung = 0;
+int captureTopRung = 0;
+float uplinkBytesPerSec = 0;
+
+// Region of interest: the part of the frame that shows the locker
+// interior, in 1/1000ths of the frame so it holds at any frame size.
+// Stored in NVS, set with the 'r' serial command.
+struct CropRect {
+  uint16_t x, y, w, h;
+};
+CropRect roi = { 0, 0, 1000, 1000 };
+uint32_t roiCrops = 0;
+uint64_t roiBytesSaved = 0;
+int64_t roiEncodeUs = 0;        // Crop re-encodes, summed
+
+// An upload's decoded pixels (see FRAME ANALYSIS)
+struct FramePixels {
+  uint8_t* bgr;  // BGR888 (what fmt2jpg takes as RGB888), malloc'd
+  int width;
+  int height;
+  int scale;     // Frame pixels per decoded pixel, each way: 1, 2, 4 or 8
+};
+
+// On-device classification sent with an upload (X-Device-Label); the
+// server skips Vision when it's confident enough and a priceMap label
+struct DeviceLabel {
+  const char* label;
+  float confidence;
+};
+
+// Change detection: dHash of the last frame the server actually received
+uint64_t lastUploadHash = 0;
+bool haveLastUploadHash = false;
 unsigned long lastPollTime = 0;
 
+// Offline spool (lib/Spool over LittleFS, see OFFLINE SPOOL). Only the
+// upload task touches it.
+unsigned long spoolRetryAt = 0;
+int lastUploadCode = 0;         // HTTP code (or negative error) of the last upload request
+bool batchRefused = false;      // Server answered a batch with 4xx (older backend) — stop trying
+
+// Long-poll fallback (own keep-alive socket, serviced non-blocking)
+WiFiClient pollClient;
+bool pollInFlight = false;
+unsigned long pollStartedAt = 0;
+unsigned long pollGapMs = 0;    // Wait before the next poll (0 = back-to-back)
+uint32_t pollReuses   = 0;
+uint32_t pollConnects = 0;
+String pollResponse;
+
+// Keep-alive HTTP session for image uploads
+WiFiClient sessionClient;
+HTTPClient sessionHttp;
+uint32_t sessionReuses   = 0;  // Requests sent on an already-open socket
+uint32_t sessionConnects = 0;  // Requests that needed a fresh TCP connect
+
+// Push channel (trigger stream); polling is the fallback while it's down
+WiFiClient pushClient;
+bool pushReady = false;             // Response headers received, stream live
+bool pushHeadersOk = false;         // Status line was 200
+unsigned long pushLastData = 0;
+unsigned long pushLastAttempt = 0;
+String pushLine;
+
 // ====================== FORWARD DECLARATIONS ======================
+void ledBegin();
 void flashLED(int times, int durationMs);
-void blinkError(int times);
-void connectWiFi();
+void blinkError(int times, LedPriority priority = LED_ERROR);
 bool initCamera();
 void captureAndSend();
-bool sendToServer(uint8_t* imageData, size_t imageLen);
+void armCapture();
+void disarmCapture();
+camera_fb_t* grabColdFrame();
+int64_t frameStartUs(const camera_fb_t* fb);
+bool readExposure(sensor_t* s, int* exposure, int* gain);
+uint8_t* decodeLuma(const camera_fb_t* fb, jpg_scale_t scale, int* width, int* height);
+uint32_t sharpnessScore(const camera_fb_t* fb);
+bool decodePixels(const camera_fb_t* fb, int scale, const CropRect* crop, FramePixels* px);
+bool pixelsHash(const FramePixels& px, uint64_t* hash);
+String hashToHex(uint64_t hash);
+camera_fb_t* pickSharpestFrame(camera_fb_t* best);
+camera_fb_t* grabArmedFrame();
+void printCaptureStats();
+size_t uploadBudget();
+void applyCaptureRung(int rung, const char* why);
+void tuneCapture(size_t frameLen);
+void noteUplinkRate(size_t bytes, int64_t sendUs);
+void captureTask(void* param);
+void uploadTask(void* param);
+void triggerTask(void* param);
+int postImage(const String& url, const uint8_t* imageData, size_t imageLen,
+              const String& frameHash, const DeviceLabel* hint, String* response);
+bool sendToServer(const uint8_t* imageData, size_t imageLen, const String& frameHash,
+                  bool thumbnail, const DeviceLabel* hint);
+bool initPreclassifier();
+bool preclassify(const FramePixels& px, DeviceLabel* out);
+void printPreclassifierStats();
+bool sendFullImage(const uint8_t* imageData, size_t imageLen, const String& frameHash);
+bool makeThumbnail(const FramePixels& px, uint8_t** jpg, size_t* jpgLen);
+int sendUnchanged(const String& frameHash);
+bool uploadFrame(camera_fb_t* fb);
+bool roiActive();
+void loadRoi();
+void handleRoiCommand(String args);
+bool cropFrame(const camera_fb_t* fb, const FramePixels& px, camera_fb_t* cropped);
+void printRoiStats();
+void spoolBegin();
+bool spoolPush(const camera_fb_t* fb);
+bool spoolDrainOne();
+bool uploadRetryable();
 void parseResponse(const String& response);
+void printDetection(JsonObject det);
+int sendBatch(const camera_fb_t* const* frames, const String* hashes, int count);
+bool uploadBatch(camera_fb_t* const* frames, int count);
+bool spoolDrainBatch();
 bool checkTriggerFromBackend();
+void startTriggerPoll();
+void cancelTriggerPoll();
+bool triggerPollComplete();
+bool sessionBegin(const String& url, uint16_t timeoutMs);
+void recordSpan(CaptureTiming* timing, Stage stage, int64_t us);
+String timingHeader(const CaptureTiming* timing);
+void postBackendEvent(const JsonDocument& doc, bool arm);
+void printLatencyHistograms();
+void metricsTask(void* param);
+bool sessionRetry(int code, bool reused);
+void printSessionStats();
+void connectPushChannel();
+void closePushChannel(const char* reason);
+bool handlePushLine(const String& line);
+bool checkPushChannel();
 
 // ====================== LED HELPERS ======================
 
-void flashLED(int times, int durationMs) {
-  for (int i = 0; i < times; i++) {
-    digitalWrite(FLASH_LED_PIN, HIGH);
-    delay(durationMs);
-    digitalWrite(FLASH_LED_PIN, LOW);
-    if (i < times - 1) delay(durationMs);
-  }
+/*
+ * Status blinks play from esp_timer callbacks, so signalling costs the
+ * capture and upload paths nothing. Callers queue a pattern from any
+ * task; the LED's timer callback (esp_timer task) owns everything else.
+ * Patterns wait in priority order, a higher-priority one preempts the
+ * pattern playing, and the lowest is dropped when the backlog is full.
+ * The flash LED yields to capture illumination: a step that finds the
+ * flash taken (flashMutex) or armed drops its pattern.
+ */
+#define LED_BACKLOG 4
+
+struct LedPattern {
+  uint8_t times;
+  uint16_t onMs, offMs;
+  LedPriority priority;
+};
+
+struct LedChannel {
+  uint8_t pin;
+  bool activeLow;
+  bool flash;                   // Shared with capture illumination
+  QueueHandle_t requests;       // Any task → timer callback
+  esp_timer_handle_t timer;
+  LedPattern waiting[LED_BACKLOG];
+  int waitingCount;
+  LedPattern pattern;           // Playing, if playing
+  bool playing;
+  int step;                     // Even = on, odd = off
+  int64_t dueUs;                // When the current step ends
+};
+
+static LedChannel flashLed, statusLed;
+
+// Insert by priority, behind equals; the lowest falls off a full backlog
+static void ledEnqueue(LedChannel* led, const LedPattern& p) {
+  int at = led->waitingCount;
+  while (at > 0 && led->waiting[at - 1].priority < p.priority) at--;
+  if (at == LED_BACKLOG) return;
+  int last = min(led->waitingCount, LED_BACKLOG - 1);
+  for (int i = last; i > at; i--) led->waiting[i] = led->waiting[i - 1];
+  led->waiting[at] = p;
+  led->waitingCount = last + 1;
 }
 
-void blinkError(int times) {
-  for (int i = 0; i < times; i++) {
-    digitalWrite(STATUS_LED_PIN, LOW);   // ON (active LOW)
-    delay(150);
-    digitalWrite(STATUS_LED_PIN, HIGH);  // OFF
-    delay(150);
+static bool ledWrite(LedChannel* led, bool on) {
+  if (!led->flash) {
+    digitalWrite(led->pin, on != led->activeLow ? HIGH : LOW);
+    return true;
   }
+  if (xSemaphoreTake(flashMutex, 0) != pdTRUE) return false;  // Capture has the flash
+  bool free = !captureArmed;  // Flash is lighting the armed frame ring — don't blink it
+  if (free) digitalWrite(led->pin, on ? HIGH : LOW);
+  xSemaphoreGive(flashMutex);
+  return free;
 }
 
-// ====================== WIFI ======================
-
-void connectWiFi() {
-  Serial.print("[WiFi] Connecting to ");
-  Serial.println(WIFI_SSID);
+static void ledTick(void* arg) {
+  LedChannel* led = (LedChannel*)arg;
+  int64_t now = esp_timer_get_time();
 
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  LedPattern p;
+  while (xQueueReceive(led->requests, &p, 0) == pdTRUE) ledEnqueue(led, p);
+  if (led->playing && led->waitingCount && led->waiting[0].priority > led->pattern.priority) {
+    led->playing = false;  // Preempted
+  } else if (led->playing && now < led->dueUs) {
+    esp_timer_start_once(led->timer, led->dueUs - now);  // Woken early by a request
+    return;
+  }
 
-  unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    if (millis() - start > WIFI_TIMEOUT_MS) {
-      Serial.println("\n[WiFi] Connection timed out!");
-      Serial.println("[WiFi] Check SSID/password. ESP32 only supports 2.4GHz WiFi.");
-      blinkError(3);
-      return;
+  for (;;) {
+    if (!led->playing) {
+      if (!led->waitingCount) {
+        ledWrite(led, false);
+        return;
+      }
+      led->pattern = led->waiting[0];
+      for (int i = 1; i < led->waitingCount; i++) led->waiting[i - 1] = led->waiting[i];
+      led->waitingCount--;
+      led->playing = true;
+      led->step = 0;
+    }
+    bool on = led->step % 2 == 0;
+    if (led->step >= led->pattern.times * 2 || !ledWrite(led, on)) {
+      led->playing = false;  // Done, or the flash is busy
+      continue;
     }
-    delay(500);
-    Serial.print(".");
+    led->step++;
+    uint32_t ms = on ? led->pattern.onMs : led->pattern.offMs;
+    led->dueUs = now + ms * 1000LL;
+    esp_timer_start_once(led->timer, ms * 1000ULL);
+    return;
   }
+}
 
-  Serial.println();
-  Serial.print("[WiFi] Connected! IP: ");
-  Serial.println(WiFi.localIP());
+static void ledInit(LedChannel* led, uint8_t pin, bool activeLow, const char* name) {
+  led->pin = pin;
+  led->activeLow = activeLow;
+  led->flash = pin == FLASH_LED_PIN;
+  pinMode(pin, OUTPUT);
+  digitalWrite(led->pin, led->activeLow ? HIGH : LOW);  // Off
+  led->requests = xQueueCreate(LED_BACKLOG, sizeof(LedPattern));
+  esp_timer_create_args_t args = {};
+  args.callback = ledTick;
+  args.arg = led;
+  args.name = name;
+  esp_timer_create(&args, &led->timer);
+}
+
+// Any task; returns at once. Dropped if the request queue is full.
+static void ledPlay(LedChannel* led, int times, int onMs, int offMs, LedPriority priority) {
+  LedPattern p = { (uint8_t)times, (uint16_t)onMs, (uint16_t)offMs, priority };
+  if (xQueueSend(led->requests, &p, 0) != pdTRUE) return;
+  esp_timer_stop(led->timer);  // Run the callback now; it resumes a step that isn't due
+  esp_timer_start_once(led->timer, 0);
+}
+
+void ledBegin() {
+  ledInit(&flashLed, FLASH_LED_PIN, false, "led_flash");
+  ledInit(&statusLed, STATUS_LED_PIN, true, "led_status");  // Red, active LOW
+}
+
+void flashLED(int times, int durationMs) {
+  ledPlay(&flashLed, times, durationMs, durationMs, LED_INFO);
+}
+
+void blinkError(int times, LedPriority priority) {
+  ledPlay(&statusLed, times, 150, 150, priority);
 }
 
 // ====================== CAMERA ======================
@@ -153,9 +538,9 @@ bool initCamera() {
   if (psramFound()) {
     config.frame_size  = FRAME_SIZE;
     config.jpeg_quality = JPEG_QUALITY;
-    config.fb_count    = 2;
+    config.fb_count    = FB_COUNT_PSRAM;
     config.fb_location = CAMERA_FB_IN_PSRAM;
-    Serial.println("[Camera] PSRAM found — using double buffer");
+    Serial.println("[Camera] PSRAM found — using frame ring");
   } else {
     config.frame_size  = FRAMESIZE_SVGA;
     config.jpeg_quality = 14;
@@ -163,6 +548,18 @@ bool initCamera() {
     config.fb_location = CAMERA_FB_IN_DRAM;
     Serial.println("[Camera] No PSRAM — using reduced settings");
   }
+  fbCount = config.fb_count;
+
+  // Tuner starts at (and never exceeds) the configured setting
+  captureTopRung = CAPTURE_RUNGS - 1;
+  for (int i = 0; i < CAPTURE_RUNGS; i++) {
+    if (resolution[CAPTURE_LADDER[i].frameSize].width <= resolution[config.frame_size].width &&
+        CAPTURE_LADDER[i].quality >= config.jpeg_quality) {
+      captureTopRung = i;
+      break;
+    }
+  }
+  captureRung = captureTopRung;
 
   esp_err_t err = esp_camera_init(&config);
   if (err != ESP_OK) {
@@ -189,7 +586,7 @@ bool initCamera() {
 // ====================== JSON PARSING ======================
 
 void parseResponse(const String& response) {
-  StaticJsonDocument<1024> doc;
+  JsonDocument doc;
   DeserializationError err = deserializeJson(doc, response);
 
   if (err) {
@@ -204,7 +601,10 @@ void parseResponse(const String& response) {
     return;
   }
 
-  JsonObject det       = doc["detection"];
+  printDetection(doc["detection"]);
+}
+
+void printDetection(JsonObject det) {
   const char* label    = det["label"]      | "Unknown";
   const char* category = det["category"]   | "Unknown";
   int minPrice         = det["minPrice"]   | 0;
@@ -221,93 +621,564 @@ void parseResponse(const String& response) {
   Serial.println();
 }
 
+// ====================== MULTIPART STREAM ======================
+
+/*
+ * Read-only Stream over a MultipartBody (lib/Multipart): HTTPClient
+ * pulls it in small chunks, so each JPEG goes onto the socket straight
+ * from its buffer — no second full-size copy. Segments are referenced,
+ * not copied: they must outlive the stream.
+ */
+class MultipartBodyStream : public Stream {
+public:
+  static_assert(2 * BATCH_MAX_FRAMES + 1 <= MultipartBody::MAX_SEGMENTS, "batch doesn't fit a MultipartBody");
+
+  MultipartBodyStream() : firstReadUs(0), lastReadUs(0) {}
+
+  MultipartBodyStream(const String& head, const uint8_t* data, size_t dataLen, const String& tail)
+    : MultipartBodyStream() {
+    add(head);
+    add(data, dataLen);
+    add(tail);
+  }
+
+  void add(const uint8_t* data, size_t len) { body.add(data, len); }
+  void add(const String& s) { body.add((const uint8_t*)s.c_str(), s.length()); }
+
+  size_t size() const { return body.size(); }
+
+  // Time from first to last byte pulled onto the socket
+  int64_t sendDurationUs() const { return lastReadUs - firstReadUs; }
+  int64_t lastByteUs() const { return lastReadUs; }
+
+  int available() override { return (int)body.available(); }
+  int peek() override { return body.peek(); }
+
+  int read() override {
+    int b = body.read();
+    if (b >= 0) noteRead(1);
+    return b;
+  }
+
+  using Stream::readBytes;
+  size_t readBytes(char* buffer, size_t length) override {
+    size_t n = body.read((uint8_t*)buffer, length);
+    noteRead(n);
+    return n;
+  }
+
+  size_t write(uint8_t) override { return 0; }  // read-only
+
+private:
+  MultipartBody body;
+  int64_t firstReadUs;
+  int64_t lastReadUs;
+
+  void noteRead(size_t n) {
+    if (!n) return;
+    lastReadUs = esp_timer_get_time();
+    if (body.position() == n) firstReadUs = lastReadUs;
+  }
+};
+
+// ====================== LATENCY SPANS ======================
+
+/*
+ * Fixed-bucket histograms, one per Stage. Bucket i counts spans up to
+ * SPAN_BUCKET_MS[i]; the last one is everything slower. Capture-side
+ * stages are only written by the capture task and upload-side ones by
+ * the upload task, so no locking; printing may see a torn update.
+ */
+static const uint16_t SPAN_BUCKET_MS[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+static const int SPAN_BUCKETS = sizeof(SPAN_BUCKET_MS) / sizeof(SPAN_BUCKET_MS[0]) + 1;
+static const char* const STAGE_NAMES[STAGE_COUNT] = {
+  "settle", "frame", "queue", "decode", "crop", "hash", "thumb", "connect", "send", "server", "parse", "detect"
+};
+
+struct SpanHistogram {
+  uint32_t counts[SPAN_BUCKETS];
+  uint32_t n;
+  uint64_t sumUs;
+  uint32_t maxUs;
+};
+static SpanHistogram spanHistograms[STAGE_COUNT];
+
+void recordSpan(CaptureTiming* timing, Stage stage, int64_t us) {
+  if (us < 0) return;
+  uint32_t ms = us / 1000;
+  int bucket = 0;
+  while (bucket < SPAN_BUCKETS - 1 && ms > SPAN_BUCKET_MS[bucket]) bucket++;
+
+  SpanHistogram& h = spanHistograms[stage];
+  h.counts[bucket]++;
+  h.n++;
+  h.sumUs += us;
+  if (us > h.maxUs) h.maxUs = us;
+
+  if (timing) timing->us[stage] += us;
+}
+
+// Upload metadata: "settle=412;frame=530;..." in ms, stages that ran so far
+String timingHeader(const CaptureTiming* timing) {
+  String out;
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    if (!timing->us[i]) continue;
+    if (out.length()) out += ";";
+    out += STAGE_NAMES[i];
+    out += "=";
+    out += String(timing->us[i] / 1000.0f, 1);
+  }
+  return out;
+}
+
+// Upper bound (ms) of the bucket holding the given percentile
+static const char* spanPercentile(const SpanHistogram& h, uint32_t pct) {
+  static char buf[8];
+  uint32_t rank = (h.n * pct + 99) / 100, seen = 0;
+  for (int i = 0; i < SPAN_BUCKETS - 1; i++) {
+    seen += h.counts[i];
+    if (seen >= rank) {
+      snprintf(buf, sizeof(buf), "%u", SPAN_BUCKET_MS[i]);
+      return buf;
+    }
+  }
+  snprintf(buf, sizeof(buf), ">%u", SPAN_BUCKET_MS[SPAN_BUCKETS - 2]);
+  return buf;
+}
+
+void printLatencyHistograms() {
+  Serial.print("[Latency] ms buckets:");
+  for (int i = 0; i < SPAN_BUCKETS - 1; i++) Serial.printf(" ≤%u", SPAN_BUCKET_MS[i]);
+  Serial.println(" >");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    const SpanHistogram& h = spanHistograms[s];
+    if (!h.n) continue;
+    Serial.printf("[Latency] %-7s n=%-4u avg %5llu  p50 %-5s", STAGE_NAMES[s], (unsigned)h.n, h.sumUs / h.n / 1000, spanPercentile(h, 50));
+    Serial.printf(" p90 %-5s", spanPercentile(h, 90));
+    Serial.printf(" p99 %-5s max %5u |", spanPercentile(h, 99), (unsigned)(h.maxUs / 1000));
+    for (int i = 0; i < SPAN_BUCKETS; i++) Serial.printf(" %u", (unsigned)h.counts[i]);
+    Serial.println();
+  }
+}
+
+// ====================== TRACING ======================
+
+/*
+ * End-to-end trace of a capture across kiosk, backend and camera. The
+ * backend mints a trace ID with each trigger; it rides along with the
+ * capture and goes back on the upload (X-Trace-Id) with the device's
+ * SNTP wall-clock timestamps, and the server logs the per-hop durations.
+ * Button and serial captures get a device-made ID.
+ */
+
+// Start the trace for a capture triggered just now
+static void beginTrace(CaptureTiming* timing) {
+  if (pendingTraceId[0]) {
+    strlcpy(timing->traceId, pendingTraceId, sizeof(timing->traceId));
+    pendingTraceId[0] = '\0';
+  } else {
+    snprintf(timing->traceId, sizeof(timing->traceId), "dev-%08x%08x", (unsigned)esp_random(), (unsigned)esp_random());
+  }
+  timing->triggerWallMs = wallClockMs();
+  Serial.printf("[Trace] %s\n", timing->traceId);
+}
+
+static void addEpochHeader(const char* name, int64_t ms) {
+  if (!ms) return;
+  char value[24];
+  snprintf(value, sizeof(value), "%lld", (long long)ms);
+  sessionHttp.addHeader(name, value);
+}
+
+// Trace headers for the upload (or unchanged notice) in flight; single captures only
+static void addTraceHeaders(const CaptureTiming* timing) {
+  if (!timing || !timing->traceId[0]) return;
+  sessionHttp.addHeader("X-Trace-Id", timing->traceId);
+  addEpochHeader("X-Trigger-Received-At", timing->triggerWallMs);
+  addEpochHeader("X-Captured-At", timing->capturedWallMs);
+  addEpochHeader("X-Sent-At", wallClockMs());
+  sessionHttp.addHeader("X-Capture-Path", timing->armed ? "armed" : "cold");
+}
+
+// Idempotency key: CRC-32 and length of the uploaded JPEG bytes, the same on
+// every retry of that body, so the server replays its first answer instead
+// of storing a second detection (server/services/uploadDedup.js)
+static void addUploadId(uint32_t crc, size_t len) {
+  char id[20];
+  snprintf(id, sizeof(id), "%08lx-%lx", (unsigned long)crc, (unsigned long)len);
+  sessionHttp.addHeader("X-Upload-Id", id);
+}
+
+// ====================== HTTP SESSION ======================
+
+/*
+ * Uploads reuse one keep-alive socket instead of reconnecting each time.
+ * HTTPClient leaves it open on end() when reuse is on and the server
+ * answered with keep-alive. (Trigger long polls park on their own socket.)
+ */
+bool sessionBegin(const String& url, uint16_t timeoutMs) {
+  bool reused = sessionClient.connected();
+  if (reused) {
+    sessionReuses++;
+  } else {
+    // Connect here rather than inside sendRequest() so the connect gets
+    // its own span; HTTPClient then reuses the open socket. (Uploads all
+    // go to SERVER_URL, which is on BACKEND_HOST.)
+    sessionConnects++;
+    int64_t start = esp_timer_get_time();
+    if (sessionClient.connect(BACKEND_HOST, BACKEND_PORT, timeoutMs)) {
+      recordSpan(uploadTiming, STAGE_CONNECT, esp_timer_get_time() - start);
+    }
+  }
+
+  sessionHttp.setReuse(true);
+  sessionHttp.begin(sessionClient, url);
+  sessionHttp.setTimeout(timeoutMs);
+  return reused;
+}
+
+// The server (or load balancer) may have closed an idle socket we still
+// think is open. Drop it and let the caller retry once on a fresh one.
+// The first attempt may still have reached the server, so every retried
+// POST carries X-Upload-Id and the server answers a repeat from its dedupe.
+bool sessionRetry(int code, bool reused) {
+  if (code >= 0 || !reused || code == HTTPC_ERROR_READ_TIMEOUT) return false;
+  sessionHttp.end();
+  sessionClient.stop();
+  Serial.println("[HTTP] Keep-alive socket dropped — reconnecting");
+  return true;
+}
+
+void printSessionStats() {
+  Serial.printf("[HTTP] Session: %u reused, %u connects\n", (unsigned)sessionReuses, (unsigned)sessionConnects);
+  Serial.printf("[HTTP] Long poll: %u reused, %u connects\n", (unsigned)pollReuses, (unsigned)pollConnects);
+}
+
 // ====================== HTTP POST ======================
 
-bool sendToServer(uint8_t* imageData, size_t imageLen) {
+/*
+ * Multipart POST of a JPEG on the session connection. Returns the HTTP
+ * code; the response body goes to *response when the caller wants it.
+ */
+int postImage(const String& url, const uint8_t* imageData, size_t imageLen,
+              const String& frameHash, const DeviceLabel* hint, String* response) {
+  String bodyStart = MULTIPART_JPEG_HEAD("image");
+  String bodyEnd   = MULTIPART_TAIL;
+
+  size_t totalLen = bodyStart.length() + imageLen + bodyEnd.length();
+  Serial.printf("[HTTP] Body: %u bytes (image: %u)\n", totalLen, imageLen);
+  Serial.printf("[HTTP] POST %s\n", url.c_str());
+
+  uint32_t crc = crc32_le(0, imageData, imageLen);
+  int code;
+  bool reused;
+  int64_t sendUs = 0;
+  do {
+    // Stream header + JPEG (from the frame buffer) + footer, no copy
+    MultipartBodyStream body(bodyStart, imageData, imageLen, bodyEnd);
+    reused = sessionBegin(url, HTTP_TIMEOUT_MS);
+    sessionHttp.addHeader("Content-Type", "multipart/form-data; boundary=" MULTIPART_BOUNDARY);
+    if (frameHash.length()) sessionHttp.addHeader("X-Frame-Hash", frameHash);
+    addUploadId(crc, imageLen);
+    if (hint) {
+      sessionHttp.addHeader("X-Device-Label", hint->label);
+      sessionHttp.addHeader("X-Device-Confidence", String(hint->confidence, 3));
+    }
+    if (uploadTiming) sessionHttp.addHeader("X-Capture-Timing", timingHeader(uploadTiming));
+    addTraceHeaders(uploadTiming);
+    code = sessionHttp.sendRequest("POST", &body, totalLen);
+    sendUs = body.sendDurationUs();
+    if (code > 0) {
+      recordSpan(uploadTiming, STAGE_SEND, sendUs);
+      recordSpan(uploadTiming, STAGE_SERVER, esp_timer_get_time() - body.lastByteUs());
+    }
+  } while (sessionRetry(code, reused));
+  lastUploadCode = code;
+  if (code == 200) uploadsOk++;
+  else             uploadsFailed++;
+  if (code > 0) uploadBytes += totalLen;
+
+  if (code > 0) noteUplinkRate(totalLen, sendUs);
+
+  if (code == 200) {
+    if (response) *response = sessionHttp.getString();
+  } else if (code > 0) {
+    Serial.printf("[HTTP] Server returned %d: %s\n", code, sessionHttp.getString().c_str());
+  } else {
+    Serial.printf("[HTTP] Request failed: %s\n", sessionHttp.errorToString(code).c_str());
+  }
+  sessionHttp.end();
+  return code;
+}
+
+bool sendToServer(const uint8_t* imageData, size_t imageLen, const String& frameHash,
+                  bool thumbnail, const DeviceLabel* hint) {
   String url = SERVER_URL;
   url += "?lockerId=";
   url += LOCKER_ID;
   if (USE_MOCK) url += "&mock=true";
+  if (thumbnail) url += "&stage=thumbnail";  // Full frame follows via sendFullImage()
 
-  String boundary  = "----BumpBoxESP32Boundary";
-  String bodyStart = "--" + boundary + "\r\n"
-                     "Content-Disposition: form-data; name=\"image\"; filename=\"capture.jpg\"\r\n"
-                     "Content-Type: image/jpeg\r\n\r\n";
-  String bodyEnd   = "\r\n--" + boundary + "--\r\n";
+  String resp;
+  if (postImage(url, imageData, imageLen, frameHash, hint, &resp) != 200) return false;
 
-  size_t totalLen = bodyStart.length() + imageLen + bodyEnd.length();
-  Serial.printf("[HTTP] Body: %u bytes (image: %u)\n", totalLen, imageLen);
-
-  // Allocate in PSRAM to avoid exhausting internal SRAM
-  uint8_t* body = (uint8_t*)ps_malloc(totalLen);
-  if (!body) {
-    Serial.println("[HTTP] Memory allocation failed!");
-    return false;
+  int64_t parseStart = esp_timer_get_time();
+  parseResponse(resp);
+  recordSpan(uploadTiming, STAGE_PARSE, esp_timer_get_time() - parseStart);
+  if (uploadTiming && !uploadTiming->us[STAGE_DETECT]) {
+    recordSpan(uploadTiming, STAGE_DETECT, esp_timer_get_time() - uploadTiming->triggeredUs);
+    Serial.printf("[Latency] %s\n", timingHeader(uploadTiming).c_str());
   }
+  Serial.println("[HTTP] Success!");
+  printSessionStats();
+  return true;
+}
+
+/*
+ * Second half of a progressive upload: the full-resolution frame for a
+ * detection the server already made from its thumbnail (matched by
+ * frame hash). No detection runs; it only replaces the stored photo.
+ */
+bool sendFullImage(const uint8_t* imageData, size_t imageLen, const String& frameHash) {
+  String url = SERVER_URL;
+  url += "/full-image?lockerId=";
+  url += LOCKER_ID;
+
+  if (postImage(url, imageData, imageLen, frameHash, NULL, NULL) != 200) return false;
 
-  // Assemble: header + JPEG binary + footer
-  size_t offset = 0;
-  memcpy(body + offset, bodyStart.c_str(), bodyStart.length());
-  offset += bodyStart.length();
-  memcpy(body + offset, imageData, imageLen);
-  offset += imageLen;
-  memcpy(body + offset, bodyEnd.c_str(), bodyEnd.length());
+  Serial.println("[HTTP] Full-resolution photo attached");
+  return true;
+}
+
+/*
+ * Several frames in one request to /detect-object/batch; the server
+ * labels them with one Vision call and answers per image. Returns the
+ * HTTP code (200 even if some images failed — those are logged).
+ */
+int sendBatch(const camera_fb_t* const* frames, const String* hashes, int count) {
+  String url = SERVER_URL;
+  url += "/batch?lockerId=";
+  url += LOCKER_ID;
+  if (USE_MOCK) url += "&mock=true";
 
-  HTTPClient http;
-  http.begin(url);
-  http.setTimeout(HTTP_TIMEOUT_MS);
-  http.addHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
+  String partHead = MULTIPART_JPEG_HEAD("images");
+  String partSep  = MULTIPART_SEPARATOR MULTIPART_JPEG_HEAD("images");
+  String bodyEnd  = MULTIPART_TAIL;
+
+  String hashList;
+  size_t imageLen = 0;
+  uint32_t crc = 0;
+  for (int i = 0; i < count; i++) {
+    if (i) hashList += ",";
+    hashList += hashes[i];
+    imageLen += frames[i]->len;
+    crc = crc32_le(crc, frames[i]->buf, frames[i]->len);
+  }
 
+  size_t totalLen = partHead.length() + (count - 1) * partSep.length() + imageLen + bodyEnd.length();
+  Serial.printf("[HTTP] Batch of %d: %u bytes (images: %u)\n", count, totalLen, imageLen);
   Serial.printf("[HTTP] POST %s\n", url.c_str());
-  int code = http.POST(body, totalLen);
-  free(body);
+
+  int code;
+  bool reused;
+  int64_t sendUs = 0;
+  do {
+    MultipartBodyStream body;
+    for (int i = 0; i < count; i++) {
+      body.add(i ? partSep : partHead);
+      body.add(frames[i]->buf, frames[i]->len);
+    }
+    body.add(bodyEnd);
+
+    reused = sessionBegin(url, HTTP_TIMEOUT_MS);
+    sessionHttp.addHeader("Content-Type", "multipart/form-data; boundary=" MULTIPART_BOUNDARY);
+    sessionHttp.addHeader("X-Frame-Hashes", hashList);
+    addUploadId(crc, imageLen);
+    code = sessionHttp.sendRequest("POST", &body, totalLen);
+    sendUs = body.sendDurationUs();
+    if (code > 0) {
+      recordSpan(NULL, STAGE_SEND, sendUs);
+      recordSpan(NULL, STAGE_SERVER, esp_timer_get_time() - body.lastByteUs());
+    }
+  } while (sessionRetry(code, reused));
+  lastUploadCode = code;
+  if (code == 200) uploadsOk++;
+  else             uploadsFailed++;
+  if (code > 0) uploadBytes += totalLen;
+
+  if (code > 0) noteUplinkRate(totalLen, sendUs);
+
+  if (code != 200) {
+    if (code > 0) {
+      Serial.printf("[HTTP] Server returned %d: %s\n", code, sessionHttp.getString().c_str());
+    } else {
+      Serial.printf("[HTTP] Request failed: %s\n", sessionHttp.errorToString(code).c_str());
+    }
+    sessionHttp.end();
+    return code;
+  }
+
+  String resp = sessionHttp.getString();
+  sessionHttp.end();
+
+  JsonDocument doc;
+  DeserializationError err = deserializeJson(doc, resp);
+  if (err) {
+    Serial.printf("[JSON] Parse error: %s\n", err.c_str());
+    return code;
+  }
+  for (JsonObject result : doc["results"].as<JsonArray>()) {
+    int index = result["index"] | -1;
+    if (result["success"] | false) {
+      Serial.printf("[Batch] Image %d of %d:\n", index + 1, count);
+      printDetection(result["detection"]);
+    } else {
+      Serial.printf("[Batch] Image %d of %d failed: %s\n", index + 1, count, result["error"] | "Unknown");
+    }
+  }
+  printSessionStats();
+  return code;
+}
+
+/*
+ * Tiny "contents unchanged" notification instead of the JPEG. The server
+ * reuses its stored detection if it came from the frame with this hash.
+ * Returns the HTTP code; 409 means the server needs the full image.
+ */
+int sendUnchanged(const String& frameHash) {
+  String url = SERVER_URL;
+  url += "/unchanged?lockerId=";
+  url += LOCKER_ID;
+
+  Serial.printf("[HTTP] POST %s (ref %s)\n", url.c_str(), frameHash.c_str());
+
+  int code;
+  bool reused;
+  do {
+    reused = sessionBegin(url, HTTP_TIMEOUT_MS);
+    sessionHttp.addHeader("X-Frame-Hash", frameHash);
+    // The hash repeats on every unchanged trigger; the capture's trace id doesn't
+    if (uploadTiming && uploadTiming->traceId[0]) sessionHttp.addHeader("X-Upload-Id", uploadTiming->traceId);
+    if (uploadTiming) sessionHttp.addHeader("X-Capture-Timing", timingHeader(uploadTiming));
+    addTraceHeaders(uploadTiming);
+    code = sessionHttp.sendRequest("POST", (uint8_t*)NULL, 0);
+  } while (sessionRetry(code, reused));
+  lastUploadCode = code;
+
+  String resp = code > 0 ? sessionHttp.getString() : "";
+  sessionHttp.end();
 
   if (code == 200) {
-    String resp = http.getString();
-    http.end();
     parseResponse(resp);
-    Serial.println("[HTTP] Success!");
-    return true;
+    if (uploadTiming && !uploadTiming->us[STAGE_DETECT]) {
+      recordSpan(uploadTiming, STAGE_DETECT, esp_timer_get_time() - uploadTiming->triggeredUs);
+      Serial.printf("[Latency] %s\n", timingHeader(uploadTiming).c_str());
+    }
+    Serial.println("[HTTP] Success! (previous detection reused)");
+  } else if (code < 0) {
+    Serial.printf("[HTTP] Request failed: %s\n", sessionHttp.errorToString(code).c_str());
+  } else if (code != 409) {
+    Serial.printf("[HTTP] Server returned %d: %s\n", code, resp.c_str());
   }
+  return code;
+}
 
-  if (code > 0) {
-    Serial.printf("[HTTP] Server returned %d: %s\n", code, http.getString().c_str());
+// ====================== POLLING ======================
+
+/*
+ * Fallback while the push stream is down: back-to-back long polls. The
+ * server parks each request (?wait=) until a trigger arrives or the wait
+ * expires. Serviced non-blocking from the trigger task, so the push
+ * stream keeps being read while a poll is parked.
+ */
+void startTriggerPoll() {
+  if (pollClient.connected()) {
+    pollReuses++;
   } else {
-    Serial.printf("[HTTP] Request failed: %s\n", http.errorToString(code).c_str());
+    pollConnects++;
+    if (!pollClient.connect(BACKEND_HOST, BACKEND_PORT, PUSH_CONNECT_MS)) {
+      pollFailures++;
+      lastPollTime = millis();
+      pollGapMs = POLL_INTERVAL_MS;
+      return;
+    }
   }
-  http.end();
-  return false;
+
+  pollClient.printf("GET %s?lockerId=%s&wait=%d HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "Connection: keep-alive\r\n\r\n",
+                    POLL_TRIGGER_PATH, LOCKER_ID, LONG_POLL_WAIT_S, BACKEND_HOST);
+  pollStartedAt = millis();
+  pollInFlight = true;
+  pollResponse = "";
 }
 
-// ====================== POLLING ======================
+void cancelTriggerPoll() {
+  if (!pollInFlight) return;
+  pollClient.stop();
+  pollInFlight = false;
+}
+
+// Full response received? (Content-Length satisfied, or server closed)
+bool triggerPollComplete() {
+  int headerEnd = pollResponse.indexOf("\r\n\r\n");
+  if (headerEnd < 0) return !pollClient.connected();
+
+  String headers = pollResponse.substring(0, headerEnd);
+  headers.toLowerCase();
+  int cl = headers.indexOf("content-length:");
+  if (cl < 0) return !pollClient.connected();
 
+  long contentLength = headers.substring(cl + 15).toInt();
+  return (long)(pollResponse.length() - headerEnd - 4) >= contentLength;
+}
+
+// Service the long poll (non-blocking). Returns true on a capture trigger.
 bool checkTriggerFromBackend() {
-  HTTPClient http;
-  http.begin(POLL_TRIGGER_URL);
-  http.setTimeout(5000);  // Shorter timeout for polling
+  if (!pollInFlight) {
+    if (millis() - lastPollTime >= pollGapMs) startTriggerPoll();
+    return false;
+  }
+
+  while (pollClient.available()) {
+    char c = pollClient.read();
+    if (pollResponse.length() < 1024) pollResponse += c;
+  }
+
+  if (!triggerPollComplete()) {
+    if (millis() - pollStartedAt > LONG_POLL_WAIT_S * 1000UL + POLL_TIMEOUT_MS) {
+      pollFailures++;
+      cancelTriggerPoll();
+      lastPollTime = millis();
+      pollGapMs = POLL_INTERVAL_MS;
+    }
+    return false;
+  }
+
+  pollInFlight = false;
+  lastPollTime = millis();
+
+  // "HTTP/1.1 200 OK"
+  int code = pollResponse.startsWith("HTTP/1.") ? pollResponse.substring(9, 12).toInt() : -1;
+  bool shouldCapture = false;
 
-  int code = http.GET();
-  
   if (code == 200) {
-    String resp = http.getString();
-    http.end();
-    
-    // Parse JSON response
-    StaticJsonDocument<256> doc;
-    DeserializationError err = deserializeJson(doc, resp);
+    JsonDocument doc;
+    DeserializationError err = deserializeJson(doc, pollResponse.substring(pollResponse.indexOf("\r\n\r\n") + 4));
     
     if (err) {
       Serial.print("[Polling] JSON parse error: ");
       Serial.println(err.c_str());
-      return false;
+    } else {
+      shouldCapture = doc["shouldCapture"] | false;
+      if (shouldCapture) postBackendEvent(doc, false);
     }
-    
-    bool shouldCapture = doc["shouldCapture"] | false;
-    return shouldCapture;
   }
   
   // Don't log errors for polling failures to avoid spam
-  if (code > 0 && code != 200) {
+  if (code != 200) {
+    pollFailures++;
+    pollClient.stop();
     // Only log non-200 status codes occasionally
     static unsigned long lastErrorLog = 0;
     if (millis() - lastErrorLog > 60000) {  // Log once per minute
@@ -315,130 +1186,1448 @@ bool checkTriggerFromBackend() {
       lastErrorLog = millis();
     }
   }
-  
-  http.end();
-  return false;
-}
-
-// ====================== CAPTURE & SEND ======================
 
-void captureAndSend() {
-  Serial.println("\n---------- CAPTURE ----------");
+  // Back-to-back only if the server actually parked the request; a server
+  // that answers immediately (no long-poll support, errors) gets the old pace
+  bool parked = lastPollTime - pollStartedAt >= POLL_INTERVAL_MS;
+  pollGapMs = (code == 200 && (parked || shouldCapture)) ? 0 : POLL_INTERVAL_MS;
+  return shouldCapture;
+}
 
-  // Flash ON — illuminate the locker
-  digitalWrite(FLASH_LED_PIN, HIGH);
-  delay(FLASH_WARMUP_MS);
+// ====================== PUSH CHANNEL ======================
+
+// Hand a backend capture trigger (with its trace ID) or arm request to
+// the capture task
+void postBackendEvent(const JsonDocument& doc, bool arm) {
+  BackendEvent event = {};
+  event.arm = arm;
+  if (!arm) strlcpy(event.traceId, doc["traceId"] | "", sizeof(event.traceId));
+  if (xQueueSend(backendEvents, &event, 0) != pdTRUE) {
+    if (!arm) triggersDropped++;
+    Serial.printf("[Trigger] Capture task backlogged — backend %s dropped\n",
+                  arm ? "arm request" : "trigger");
+  }
+}
 
-  // Discard stale frame (captured before flash)
-  camera_fb_t* fb = esp_camera_fb_get();
-  if (fb) esp_camera_fb_return(fb);
+/*
+ * The backend pushes capture triggers over a long-lived SSE stream, so a
+ * trigger arrives in one network hop instead of on the next 2 s poll.
+ * HTTP/1.0 keeps the body free of chunked framing: just "data:" lines
+ * and ": ping" heartbeats.
+ */
+void connectPushChannel() {
+  pushLastAttempt = millis();
+  if (!pushClient.connect(BACKEND_HOST, BACKEND_PORT, PUSH_CONNECT_MS)) return;
+
+  pushClient.setNoDelay(true);
+  pushClient.printf("GET %s?lockerId=%s HTTP/1.0\r\n"
+                    "Host: %s\r\n"
+                    "Accept: text/event-stream\r\n\r\n",
+                    PUSH_PATH, LOCKER_ID, BACKEND_HOST);
+  pushReady = false;
+  pushHeadersOk = false;
+  pushLastData = millis();
+  pushLine = "";
+}
 
-  // Capture fresh frame (with flash)
-  fb = esp_camera_fb_get();
-  digitalWrite(FLASH_LED_PIN, LOW);
+void closePushChannel(const char* reason) {
+  pushClient.stop();
+  if (pushReady) {
+    pushDisconnects++;
+    Serial.printf("[Push] Disconnected (%s) — falling back to polling\n", reason);
+  }
+  pushReady = false;
+}
 
-  if (!fb) {
-    Serial.println("[Camera] Capture failed!");
-    blinkError(5);
-    return;
+// Returns true if the line carried a capture trigger
+bool handlePushLine(const String& line) {
+  if (!pushReady) {
+    if (line.startsWith("HTTP/")) {
+      pushHeadersOk = line.indexOf(" 200") > 0;
+    } else if (line.length() == 0) {
+      if (!pushHeadersOk) {
+        closePushChannel("bad status");
+        return false;
+      }
+      pushReady = true;
+      Serial.println("[Push] Trigger stream connected");
+    }
+    return false;
   }
 
-  Serial.printf("[Camera] %u bytes (%ux%u)\n", fb->len, fb->width, fb->height);
+  if (!line.startsWith("data:")) return false;  // ": ping" heartbeat etc.
 
-  if (fb->len > 1000000) {
-    Serial.println("[Camera] Image exceeds 1MB server limit!");
-    esp_camera_fb_return(fb);
-    blinkError(4);
-    return;
+  JsonDocument doc;
+  if (deserializeJson(doc, line.substring(5))) {
+    Serial.println("[Push] Bad event payload");
+    return false;
+  }
+  if (doc["arm"] | false) {
+    Serial.println("[Push] Arm request — sell flow expected");
+    postBackendEvent(doc, true);
   }
+  bool shouldCapture = doc["shouldCapture"] | false;
+  if (shouldCapture) postBackendEvent(doc, false);
+  return shouldCapture;
+}
 
-  bool ok = sendToServer(fb->buf, fb->len);
-  esp_camera_fb_return(fb);
+// Service the push stream (non-blocking). Returns true on a capture trigger.
+bool checkPushChannel() {
+  if (!pushClient.connected()) {
+    if (pushReady) closePushChannel("socket closed");
+    if (millis() - pushLastAttempt > PUSH_RETRY_MS) connectPushChannel();
+    return false;
+  }
 
-  if (ok) {
-    flashLED(2, 100);  // Success: 2 short blinks
-  } else {
-    blinkError(5);
+  bool trigger = false;
+  while (pushClient.available()) {
+    char c = pushClient.read();
+    pushLastData = millis();
+    if (c == '\n') {
+      if (pushLine.endsWith("\r")) pushLine.remove(pushLine.length() - 1);
+      if (handlePushLine(pushLine)) trigger = true;
+      pushLine = "";
+    } else if (pushLine.length() < 256) {
+      pushLine += c;
+    }
   }
-}
 
-// ====================== SETUP & LOOP ======================
+  if (millis() - pushLastData > PUSH_IDLE_MS) closePushChannel("heartbeat timeout");
+  return trigger;
+}
 
-void setup() {
-  Serial.begin(115200);
-  delay(1000);
+// ====================== FRAME ANALYSIS ======================
 
-  Serial.println();
-  Serial.println("========================================");
-  Serial.println("  BumpBox ESP32-CAM v1.0");
-  Serial.println("  Smart Locker Camera System");
-  Serial.println("----------------------------------------");
-  Serial.println("  Trigger: button (GPIO 13) or type 'c'");
-  Serial.println("========================================");
-  Serial.println();
+/*
+ * Burst scoring works on a decimated luma plane decoded straight from
+ * the JPEG (esp_jpg_decode at 1/4 scale). An upload instead decodes its
+ * frame once into FramePixels (the full-scale ROI crop, or the whole
+ * frame at thumbnail scale), and the change hash, the pre-classifier
+ * input and the thumbnail are box-downscaled from those pixels rather
+ * than decoded again. The kernels are in lib/FrameAnalysis.
+ */
+struct FrameDecode {
+  const camera_fb_t* fb;
+  uint8_t* pixels;
+  int width;
+  int height;
+  int channels;          // 1: luma plane, 3: BGR888 (what fmt2jpg takes as RGB888)
+  const CropRect* crop;  // Keep only this part of the frame (NULL: all of it)
+  int cropX;
+  int cropY;
+};
+
+static size_t frameReader(void* arg, size_t index, uint8_t* buf, size_t len) {
+  const camera_fb_t* fb = ((FrameDecode*)arg)->fb;
+  if (index + len > fb->len) len = fb->len - index;
+  if (buf) memcpy(buf, fb->buf + index, len);
+  return len;
+}
 
-  pinMode(BUTTON_PIN, INPUT_PULLUP);
-  pinMode(FLASH_LED_PIN, OUTPUT);
-  pinMode(STATUS_LED_PIN, OUTPUT);
-  digitalWrite(FLASH_LED_PIN, LOW);
-  digitalWrite(STATUS_LED_PIN, HIGH);  // OFF (active LOW)
+static bool frameWriter(void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data) {
+  FrameDecode* dec = (FrameDecode*)arg;
+  if (!data) {
+    if (x == 0 && y == 0 && !dec->pixels) {  // Start: w/h are the output size
+      dec->width  = w;
+      dec->height = h;
+      if (dec->crop) {
+        dec->cropX  = w * dec->crop->x / 1000;
+        dec->cropY  = h * dec->crop->y / 1000;
+        dec->width  = max(1, w * dec->crop->w / 1000);
+        dec->height = max(1, h * dec->crop->h / 1000);
+      }
+      dec->pixels = (uint8_t*)malloc(dec->width * dec->height * dec->channels);
+      return dec->pixels != NULL;
+    }
+    return true;  // End of image
+  }
 
-  if (!initCamera()) {
-    Serial.println("[FATAL] Camera init failed. Halting.");
-    while (true) {
-      blinkError(3);
-      delay(2000);
+  // data is an RGB888 block, row-major
+  for (int j = 0; j < h; j++) {
+    int oy = y + j - dec->cropY;
+    if (oy < 0 || oy >= dec->height) continue;
+    const uint8_t* in = data + j * w * 3;
+    for (int i = 0; i < w; i++, in += 3) {
+      int ox = x + i - dec->cropX;
+      if (ox < 0 || ox >= dec->width) continue;
+      if (dec->channels == 3) {
+        uint8_t* out = dec->pixels + (oy * dec->width + ox) * 3;
+        out[0] = in[2];
+        out[1] = in[1];
+        out[2] = in[0];
+      } else {
+        // (r + 2g + b) / 4 is close enough to luma
+        dec->pixels[oy * dec->width + ox] = (in[0] + 2 * in[1] + in[2]) >> 2;
+      }
     }
   }
+  return true;
+}
 
-  connectWiFi();
-  Serial.println("[Ready] Waiting for trigger...");
-  Serial.println("[Polling] Checking backend every 2 seconds for capture trigger\n");
+// Decode to a malloc'd luma plane (caller frees). NULL on failure.
+uint8_t* decodeLuma(const camera_fb_t* fb, jpg_scale_t scale, int* width, int* height) {
+  FrameDecode dec = { fb, NULL, 0, 0, 1, NULL, 0, 0 };
+  if (esp_jpg_decode(fb->len, scale, frameReader, frameWriter, &dec) != ESP_OK) {
+    free(dec.pixels);
+    return NULL;
+  }
+  *width  = dec.width;
+  *height = dec.height;
+  return dec.pixels;
 }
 
-void loop() {
-  bool trigger = false;
+/*
+ * Decode fb at 1/scale into *px, keeping only crop (NULL: the whole
+ * frame). esp_jpg_decode only scales by powers of two up to 8. On
+ * failure px->bgr is NULL.
+ */
+bool decodePixels(const camera_fb_t* fb, int scale, const CropRect* crop, FramePixels* px) {
+  static const jpg_scale_t scales[] = { JPG_SCALE_NONE, JPG_SCALE_2X, JPG_SCALE_4X, JPG_SCALE_8X };
+  int shift = scale >= 8 ? 3 : scale >= 4 ? 2 : scale >= 2 ? 1 : 0;
+
+  FrameDecode dec = { fb, NULL, 0, 0, 3, crop, 0, 0 };
+  if (esp_jpg_decode(fb->len, scales[shift], frameReader, frameWriter, &dec) != ESP_OK) {
+    free(dec.pixels);
+    *px = { NULL, 0, 0, 1 << shift };
+    return false;
+  }
+  *px = { dec.pixels, dec.width, dec.height, 1 << shift };
+  return true;
+}
 
-  // Poll backend for trigger (every POLL_INTERVAL_MS)
-  if (millis() - lastPollTime > POLL_INTERVAL_MS) {
-    lastPollTime = millis();
-    if (WiFi.status() == WL_CONNECTED) {
-      if (checkTriggerFromBackend()) {
-        Serial.println("[Trigger] Backend capture request");
-        trigger = true;
+// Thumbnail scale for a frame: the smallest that brings it under
+// THUMB_MAX_WIDTH (1: the frame is already that small)
+int thumbnailScale(int width) {
+  int scale = 1;
+  while (scale < 8 && width / scale > THUMB_MAX_WIDTH) scale *= 2;
+  return scale;
+}
+
+// px box-averaged to 1/8 of the frame (what a 1/8 JPEG decode gives),
+// as BGR888 (channels 3) or luma (1). malloc'd; NULL on failure.
+uint8_t* eighthScale(const FramePixels& px, int channels, int* width, int* height) {
+  int factor = px.scale < 8 ? 8 / px.scale : 1;
+  *width  = px.width / factor;
+  *height = px.height / factor;
+  uint8_t* out = (uint8_t*)malloc(max(1, *width * *height * channels));
+  if (out) downscaleBgr(px.bgr, px.width, px.height, factor, out, channels);
+  return out;
+}
+
+/*
+ * Detection thumbnail: px scaled down until it fits THUMB_MAX_WIDTH and
+ * re-encoded. Vision labels a 320x240 shot as well as the full frame at
+ * a fraction of the upload. false (nothing to free) when the frame is
+ * already that small.
+ */
+bool makeThumbnail(const FramePixels& px, uint8_t** jpg, size_t* jpgLen) {
+  if (px.width * px.scale <= THUMB_MAX_WIDTH) return false;
+
+  int factor = thumbnailScale(px.width);
+  int width  = px.width / factor;
+  int height = px.height / factor;
+  uint8_t* pixels = px.bgr;
+  if (factor > 1) {
+    pixels = (uint8_t*)malloc(width * height * 3);
+    if (!pixels) return false;
+    downscaleBgr(px.bgr, px.width, px.height, factor, pixels, 3);
+  }
+
+  bool ok = fmt2jpg(pixels, width * height * 3, width, height, PIXFORMAT_RGB888, THUMB_QUALITY, jpg, jpgLen);
+  if (pixels != px.bgr) free(pixels);
+  if (ok) Serial.printf("[Thumb] %dx%d → %dx%d, %u bytes\n", px.width * px.scale, px.height * px.scale, width, height, *jpgLen);
+  return ok;
+}
+
+// Burst score of a frame (gradientEnergy of the 1/4-scale plane). 0 if
+// it won't decode, so a broken frame never beats a good one.
+uint32_t sharpnessScore(const camera_fb_t* fb) {
+  int width, height;
+  uint8_t* luma = decodeLuma(fb, SHARPNESS_SCALE, &width, &height);
+  if (!luma) return 0;
+
+  uint32_t score = gradientEnergy(luma, width, height);
+  free(luma);
+  return score;
+}
+
+// Change-detection hash of an upload (differenceHash of the 1/8-scale plane)
+bool pixelsHash(const FramePixels& px, uint64_t* hash) {
+  int width, height;
+  uint8_t* luma = eighthScale(px, 1, &width, &height);
+  if (!luma) return false;
+
+  bool ok = differenceHash(luma, width, height, hash);
+  free(luma);
+  return ok;
+}
+
+String hashToHex(uint64_t hash) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+  return String(hex);
+}
+
+/*
+ * Grab BURST_SIZE - 1 more frames after `best` (flash must still be on)
+ * and keep the sharpest. Holds at most two driver buffers at a time, so
+ * it only bursts when the upload pipeline leaves a buffer spare.
+ */
+camera_fb_t* pickSharpestFrame(camera_fb_t* best) {
+  if (BURST_SIZE <= 1 || uxSemaphoreGetCount(frameSlots) == 0) return best;
+
+  int64_t startUs = esp_timer_get_time();
+  uint32_t bestScore = sharpnessScore(best);
+  int bestIndex = 0;
+  int frames = 1;
+
+  for (int i = 1; i < BURST_SIZE; i++) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (!fb) break;
+    frames++;
+
+    uint32_t score = sharpnessScore(fb);
+    if (score > bestScore) {
+      esp_camera_fb_return(best);
+      best = fb;
+      bestScore = score;
+      bestIndex = i;
+    } else {
+      esp_camera_fb_return(fb);
+    }
+  }
+
+  Serial.printf("[Camera] Burst: picked frame %d/%d (score %u) in %lld ms\n",
+                bestIndex + 1, frames, (unsigned)bestScore, (esp_timer_get_time() - startUs) / 1000);
+  return best;
+}
+
+// ====================== REGION OF INTEREST ======================
+
+bool roiActive() {
+  return roi.w < 1000 || roi.h < 1000;
+}
+
+static bool roiValid(const CropRect& r) {
+  return r.w >= 100 && r.h >= 100 && r.x + r.w <= 1000 && r.y + r.h <= 1000;
+}
+
+static void printRoi() {
+  if (roiActive()) {
+    Serial.printf("[ROI] x %u y %u w %u h %u (per mille of the frame)\n", roi.x, roi.y, roi.w, roi.h);
+  } else {
+    Serial.println("[ROI] Off — full frame is uploaded");
+  }
+}
+
+void loadRoi() {
+  Preferences prefs;
+  if (prefs.begin(NVS_NAMESPACE, true)) {
+    CropRect r;
+    if (prefs.getBytes("roi", &r, sizeof(r)) == sizeof(r) && roiValid(r)) roi = r;
+    prefs.end();
+  }
+  printRoi();
+}
+
+/*
+ * Serial: "r" shows the ROI, "r off" clears it, "r <x> <y> <w> <h>"
+ * sets it (per mille of the frame) and saves it to NVS.
+ */
+void handleRoiCommand(String args) {
+  args.trim();
+  CropRect r = { 0, 0, 1000, 1000 };
+  if (args.length() == 0) {
+    printRoi();
+    return;
+  }
+  if (args != "off") {
+    unsigned x, y, w, h;
+    if (sscanf(args.c_str(), "%u %u %u %u", &x, &y, &w, &h) != 4) {
+      Serial.println("[ROI] Usage: r <x> <y> <w> <h> (0-1000) or r off");
+      return;
+    }
+    r = { (uint16_t)x, (uint16_t)y, (uint16_t)w, (uint16_t)h };
+    if (x > 1000 || y > 1000 || w > 1000 || h > 1000 || !roiValid(r)) {
+      Serial.println("[ROI] Must fit inside 0-1000 and be at least 100 wide and high");
+      return;
+    }
+  }
+
+  Preferences prefs;
+  if (prefs.begin(NVS_NAMESPACE, false)) {
+    prefs.putBytes("roi", &r, sizeof(r));
+    prefs.end();
+  }
+  roi = r;
+  printRoi();
+}
+
+/*
+ * Re-encode the ROI crop an upload decoded (decodePixels() at full scale
+ * with the ROI). The decoder still has to run over the whole JPEG; only
+ * the pixels inside the ROI are kept. Sensor windowing would save that,
+ * but it fights the capture tuner's frame-size changes; this works at any
+ * resolution. On success *cropped is a copy of *fb pointing at a
+ * malloc'd JPEG.
+ */
+bool cropFrame(const camera_fb_t* fb, const FramePixels& px, camera_fb_t* cropped) {
+  int64_t start = esp_timer_get_time();
+  uint8_t* jpg = NULL;
+  size_t jpgLen = 0;
+  bool ok = px.bgr && px.scale == 1 &&
+            fmt2jpg(px.bgr, px.width * px.height * 3, px.width, px.height,
+                    PIXFORMAT_RGB888, ROI_QUALITY, &jpg, &jpgLen);
+  int64_t elapsedUs = esp_timer_get_time() - start;
+
+  if (!ok || jpgLen >= fb->len) {
+    Serial.printf("[ROI] Crop %s — uploading the full frame\n", ok ? "saved nothing" : "failed");
+    free(jpg);
+    return false;
+  }
+
+  *cropped = *fb;
+  cropped->buf    = jpg;
+  cropped->len    = jpgLen;
+  cropped->width  = px.width;
+  cropped->height = px.height;
+
+  roiCrops++;
+  roiBytesSaved += fb->len - jpgLen;
+  roiEncodeUs   += elapsedUs;
+  Serial.printf("[ROI] %ux%u → %dx%d, %u → %u bytes (saved %u), encode %lld ms\n",
+                fb->width, fb->height, px.width, px.height,
+                fb->len, jpgLen, fb->len - jpgLen, elapsedUs / 1000);
+  return true;
+}
+
+void printRoiStats() {
+  printRoi();
+  if (roiCrops) {
+    Serial.printf("[ROI] %u crops, avg %llu bytes saved, avg %lld ms encode\n",
+                  (unsigned)roiCrops, roiBytesSaved / roiCrops, roiEncodeUs / roiCrops / 1000);
+  }
+}
+
+// ====================== PRE-CLASSIFIER ======================
+
+#ifdef BUMPBOX_PRECLASSIFIER
+/*
+ * Small TFLite Micro image classifier over the common priceMap labels.
+ * A confident result rides along with the upload as X-Device-Label and
+ * the server prices it without a Vision call; uncertain frames go to
+ * Vision as usual. The model (int8, NHWC input, one score per label)
+ * comes from src/preclassifier_model.h; the committed one is a zero-weight
+ * placeholder that never reports — see README.
+ */
+static tflite::MicroErrorReporter pcErrorReporter;
+static tflite::MicroInterpreter* pcInterpreter = NULL;
+static uint32_t pcRuns = 0;
+static uint32_t pcConfident = 0;
+static int64_t pcTotalUs = 0;
+
+bool initPreclassifier() {
+  const tflite::Model* model = tflite::GetModel(g_preclassifier_model);
+  if (model->version() != TFLITE_SCHEMA_VERSION) {
+    Serial.printf("[Preclass] Model schema %lu, expected %d — disabled\n", (unsigned long)model->version(), TFLITE_SCHEMA_VERSION);
+    return false;
+  }
+
+  static tflite::AllOpsResolver resolver;
+  uint8_t* arena = (uint8_t*)ps_malloc(PRECLASS_ARENA_KB * 1024);
+  if (!arena) return false;
+  pcInterpreter = new tflite::MicroInterpreter(model, resolver, arena, PRECLASS_ARENA_KB * 1024, &pcErrorReporter);
+  if (pcInterpreter->AllocateTensors() != kTfLiteOk) {
+    Serial.println("[Preclass] AllocateTensors failed — arena too small?");
+    delete pcInterpreter;
+    pcInterpreter = NULL;
+    free(arena);
+    return false;
+  }
+
+  TfLiteTensor* input = pcInterpreter->input(0);
+  Serial.printf("[Preclass] Ready: %dx%dx%d input, %d labels, arena %u/%u bytes used\n",
+                input->dims->data[2], input->dims->data[1], input->dims->data[3],
+                PRECLASSIFIER_LABEL_COUNT, pcInterpreter->arena_used_bytes(), PRECLASS_ARENA_KB * 1024);
+  return true;
+}
+
+bool preclassify(const FramePixels& px, DeviceLabel* out) {
+  if (!pcInterpreter || !px.bgr) return false;
+  int64_t start = esp_timer_get_time();
+
+  // 1/8 scale of the upload's pixels (80x60 from VGA), nearest-neighbour into the input
+  int width, height;
+  uint8_t* bgr = eighthScale(px, 3, &width, &height);
+  if (!bgr) return false;
+
+  TfLiteTensor* input = pcInterpreter->input(0);
+  PreclassQuant inQuant = { input->params.scale, (int)input->params.zero_point };
+  preclassFillInput(bgr, width, height, input->data.int8,
+                    input->dims->data[2], input->dims->data[1], input->dims->data[3], inQuant);
+  free(bgr);
+
+  if (pcInterpreter->Invoke() != kTfLiteOk) return false;
+
+  TfLiteTensor* output = pcInterpreter->output(0);
+  PreclassQuant outQuant = { output->params.scale, (int)output->params.zero_point };
+  float confidence;
+  int best = preclassBest(output->data.int8, PRECLASSIFIER_LABEL_COUNT, outQuant, &confidence);
+
+  int64_t elapsedUs = esp_timer_get_time() - start;
+  pcRuns++;
+  pcTotalUs += elapsedUs;
+  bool confident = confidence >= PRECLASS_MIN_CONF;
+  Serial.printf("[Preclass] %s %.0f%% in %lld ms%s\n", PRECLASSIFIER_LABELS[best], confidence * 100,
+                elapsedUs / 1000, confident ? " — reporting to server" : " — leaving it to Vision");
+  if (!confident) return false;
+
+  pcConfident++;
+  out->label = PRECLASSIFIER_LABELS[best];
+  out->confidence = confidence;
+  return true;
+}
+
+void printPreclassifierStats() {
+  if (!pcInterpreter) return;
+  Serial.printf("[Preclass] %u runs, %u confident, avg %lld ms, arena %u bytes\n",
+                (unsigned)pcRuns, (unsigned)pcConfident, pcRuns ? pcTotalUs / pcRuns / 1000 : 0LL,
+                pcInterpreter->arena_used_bytes());
+}
+#else
+bool initPreclassifier() { return false; }
+bool preclassify(const FramePixels& px, DeviceLabel* out) { return false; }
+void printPreclassifierStats() {}
+#endif
+
+// ====================== CAPTURE TUNING ======================
+
+size_t uploadBudget() {
+  size_t budget = MAX_UPLOAD_BYTES;
+  if (uplinkBytesPerSec > 0) {
+    budget = min(budget, (size_t)(uplinkBytesPerSec * UPLOAD_TARGET_MS / 1000));
+  }
+  return budget;
+}
+
+void applyCaptureRung(int rung, const char* why) {
+  rung = constrain(rung, captureTopRung, CAPTURE_RUNGS - 1);
+  if (rung == captureRung) return;
+
+  const CaptureRung& from = CAPTURE_LADDER[captureRung];
+  const CaptureRung& to   = CAPTURE_LADDER[rung];
+  sensor_t* s = esp_camera_sensor_get();
+  if (s) {
+    if (to.frameSize != from.frameSize) s->set_framesize(s, to.frameSize);
+    if (to.quality != from.quality)     s->set_quality(s, to.quality);
+  }
+  Serial.printf("[Tune] %ux%u q%d → %ux%u q%d (%s)\n",
+                resolution[from.frameSize].width, resolution[from.frameSize].height, from.quality,
+                resolution[to.frameSize].width, resolution[to.frameSize].height, to.quality, why);
+  captureRung = rung;
+}
+
+// Called after each capture with the size it produced
+void tuneCapture(size_t frameLen) {
+  size_t budget = uploadBudget();
+  if (frameLen > budget) {
+    applyCaptureRung(captureRung + 1, "over budget");
+  } else if (frameLen * 2 < budget) {
+    applyCaptureRung(captureRung - 1, "headroom");
+  }
+}
+
+// Upload task: fold one upload's wire rate into the EWMA
+void noteUplinkRate(size_t bytes, int64_t sendUs) {
+  if (bytes < MIN_RATE_SAMPLE || sendUs <= 0) return;
+
+  float rate = bytes * 1000000.0f / sendUs;
+  uplinkBytesPerSec = uplinkBytesPerSec > 0 ? uplinkBytesPerSec * 0.7f + rate * 0.3f : rate;
+  Serial.printf("[Tune] Uplink %.1f kB/s (avg %.1f kB/s), budget %u bytes\n",
+                rate / 1000, uplinkBytesPerSec / 1000, uploadBudget());
+}
+
+// ====================== ARMED MODE ======================
+
+void armCapture() {
+  armedAt = millis();
+  if (captureArmed) return;  // Already lit; just extend the timeout
+
+  xSemaphoreTake(flashMutex, portMAX_DELAY);
+  digitalWrite(FLASH_LED_PIN, HIGH);
+  armedSettledUs = esp_timer_get_time() + FLASH_WARMUP_MS * 1000LL;
+  captureArmed = true;
+  xSemaphoreGive(flashMutex);
+  Serial.println("[Camera] Armed — flash on, sensor streaming");
+}
+
+void disarmCapture() {
+  if (!captureArmed) return;
+
+  xSemaphoreTake(flashMutex, portMAX_DELAY);
+  captureArmed = false;
+  digitalWrite(FLASH_LED_PIN, LOW);
+  xSemaphoreGive(flashMutex);
+  Serial.println("[Camera] Disarmed");
+}
+
+// Driver timestamp (esp_timer clock) of when the frame started
+int64_t frameStartUs(const camera_fb_t* fb) {
+  return fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+}
+
+// Current OV2640 AEC exposure (16-bit, split over 3 regs) and AGC gain
+bool readExposure(sensor_t* s, int* exposure, int* gain) {
+  if (!s || !s->get_reg || s->id.PID != OV2640_PID) return false;
+
+  int hi  = s->get_reg(s, 0x145, 0x3F);  // Sensor bank: AEC[15:10]
+  int mid = s->get_reg(s, 0x110, 0xFF);  //              AEC[9:2]
+  int lo  = s->get_reg(s, 0x104, 0x03);  //              AEC[1:0]
+  int g   = s->get_reg(s, 0x100, 0xFF);  //              GAIN
+  if (hi < 0 || mid < 0 || lo < 0 || g < 0) return false;
+
+  *exposure = (hi << 10) | (mid << 2) | lo;
+  *gain = g;
+  return true;
+}
+
+/*
+ * Cold path: light the locker and grab frames until auto-exposure has
+ * converged on the flash — AEC/AGC unchanged between two lit frames, or
+ * JPEG size stable when the sensor registers can't be read. Frames
+ * started before the flash came on are skipped. SETTLE_MAX_MS caps the
+ * wait; the last frame is used either way.
+ */
+camera_fb_t* grabColdFrame() {
+  sensor_t* s = esp_camera_sensor_get();
+
+  xSemaphoreTake(flashMutex, portMAX_DELAY);
+  digitalWrite(FLASH_LED_PIN, HIGH);
+  int64_t flashOnUs = esp_timer_get_time();
+
+  camera_fb_t* fb = NULL;
+  int prevExposure = -1, prevGain = -1;
+  size_t prevLen = 0;
+  int frames = 0;
+  bool settled = false;
+
+  for (;;) {
+    fb = esp_camera_fb_get();
+    if (!fb) break;
+
+    if (frameStartUs(fb) < flashOnUs) {  // Pre-flash frame, still in the ring
+      esp_camera_fb_return(fb);
+      fb = NULL;
+      continue;
+    }
+    frames++;
+
+    int exposure, gain;
+    if (readExposure(s, &exposure, &gain)) {
+      settled = prevExposure >= 0 &&
+                abs(exposure - prevExposure) * 100 <= prevExposure * SETTLE_EXP_TOL &&
+                abs(gain - prevGain) <= 1;
+      prevExposure = exposure;
+      prevGain = gain;
+    } else {
+      settled = prevLen > 0 &&
+                (size_t)abs((int)fb->len - (int)prevLen) * 100 <= prevLen * SETTLE_LEN_TOL;
+      prevLen = fb->len;
+    }
+
+    if (settled || esp_timer_get_time() - flashOnUs > SETTLE_MAX_MS * 1000LL) break;
+    esp_camera_fb_return(fb);
+    fb = NULL;
+  }
+  int64_t settleUs = esp_timer_get_time() - flashOnUs;
+  recordSpan(captureTiming, STAGE_SETTLE, settleUs);
+  Serial.printf("[Camera] Exposure %s after %lld ms (%d lit frames)\n",
+                settled ? "settled" : "NOT settled (cap hit)", settleUs / 1000, frames);
+
+  if (fb) fb = pickSharpestFrame(fb);
+
+  digitalWrite(FLASH_LED_PIN, LOW);
+  xSemaphoreGive(flashMutex);
+  return fb;
+}
+
+// Armed path: the ring already holds lit frames; take the newest one.
+// Only a frame that started before the flash settled needs a re-grab.
+camera_fb_t* grabArmedFrame() {
+  camera_fb_t* fb = esp_camera_fb_get();
+  if (!fb) return NULL;
+
+  if (frameStartUs(fb) < armedSettledUs) {
+    esp_camera_fb_return(fb);
+    fb = esp_camera_fb_get();
+  }
+  return fb ? pickSharpestFrame(fb) : NULL;
+}
+
+void printCaptureStats() {
+  Serial.printf("[Camera] Trigger→frame: cold %u x avg %lld ms, armed %u x avg %lld ms\n",
+                (unsigned)coldCaptures,  coldCaptures  ? coldLatencyUs  / coldCaptures  / 1000 : 0LL,
+                (unsigned)armedCaptures, armedCaptures ? armedLatencyUs / armedCaptures / 1000 : 0LL);
+  const CaptureRung& r = CAPTURE_LADDER[captureRung];
+  Serial.printf("[Tune] Now %ux%u q%d, uplink %.1f kB/s, budget %u bytes\n",
+                resolution[r.frameSize].width, resolution[r.frameSize].height, r.quality,
+                uplinkBytesPerSec / 1000, uploadBudget());
+}
+
+// ====================== CAPTURE & SEND ======================
+
+/*
+ * Capture side of the pipeline: grab a frame and hand it to the upload
+ * task. Returns as soon as the frame is queued, so the next trigger can
+ * be captured while this one is still uploading.
+ */
+void captureAndSend() {
+  Serial.println("\n---------- CAPTURE ----------");
+
+  if (xSemaphoreTake(frameSlots, 0) != pdTRUE) {
+    triggersDropped++;
+    pendingTraceId[0] = '\0';  // Don't pin its trace on the next capture
+    Serial.println("[Camera] Upload pipeline full — trigger dropped");
+    blinkError(2, LED_WARN);
+    return;
+  }
+
+  UploadJob job = {};
+  job.timing.triggeredUs = esp_timer_get_time();
+  beginTrace(&job.timing);
+  captureTiming = &job.timing;
+
+  bool armed = captureArmed;
+  camera_fb_t* fb = armed ? grabArmedFrame() : grabColdFrame();
+  int64_t latencyUs = esp_timer_get_time() - job.timing.triggeredUs;
+  recordSpan(captureTiming, STAGE_FRAME, latencyUs);
+  job.timing.capturedWallMs = wallClockMs();
+  job.timing.armed = armed;
+  captureTiming = NULL;
+
+  if (armed) {
+    armedCaptures++;
+    armedLatencyUs += latencyUs;
+    disarmCapture();  // One shot per sell flow
+  } else {
+    coldCaptures++;
+    coldLatencyUs += latencyUs;
+  }
+
+  if (!fb) {
+    captureFailures++;
+    Serial.println("[Camera] Capture failed!");
+    xSemaphoreGive(frameSlots);
+    blinkError(5);
+    return;
+  }
+
+  Serial.printf("[Camera] %u bytes (%ux%u), trigger→frame %lld ms (%s)\n",
+                fb->len, fb->width, fb->height, latencyUs / 1000, armed ? "armed" : "cold");
+
+  // Too big for the server: re-grab two rungs lower rather than lose it
+  for (int retry = 0; fb && fb->len > MAX_UPLOAD_BYTES && retry < OVERSIZE_RETRIES; retry++) {
+    Serial.println("[Camera] Image exceeds 1MB server limit — retrying smaller");
+    esp_camera_fb_return(fb);
+    applyCaptureRung(captureRung + 2, "oversize");
+    fb = grabColdFrame();
+    if (fb) Serial.printf("[Camera] Retry: %u bytes (%ux%u)\n", fb->len, fb->width, fb->height);
+  }
+
+  if (!fb || fb->len > MAX_UPLOAD_BYTES) {
+    captureFailures++;
+    Serial.println("[Camera] No frame within the upload limit!");
+    if (fb) esp_camera_fb_return(fb);
+    xSemaphoreGive(frameSlots);
+    blinkError(4);
+    return;
+  }
+
+  tuneCapture(fb->len);
+
+  int sizeBucket = 0;
+  while (sizeBucket < FRAME_BUCKETS - 1 && fb->len > FRAME_BUCKET_BYTES[sizeBucket]) sizeBucket++;
+  frameSizeCounts[sizeBucket]++;
+  frameSizeSum += fb->len;
+
+  // Can't block: the queue holds fbCount entries and we own a slot
+  job.fb = fb;
+  job.timing.queuedUs = esp_timer_get_time();
+  xQueueSend(uploadQueue, &job, 0);
+  Serial.printf("[Camera] Queued for upload (%u pending)\n", uxQueueMessagesWaiting(uploadQueue));
+}
+
+/*
+ * Several pending frames in one request. Each is decoded once, cropped
+ * to the ROI and hashed as in uploadFrame(), but sent whole: no thumbnail
+ * stage and no "unchanged" shortcut — these are catching up, not a
+ * seller waiting.
+ */
+bool uploadBatch(camera_fb_t* const* frames, int count) {
+  const camera_fb_t* send[BATCH_MAX_FRAMES];
+  camera_fb_t cropped[BATCH_MAX_FRAMES];
+  bool isCropped[BATCH_MAX_FRAMES];
+  String hashes[BATCH_MAX_FRAMES];
+  uint64_t hash = 0;
+  bool hashed = false;
+
+  for (int i = 0; i < count; i++) {
+    bool cropping = roiActive();
+    FramePixels px;
+    bool decoded = decodePixels(frames[i], cropping ? 1 : 8, cropping ? &roi : NULL, &px);
+    hashed = decoded && pixelsHash(px, &hash);
+    isCropped[i] = cropping && decoded && cropFrame(frames[i], px, &cropped[i]);
+    free(px.bgr);
+    send[i] = isCropped[i] ? &cropped[i] : frames[i];
+    hashes[i] = hashed ? hashToHex(hash) : String();
+  }
+
+  bool ok = sendBatch(send, hashes, count) == 200;
+  if (ok) {
+    lastUploadHash = hash;  // Last frame of the batch is what the server has now
+    haveLastUploadHash = hashed;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (isCropped[i]) free(cropped[i].buf);
+  }
+  return ok;
+}
+
+// ====================== OFFLINE SPOOL ======================
+
+/*
+ * Store-and-forward for frames the network couldn't take (lib/Spool,
+ * host-tested). Entries drain oldest-first once WiFi is back, and while
+ * any are waiting new frames queue behind them to keep the order. This
+ * part is the LittleFS backing and the upload glue.
+ */
+class LittleFsSpool : public SpoolFs {
+public:
+  bool mkdir(const char* dir) override { return LittleFS.mkdir(dir); }
+
+  void list(const char* path, ListFn fn, void* ctx) override {
+    File dir = LittleFS.open(path);
+    if (!dir) return;
+    for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+      String name = f.name();
+      int slash = name.lastIndexOf('/');
+      if (slash >= 0) name = name.substring(slash + 1);
+      size_t size = f.size();
+      f.close();  // fn may remove it
+      fn(ctx, name.c_str(), size);
+    }
+    dir.close();
+  }
+
+  bool exists(const char* path) override { return LittleFS.exists(path); }
+
+  long size(const char* path) override {
+    File f = LittleFS.open(path, FILE_READ);
+    if (!f) return -1;
+    long size = f.size();
+    f.close();
+    return size;
+  }
+
+  bool remove(const char* path) override { return LittleFS.remove(path); }
+  bool rename(const char* from, const char* to) override { return LittleFS.rename(from, to); }
+
+  bool write(const char* path, const uint8_t* head, size_t headLen,
+             const uint8_t* data, size_t dataLen) override {
+    File f = LittleFS.open(path, FILE_WRITE);
+    bool ok = f && f.write(head, headLen) == headLen && f.write(data, dataLen) == dataLen;
+    if (f) f.close();
+    return ok;
+  }
+
+  size_t read(const char* path, size_t offset, uint8_t* out, size_t len) override {
+    File f = LittleFS.open(path, FILE_READ);
+    if (!f) return 0;
+    size_t n = f.seek(offset) ? f.read(out, len) : 0;
+    f.close();
+    return n;
+  }
+
+  size_t usedBytes() override { return LittleFS.usedBytes(); }
+  size_t totalBytes() override { return LittleFS.totalBytes(); }
+};
+
+LittleFsSpool spoolFs;
+Spool spool(spoolFs, SPOOL_DIR, SPOOL_MAX_FILES, SPOOL_MAX_BYTES);
+uint32_t bootId;  // Tells spooled frames from an earlier boot apart (spoolBegin)
+
+// Stamp for a frame taken at uptime capturedMs in this boot
+static SpoolStamp spoolStamp(uint32_t capturedMs) {
+  int64_t wallMs = wallClockMs();
+  SpoolStamp stamp = { bootId, capturedMs, wallMs ? wallMs - (uint32_t)(millis() - capturedMs) : 0 };
+  return stamp;
+}
+
+static void onSpoolDrop(SpoolDrop why, uint32_t seq) {
+  switch (why) {
+    case SPOOL_EVICTED:
+      Serial.printf("[Spool] Full — evicting capture #%lu\n", (unsigned long)seq);
+      break;
+    case SPOOL_UNREADABLE:
+      Serial.printf("[Spool] Capture #%lu unreadable — dropped\n", (unsigned long)seq);
+      break;
+    case SPOOL_DROPPED_REJECTED:
+      Serial.printf("[Spool] Server rejected capture #%lu — dropped\n", (unsigned long)seq);
+      break;
+  }
+}
+
+// Mount and rebuild the queue from the files left by the last boot
+void spoolBegin() {
+  if (!LittleFS.begin(true)) {
+    Serial.println("[Spool] LittleFS mount failed — offline captures disabled");
+    return;
+  }
+  bootId = esp_random();
+  spool.setDropListener(onSpoolDrop);
+  spool.begin();
+
+  Serial.printf("[Spool] %u queued capture(s), %u bytes (flash %u/%u used)\n",
+                (unsigned)spool.count(), spool.bytes(), LittleFS.usedBytes(), LittleFS.totalBytes());
+}
+
+bool spoolPush(const camera_fb_t* fb) {
+  if (!spool.push(spoolStamp((uint32_t)(frameStartUs(fb) / 1000)), fb->width, fb->height, fb->buf, fb->len)) {
+    if (spool.ready()) Serial.println("[Spool] Write failed — capture lost");
+    return false;
+  }
+  Serial.printf("[Spool] Saved capture #%lu (%u bytes), %u waiting\n",
+                (unsigned long)(spool.tail() - 1), fb->len, (unsigned)spool.count());
+  return true;
+}
+
+// Worth keeping the frame for later: network error or server-side failure
+bool uploadRetryable() {
+  return lastUploadCode < 0 || lastUploadCode >= 500;
+}
+
+// Spooled entry as a camera frame (buffer still owned by the spool)
+static camera_fb_t spooledFrame(const SpoolEntry& entry) {
+  camera_fb_t fb = {};
+  fb.buf    = entry.jpg;
+  fb.len    = entry.header.len;
+  fb.width  = entry.header.width;
+  fb.height = entry.header.height;
+  fb.format = PIXFORMAT_JPEG;
+  return fb;
+}
+
+// SpoolSender: one entry through uploadFrame(), several through
+// uploadBatch(). A batch the server refuses outright stays queued and
+// switches batching off (spoolDrainBatch then goes one at a time).
+static SpoolResult sendSpooled(void*, const SpoolEntry* entries, int count) {
+  camera_fb_t fbs[BATCH_MAX_FRAMES];
+  camera_fb_t* frames[BATCH_MAX_FRAMES];
+  count = min(count, BATCH_MAX_FRAMES);
+  for (int i = 0; i < count; i++) {
+    fbs[i] = spooledFrame(entries[i]);
+    frames[i] = &fbs[i];
+  }
+
+  bool ok;
+  if (count == 1) {
+    int64_t ageMs = spoolAgeMs(entries[0].header.stamp, spoolStamp(millis()));
+    if (ageMs >= 0) {
+      Serial.printf("[Spool] Uploading capture #%lu (taken %lu s ago), %u left\n",
+                    (unsigned long)entries[0].seq, (unsigned long)(ageMs / 1000), (unsigned)(spool.count() - 1));
+    } else {
+      Serial.printf("[Spool] Uploading capture #%lu (taken before restart), %u left\n",
+                    (unsigned long)entries[0].seq, (unsigned)(spool.count() - 1));
+    }
+    ok = uploadFrame(frames[0]);
+  } else {
+    Serial.printf("[Spool] Uploading captures #%lu-#%lu as a batch, %u left after\n",
+                  (unsigned long)entries[0].seq, (unsigned long)entries[count - 1].seq, (unsigned)(spool.count() - count));
+    ok = uploadBatch(frames, count);
+    if (!ok && !uploadRetryable()) {
+      Serial.println("[HTTP] Server refused the batch — uploading one at a time");
+      batchRefused = true;
+      return SPOOL_RETRY;
+    }
+  }
+
+  if (ok) return SPOOL_SENT;
+  return uploadRetryable() ? SPOOL_RETRY : SPOOL_REJECTED;
+}
+
+/*
+ * Upload the oldest spooled capture. Returns false if it failed in a
+ * way worth retrying (the entry stays); a rejected entry is dropped.
+ */
+bool spoolDrainOne() {
+  return spool.drainOne(sendSpooled, NULL);
+}
+
+/*
+ * Upload the oldest few spooled captures as one batch (up to
+ * BATCH_MAX_FRAMES / BATCH_MAX_BYTES). Same return as spoolDrainOne();
+ * falls back to it when there's only one, or the server refuses batches.
+ */
+bool spoolDrainBatch() {
+  if (batchRefused) return spoolDrainOne();
+  if (spool.drainBatch(BATCH_MAX_FRAMES, BATCH_MAX_BYTES, sendSpooled, NULL)) return true;
+  return batchRefused ? spoolDrainOne() : false;
+}
+
+// ====================== METRICS ======================
+
+/*
+ * Prometheus text exposition on METRICS_PORT, served by its own
+ * low-priority task on the network core — never on the capture path.
+ * Values are read without locks (a scrape may see a torn update). The
+ * cost of rendering and sending is itself exported.
+ */
+WiFiServer metricsServer(METRICS_PORT);
+uint32_t metricsScrapes = 0;
+uint64_t metricsBusyUs  = 0;  // Render + send, summed
+uint32_t metricsLastUs  = 0;
+
+static void metricHeader(String& out, const char* name, const char* type, const char* help) {
+  out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+  out += "# TYPE "; out += name; out += " "; out += type; out += "\n";
+}
+
+static void metricValue(String& out, const char* name, const char* labels, double value) {
+  char line[160];
+  snprintf(line, sizeof(line), "%s%s %.6g\n", name, labels, value);
+  out += line;
+}
+
+static void metric(String& out, const char* name, const char* type, const char* help, double value) {
+  metricHeader(out, name, type, help);
+  metricValue(out, name, "", value);
+}
+
+String renderMetrics() {
+  String out;
+  out.reserve(8192);
+  char labels[64];
+
+  metric(out, "bumpbox_uptime_seconds", "gauge", "Seconds since boot", millis() / 1000.0);
+
+  metricHeader(out, "bumpbox_captures_total", "counter", "Frames captured, by path");
+  metricValue(out, "bumpbox_captures_total", "{path=\"cold\"}", coldCaptures);
+  metricValue(out, "bumpbox_captures_total", "{path=\"armed\"}", armedCaptures);
+  metricHeader(out, "bumpbox_trigger_to_frame_seconds", "summary", "Trigger to frame in hand, by path");
+  metricValue(out, "bumpbox_trigger_to_frame_seconds_sum", "{path=\"cold\"}", coldLatencyUs / 1e6);
+  metricValue(out, "bumpbox_trigger_to_frame_seconds_count", "{path=\"cold\"}", coldCaptures);
+  metricValue(out, "bumpbox_trigger_to_frame_seconds_sum", "{path=\"armed\"}", armedLatencyUs / 1e6);
+  metricValue(out, "bumpbox_trigger_to_frame_seconds_count", "{path=\"armed\"}", armedCaptures);
+  metric(out, "bumpbox_capture_failures_total", "counter", "Captures with no usable frame", captureFailures);
+  metric(out, "bumpbox_triggers_dropped_total", "counter", "Triggers dropped with the upload pipeline full", triggersDropped);
+
+  metricHeader(out, "bumpbox_frame_bytes", "histogram", "JPEG size of captured frames");
+  uint32_t cumulative = 0;
+  for (int i = 0; i < FRAME_BUCKETS; i++) {
+    cumulative += frameSizeCounts[i];
+    if (i < FRAME_BUCKETS - 1) snprintf(labels, sizeof(labels), "{le=\"%u\"}", (unsigned)FRAME_BUCKET_BYTES[i]);
+    else                       snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+    metricValue(out, "bumpbox_frame_bytes_bucket", labels, cumulative);
+  }
+  metricValue(out, "bumpbox_frame_bytes_sum", "", frameSizeSum);
+  metricValue(out, "bumpbox_frame_bytes_count", "", cumulative);
+
+  metricHeader(out, "bumpbox_uploads_total", "counter", "Upload requests, by result");
+  metricValue(out, "bumpbox_uploads_total", "{result=\"ok\"}", uploadsOk);
+  metricValue(out, "bumpbox_uploads_total", "{result=\"error\"}", uploadsFailed);
+  metric(out, "bumpbox_upload_bytes_total", "counter", "Upload request body bytes sent", uploadBytes);
+  metric(out, "bumpbox_uplink_bytes_per_second", "gauge", "Smoothed measured upload rate", uplinkBytesPerSec);
+
+  metricHeader(out, "bumpbox_stage_seconds", "histogram", "Capture path latency per stage");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    const SpanHistogram& h = spanHistograms[s];
+    cumulative = 0;
+    for (int i = 0; i < SPAN_BUCKETS; i++) {
+      cumulative += h.counts[i];
+      if (i < SPAN_BUCKETS - 1) snprintf(labels, sizeof(labels), "{stage=\"%s\",le=\"%g\"}", STAGE_NAMES[s], SPAN_BUCKET_MS[i] / 1000.0);
+      else                      snprintf(labels, sizeof(labels), "{stage=\"%s\",le=\"+Inf\"}", STAGE_NAMES[s]);
+      metricValue(out, "bumpbox_stage_seconds_bucket", labels, cumulative);
+    }
+    snprintf(labels, sizeof(labels), "{stage=\"%s\"}", STAGE_NAMES[s]);
+    metricValue(out, "bumpbox_stage_seconds_sum", labels, h.sumUs / 1e6);
+    metricValue(out, "bumpbox_stage_seconds_count", labels, h.n);
+  }
+
+  metric(out, "bumpbox_poll_requests_total", "counter", "Trigger long polls sent", pollReuses + pollConnects);
+  metric(out, "bumpbox_poll_failures_total", "counter", "Trigger long polls that failed or timed out", pollFailures);
+  metric(out, "bumpbox_push_connected", "gauge", "1 while the trigger push stream is live", pushReady ? 1 : 0);
+  metric(out, "bumpbox_push_disconnects_total", "counter", "Trigger push stream drops", pushDisconnects);
+  metric(out, "bumpbox_spool_frames", "gauge", "Captures waiting in the offline spool", spool.count());
+  metric(out, "bumpbox_spool_bytes", "gauge", "Bytes used by the offline spool", spool.bytes());
+
+  metric(out, "bumpbox_wifi_rssi_dbm", "gauge", "WiFi signal strength", WiFi.RSSI());
+  metric(out, "bumpbox_wifi_connects_total", "counter", "WiFi connections made (first one plus reconnects)", wifiStats().connects);
+  metric(out, "bumpbox_wifi_fast_connects_total", "counter", "WiFi connections made via the cached AP and lease", wifiStats().fastConnects);
+  metric(out, "bumpbox_wifi_connect_seconds", "gauge", "Duration of the last WiFi connect", wifiStats().connectMs / 1000.0);
+  metricHeader(out, "bumpbox_wifi_connect_duration_seconds", "summary", "WiFi connect durations, by path");
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_sum", "{path=\"cached\"}", wifiStats().fastConnectMsTotal / 1000.0);
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_count", "{path=\"cached\"}", wifiStats().fastConnects);
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_sum", "{path=\"cached_dhcp\"}", wifiStats().apConnectMsTotal / 1000.0);
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_count", "{path=\"cached_dhcp\"}", wifiStats().apConnects);
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_sum", "{path=\"scan_dhcp\"}", wifiStats().fullConnectMsTotal / 1000.0);
+  metricValue(out, "bumpbox_wifi_connect_duration_seconds_count", "{path=\"scan_dhcp\"}",
+              wifiStats().connects - wifiStats().fastConnects - wifiStats().apConnects);
+  metric(out, "bumpbox_wifi_lease_renewals_total", "counter", "Cached DHCP leases renewed while the link was up", wifiStats().leaseRenewals);
+
+  metric(out, "bumpbox_heap_free_bytes", "gauge", "Free internal heap", ESP.getFreeHeap());
+  metric(out, "bumpbox_heap_min_free_bytes", "gauge", "Lowest free internal heap since boot", ESP.getMinFreeHeap());
+  metric(out, "bumpbox_psram_free_bytes", "gauge", "Free PSRAM", ESP.getFreePsram());
+  metric(out, "bumpbox_psram_min_free_bytes", "gauge", "Lowest free PSRAM since boot", ESP.getMinFreePsram());
+
+  metric(out, "bumpbox_metrics_scrapes_total", "counter", "Scrapes served", metricsScrapes);
+  metric(out, "bumpbox_metrics_busy_seconds_total", "counter", "Time spent rendering and sending scrapes", metricsBusyUs / 1e6);
+  metric(out, "bumpbox_metrics_last_scrape_seconds", "gauge", "Render + send time of the previous scrape", metricsLastUs / 1e6);
+  return out;
+}
+
+// Serve one request: GET /metrics, anything else 404
+static void serveMetrics(WiFiClient& client) {
+  client.setTimeout(2);
+  String requestLine = client.readStringUntil('\n');
+  while (client.connected()) {  // Skip headers
+    String line = client.readStringUntil('\n');
+    if (line.length() <= 1) break;
+  }
+
+  int64_t start = esp_timer_get_time();
+  if (!requestLine.startsWith("GET /metrics")) {
+    client.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    return;
+  }
+
+  String body = renderMetrics();
+  client.printf("HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %u\r\n"
+                "Connection: close\r\n\r\n", body.length());
+  client.write((const uint8_t*)body.c_str(), body.length());
+
+  metricsLastUs = esp_timer_get_time() - start;
+  metricsBusyUs += metricsLastUs;
+  metricsScrapes++;
+}
+
+void metricsTask(void* param) {
+  metricsServer.begin();
+  for (;;) {
+    WiFiClient client = metricsServer.available();
+    if (client) {
+      serveMetrics(client);
+      client.stop();
+    }
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+}
+
+// ====================== TASKS ======================
+
+/*
+ * Upload one frame — or just "unchanged" if it matches the last upload.
+ * The frame is decoded once: at full scale cropped to the ROI (if set),
+ * else whole at thumbnail scale. The hash, pre-classifier input and
+ * thumbnail all come from those pixels, and the crop is only re-encoded
+ * once the frame turns out to have changed.
+ */
+bool uploadFrame(camera_fb_t* fb) {
+  bool cropping = roiActive();
+  int thumbScale = thumbnailScale(fb->width);
+  FramePixels px;
+  int64_t start = esp_timer_get_time();
+  bool decoded = cropping ? decodePixels(fb, 1, &roi, &px)
+                          : decodePixels(fb, thumbScale > 1 ? thumbScale : 8, NULL, &px);
+  recordSpan(uploadTiming, STAGE_DECODE, esp_timer_get_time() - start);
+
+  uint64_t hash;
+  start = esp_timer_get_time();
+  bool hashed = decoded && pixelsHash(px, &hash);
+  recordSpan(uploadTiming, STAGE_HASH, esp_timer_get_time() - start);
+
+  if (hashed && haveLastUploadHash) {
+    int distance = hashDistance(hash, lastUploadHash);
+    if (distance <= UNCHANGED_MAX_BITS) {
+      Serial.printf("[Change] Frame matches last upload (%d/64 bits differ) — skipping image\n", distance);
+      int code = sendUnchanged(hashToHex(lastUploadHash));
+      if (code != 409) {
+        free(px.bgr);
+        return code == 200;
       }
+      Serial.println("[Change] Server has no matching detection — sending image");
+    } else {
+      Serial.printf("[Change] Contents changed (%d/64 bits differ)\n", distance);
     }
   }
 
-  // Button check (active LOW, with debounce)
-  if (digitalRead(BUTTON_PIN) == LOW && millis() - lastButtonPress > DEBOUNCE_MS) {
-    lastButtonPress = millis();
-    Serial.println("[Trigger] Button pressed");
-    trigger = true;
+  // If the crop saves nothing the whole frame goes up, but the thumbnail
+  // and pre-classifier still work from the crop's pixels
+  camera_fb_t cropped;
+  bool isCropped = false;
+  if (cropping && decoded) {
+    start = esp_timer_get_time();
+    isCropped = cropFrame(fb, px, &cropped);
+    recordSpan(uploadTiming, STAGE_CROP, esp_timer_get_time() - start);
   }
+  const camera_fb_t* frame = isCropped ? &cropped : fb;
+
+  // Progressive upload: the thumbnail gets the price estimate to the
+  // seller first, then the full frame follows as the listing photo. The
+  // full frame needs the hash to find its detection on the server.
+  String hex = hashed ? hashToHex(hash) : String();
+  DeviceLabel label;
+  const DeviceLabel* hint = decoded && preclassify(px, &label) ? &label : NULL;
+  uint8_t* thumb = NULL;
+  size_t thumbLen = 0;
+  bool ok;
+  start = esp_timer_get_time();
+  bool haveThumb = hashed && makeThumbnail(px, &thumb, &thumbLen);
+  if (haveThumb) recordSpan(uploadTiming, STAGE_THUMB, esp_timer_get_time() - start);
+  free(px.bgr);
+  if (haveThumb) {
+    ok = sendToServer(thumb, thumbLen, hex, true, hint);
+    free(thumb);
+    if (ok && !sendFullImage(frame->buf, frame->len, hex)) {
+      Serial.println("[HTTP] Full photo not attached — listing keeps the thumbnail");
+    }
+  } else {
+    ok = sendToServer(frame->buf, frame->len, hex, false, hint);
+  }
+  if (isCropped) free(cropped.buf);
 
-  // Serial command check
-  if (Serial.available()) {
-    char cmd = Serial.read();
-    while (Serial.available()) Serial.read();  // drain buffer
-    if (cmd == 'c' || cmd == 'C') {
-      Serial.println("[Trigger] Serial command");
-      trigger = true;
+  if (ok) {
+    lastUploadHash = hash;
+    haveLastUploadHash = hashed;
+  }
+  return ok;
+}
+
+// Upload one frame; keep it for later if that failed but may work later.
+// Once anything is spooled, later frames go straight behind it.
+static bool uploadOrSpool(camera_fb_t* fb, int* spooled) {
+  if (spool.count() == 0) {
+    if (uploadFrame(fb)) return true;
+    if (!uploadRetryable()) return false;
+  }
+  *spooled += spoolPush(fb);
+  return false;
+}
+
+// Network core: upload queued frames in order, then give the buffer back
+// and work through the offline spool when there's nothing new
+void uploadTask(void* param) {
+  UploadJob jobs[BATCH_MAX_FRAMES];
+  camera_fb_t* frames[BATCH_MAX_FRAMES];
+  for (;;) {
+    if (xQueueReceive(uploadQueue, &jobs[0], pdMS_TO_TICKS(1000)) == pdTRUE) {
+      // More frames already waiting (burst, or triggers during a slow
+      // upload): take them too and send them as one batch
+      int count = 1;
+      while (count < BATCH_MAX_FRAMES && xQueueReceive(uploadQueue, &jobs[count], 0) == pdTRUE) count++;
+      for (int i = 0; i < count; i++) {
+        frames[i] = jobs[i].fb;
+        recordSpan(&jobs[i].timing, STAGE_QUEUE, esp_timer_get_time() - jobs[i].timing.queuedUs);
+      }
+      // Per-capture spans only for single uploads; batches still feed the histograms
+      uploadTiming = count == 1 ? &jobs[0].timing : NULL;
+
+      bool ok = false;
+      int spooled = 0;
+      if (wifiLinkUp() && spool.count() == 0) {
+        bool individually = count == 1 || batchRefused;
+        if (!individually) {
+          ok = uploadBatch(frames, count);
+          if (!ok && uploadRetryable()) {
+            for (int i = 0; i < count; i++) spooled += spoolPush(frames[i]);
+          } else if (!ok) {
+            Serial.println("[HTTP] Server refused the batch — uploading one at a time");
+            batchRefused = individually = true;
+          }
+        }
+        if (individually) {
+          ok = true;
+          for (int i = 0; i < count; i++) ok = uploadOrSpool(frames[i], &spooled) && ok;
+        }
+      } else {
+        Serial.println(spool.count() ? "[Spool] Queuing behind earlier captures" : "[Spool] No WiFi — saving for later");
+        for (int i = 0; i < count; i++) spooled += spoolPush(frames[i]);
+      }
+      uploadTiming = NULL;
+      for (int i = 0; i < count; i++) {
+        esp_camera_fb_return(frames[i]);
+        xSemaphoreGive(frameSlots);
+      }
+
+      if (ok) {
+        flashLED(2, 100);  // Success: 2 short blinks
+      } else if (spooled) {
+        flashLED(1, 400);  // Saved offline: 1 long blink
+      } else {
+        blinkError(5);
+      }
+      continue;
+    }
+
+    if (spool.count() && wifiLinkUp() && (long)(millis() - spoolRetryAt) >= 0) {
+      if (!spoolDrainBatch()) {
+        Serial.printf("[Spool] Upload failed — retrying in %d s\n", SPOOL_RETRY_MS / 1000);
+        spoolRetryAt = millis() + SPOOL_RETRY_MS;
+      }
     }
   }
+}
+
+// Link changes, on the trigger task (via wifiService)
+static void onTriggerLinkChange(LinkEvent event) {
+  if (event == LINK_DOWN) {
+    closePushChannel("WiFi down");
+    cancelTriggerPoll();
+  } else {
+    pushLastAttempt = millis() - PUSH_RETRY_MS - 1;  // Reopen the push stream right away
+    spoolRetryAt = millis();                          // Drain the offline spool now
+  }
+}
+
+/*
+ * Network core: the WiFi link and the backend trigger sources. Opening
+ * the push stream or a poll socket is a DNS lookup plus a TCP connect of
+ * up to PUSH_CONNECT_MS, retried while the backend is unreachable, so it
+ * happens here and not on the capture task; triggers cross over on
+ * backendEvents.
+ */
+void triggerTask(void* param) {
+  for (;;) {
+    wifiService();
 
-  if (trigger) {
-    if (WiFi.status() != WL_CONNECTED) {
-      Serial.println("[WiFi] Reconnecting...");
-      connectWiFi();
+    // Push channel delivers backend triggers instantly when it's up
+    if (wifiLinkUp() && checkPushChannel()) {
+      Serial.println("[Trigger] Backend push");
     }
-    if (WiFi.status() == WL_CONNECTED) {
-      captureAndSend();
+
+    // Long-poll the backend for triggers while push is down
+    if (!pushReady && wifiLinkUp()) {
+      if (checkTriggerFromBackend()) {
+        Serial.println("[Trigger] Backend capture request");
+      }
     } else {
-      Serial.println("[Error] No WiFi — cannot send image");
+      cancelTriggerPoll();
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(20));
+  }
+}
+
+// Capture core: watch every trigger source and capture on demand
+void captureTask(void* param) {
+  for (;;) {
+    bool trigger = false;
+
+    // Backend triggers and arm requests from the trigger task. Waiting
+    // here paces the loop and wakes it as soon as one arrives.
+    BackendEvent event;
+    if (xQueueReceive(backendEvents, &event, pdMS_TO_TICKS(50)) == pdTRUE) {
+      if (event.arm) {
+        armCapture();
+      } else {
+        strlcpy(pendingTraceId, event.traceId, sizeof(pendingTraceId));
+        trigger = true;
+      }
+    }
+
+    // Button check (active LOW, with debounce)
+    if (digitalRead(BUTTON_PIN) == LOW && millis() - lastButtonPress > DEBOUNCE_MS) {
+      lastButtonPress = millis();
+      Serial.println("[Trigger] Button pressed");
+      trigger = true;
+    }
+
+    // Serial command check
+    if (Serial.available()) {
+      char cmd = Serial.read();
+      String args = (cmd == 'r' || cmd == 'R') ? Serial.readStringUntil('\n') : String();
+      while (Serial.available()) Serial.read();  // drain buffer
+      if (cmd == 'c' || cmd == 'C') {
+        Serial.println("[Trigger] Serial command");
+        trigger = true;
+      } else if (cmd == 'a' || cmd == 'A') {
+        if (captureArmed) disarmCapture();
+        else              armCapture();
+      } else if (cmd == 's' || cmd == 'S') {
+        printSessionStats();
+        printCaptureStats();
+        printRoiStats();
+        printPreclassifierStats();
+      } else if (cmd == 'r' || cmd == 'R') {
+        handleRoiCommand(args);
+      } else if (cmd == 't' || cmd == 'T') {
+        printLatencyHistograms();
+      }
+    }
+
+    if (captureArmed && millis() - armedAt > ARM_TIMEOUT_MS) {
+      Serial.println("[Camera] Arm timeout");
+      disarmCapture();
+    }
+
+    if (trigger) {
+      captureAndSend();  // Offline frames go to the flash spool
+    }
+  }
+}
+
+// ====================== SETUP & LOOP ======================
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  Serial.println();
+  Serial.println("========================================");
+  Serial.println("  BumpBox ESP32-CAM v1.0");
+  Serial.println("  Smart Locker Camera System");
+  Serial.println("----------------------------------------");
+  Serial.println("  Trigger: button (GPIO 13) or type 'c'");
+  Serial.println("  Arm:     type 'a' (flash on, instant capture)");
+  Serial.println("  Stats:   type 's' (latency histograms: 't')");
+  Serial.println("  Crop:    type 'r x y w h' (per mille) or 'r off'");
+  Serial.println("========================================");
+  Serial.println();
+
+  pinMode(BUTTON_PIN, INPUT_PULLUP);
+  flashMutex = xSemaphoreCreateMutex();
+  ledBegin();
+
+  if (!initCamera()) {
+    Serial.println("[FATAL] Camera init failed. Halting.");
+    while (true) {
       blinkError(3);
+      delay(2000);
     }
   }
+  loadRoi();
+  spoolBegin();
+  initPreclassifier();
+
+  uploadQueue = xQueueCreate(fbCount, sizeof(UploadJob));
+  backendEvents = xQueueCreate(4, sizeof(BackendEvent));
+  frameSlots  = xSemaphoreCreateCounting(fbCount, fbCount);
 
-  delay(50);
+  onLinkChange(onTriggerLinkChange);
+  wifiBegin(WIFI_SSID, WIFI_PASSWORD, NVS_NAMESPACE, NTP_SERVER_1, NTP_SERVER_2);  // Connects in the background; captures meanwhile go to the spool
+  Serial.println("[Ready] Waiting for trigger...");
+  Serial.println("[Push] Listening for capture triggers on the backend stream");
+  Serial.println("[Polling] Long-polling the backend while the stream is down\n");
+
+  xTaskCreatePinnedToCore(uploadTask,  "upload",  TASK_STACK_SIZE, NULL, 1, NULL, NETWORK_CORE);
+  xTaskCreatePinnedToCore(triggerTask, "trigger", TASK_STACK_SIZE, NULL, 1, NULL, NETWORK_CORE);
+  xTaskCreatePinnedToCore(captureTask, "capture", TASK_STACK_SIZE, NULL, 1, NULL, CAPTURE_CORE);
+  xTaskCreatePinnedToCore(metricsTask, "metrics", METRICS_STACK_SIZE, NULL, 0, NULL, NETWORK_CORE);
+}
+
+void loop() {
+  // All work happens in captureTask / uploadTask / triggerTask
+  vTaskDelete(NULL);
 }
@@ -0,0 +1,277 @@
+/*
+ * Host tests and a benchmark for lib/FrameAnalysis, on synthetic luma
+ * planes the size main.cpp decodes from a VGA frame: 160x120 for burst
+ * scoring (1/4 scale), 80x60 for the change hash (1/8 scale). The
+ * downscale runs on a BGR version of the same scene.
+ *
+ *   pio test -e native
+ */
+#include <unity.h>
+#include <FrameAnalysis.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static const int SCORE_W = 160, SCORE_H = 120;
+static const int HASH_W = 80, HASH_H = 60;
+static const int UNCHANGED_MAX_BITS = 6;  // Same as main.cpp
+
+typedef std::vector<uint8_t> Plane;
+
+static uint32_t seed;
+static int noise(int amplitude) {
+  seed = seed * 1664525u + 1013904223u;
+  return (int)(seed >> 24) % (2 * amplitude + 1) - amplitude;
+}
+
+static uint8_t clamp(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Locker interior: the flash lights the middle brightest and the floor
+// more than the roof, and an item (a textured, shaded box) sits at (x, y) with
+// size w x h, all in plane pixels. (On a perfectly even wall neighbouring
+// hash cells tie, and noise alone flips their bits.)
+static Plane scene(int width, int height, int x, int y, int w, int h, int brightness = 0) {
+  Plane p(width * height);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      int v = 60 + 60 * j / height + 60 - 120 * abs(2 * i - width) / (2 * width);
+      if (i >= x && i < x + w && j >= y && j < y + h) {
+        v = 220 - 120 * (i - x) / w + (((i / 3 + j / 3) & 1) ? 25 : -25);  // Lit from the left
+      }
+      p[j * width + i] = clamp(v + brightness);
+    }
+  }
+  return p;
+}
+
+// 3x3 box blur, `passes` times: motion / focus blur
+static Plane blur(Plane p, int width, int height, int passes) {
+  for (int n = 0; n < passes; n++) {
+    Plane out(p);
+    for (int j = 1; j < height - 1; j++) {
+      for (int i = 1; i < width - 1; i++) {
+        int sum = 0;
+        for (int dj = -1; dj <= 1; dj++) {
+          for (int di = -1; di <= 1; di++) sum += p[(j + dj) * width + i + di];
+        }
+        out[j * width + i] = sum / 9;
+      }
+    }
+    p = out;
+  }
+  return p;
+}
+
+static Plane addNoise(Plane p, int amplitude) {
+  for (size_t i = 0; i < p.size(); i++) p[i] = clamp(p[i] + noise(amplitude));
+  return p;
+}
+
+static Plane scale(Plane p, int percent) {
+  for (size_t i = 0; i < p.size(); i++) p[i] = p[i] * percent / 100;
+  return p;
+}
+
+// The scene as gray BGR888, as an upload decodes it
+static Plane toBgr(const Plane& luma) {
+  Plane bgr(luma.size() * 3);
+  for (size_t i = 0; i < luma.size(); i++) bgr[i * 3] = bgr[i * 3 + 1] = bgr[i * 3 + 2] = luma[i];
+  return bgr;
+}
+
+void setUp() {
+  seed = 12345;
+}
+
+void tearDown() {}
+
+void test_gradient_flat_is_zero() {
+  Plane flat(SCORE_W * SCORE_H, 128);
+  TEST_ASSERT_EQUAL_UINT32(0, gradientEnergy(flat.data(), SCORE_W, SCORE_H));
+}
+
+// Columns alternating 0/255: dx² = 255² everywhere, dy = 0
+void test_gradient_exact() {
+  Plane stripes(4 * 3);
+  for (int j = 0; j < 3; j++) {
+    for (int i = 0; i < 4; i++) stripes[j * 4 + i] = (i & 1) ? 255 : 0;
+  }
+  TEST_ASSERT_EQUAL_UINT32(255 * 255, gradientEnergy(stripes.data(), 4, 3));
+}
+
+void test_gradient_too_small() {
+  uint8_t one[2] = { 0, 255 };
+  TEST_ASSERT_EQUAL_UINT32(0, gradientEnergy(one, 2, 1));
+  TEST_ASSERT_EQUAL_UINT32(0, gradientEnergy(one, 1, 2));
+}
+
+// The sharp frame of a burst beats blurred and half-lit ones
+void test_gradient_ranks_burst() {
+  Plane sharp = scene(SCORE_W, SCORE_H, 50, 30, 60, 60);
+  uint32_t sharpScore = gradientEnergy(sharp.data(), SCORE_W, SCORE_H);
+  uint32_t lastScore = sharpScore;
+  for (int passes = 1; passes <= 3; passes++) {
+    Plane blurred = blur(sharp, SCORE_W, SCORE_H, passes);
+    uint32_t score = gradientEnergy(blurred.data(), SCORE_W, SCORE_H);
+    TEST_ASSERT_TRUE(score < lastScore);
+    lastScore = score;
+  }
+  Plane dim = scale(sharp, 50);
+  TEST_ASSERT_TRUE(gradientEnergy(dim.data(), SCORE_W, SCORE_H) < sharpScore);
+}
+
+void test_hash_deterministic() {
+  Plane p = scene(HASH_W, HASH_H, 20, 10, 30, 30);
+  uint64_t a, b;
+  TEST_ASSERT_TRUE(differenceHash(p.data(), HASH_W, HASH_H, &a));
+  TEST_ASSERT_TRUE(differenceHash(p.data(), HASH_W, HASH_H, &b));
+  TEST_ASSERT_TRUE(a == b);
+}
+
+// Same contents under sensor noise and an exposure shift: still "unchanged"
+void test_hash_tolerates_noise_and_exposure() {
+  Plane p = scene(HASH_W, HASH_H, 20, 10, 30, 30);
+  uint64_t base, other;
+  TEST_ASSERT_TRUE(differenceHash(p.data(), HASH_W, HASH_H, &base));
+
+  Plane noisy = addNoise(p, 6);
+  TEST_ASSERT_TRUE(differenceHash(noisy.data(), HASH_W, HASH_H, &other));
+  TEST_ASSERT_TRUE(hashDistance(base, other) <= UNCHANGED_MAX_BITS);
+
+  Plane brighter = scene(HASH_W, HASH_H, 20, 10, 30, 30, 15);
+  TEST_ASSERT_TRUE(differenceHash(brighter.data(), HASH_W, HASH_H, &other));
+  TEST_ASSERT_TRUE(hashDistance(base, other) <= UNCHANGED_MAX_BITS);
+}
+
+// A different item (or none) is a change
+void test_hash_sees_different_contents() {
+  Plane p = scene(HASH_W, HASH_H, 20, 10, 30, 30);
+  Plane moved = scene(HASH_W, HASH_H, 45, 25, 30, 30);
+  Plane empty = scene(HASH_W, HASH_H, 0, 0, 0, 0);
+  uint64_t base, other;
+  TEST_ASSERT_TRUE(differenceHash(p.data(), HASH_W, HASH_H, &base));
+  TEST_ASSERT_TRUE(differenceHash(moved.data(), HASH_W, HASH_H, &other));
+  TEST_ASSERT_TRUE(hashDistance(base, other) > UNCHANGED_MAX_BITS);
+  TEST_ASSERT_TRUE(differenceHash(empty.data(), HASH_W, HASH_H, &other));
+  TEST_ASSERT_TRUE(hashDistance(base, other) > UNCHANGED_MAX_BITS);
+}
+
+void test_hash_too_small() {
+  Plane p(8 * 8, 100);
+  uint64_t h;
+  TEST_ASSERT_FALSE(differenceHash(p.data(), 8, 8, &h));
+  TEST_ASSERT_TRUE(differenceHash(p.data(), 9, 7 + 1, &h));
+}
+
+void test_hash_distance() {
+  TEST_ASSERT_EQUAL(0, hashDistance(0x1234, 0x1234));
+  TEST_ASSERT_EQUAL(64, hashDistance(0, ~0ull));
+  TEST_ASSERT_EQUAL(3, hashDistance(0, 0x8000000000000101ull));
+}
+
+// 4x2 BGR, factor 2: two blocks, each the rounded mean of its four pixels
+void test_downscale_exact() {
+  uint8_t bgr[4 * 2 * 3] = {
+    10, 20, 30,   11, 21, 31,   0, 0, 0,       255, 255, 255,
+    12, 22, 32,   12, 22, 33,   255, 255, 255, 255, 255, 255,
+  };
+  uint8_t out[2 * 3], luma[2];
+  downscaleBgr(bgr, 4, 2, 2, out, 3);
+  uint8_t expected[] = { 11, 21, 32,  191, 191, 191 };  // (45 + 2) / 4 = 11, (126 + 2) / 4 = 32
+  TEST_ASSERT_EQUAL_MEMORY(expected, out, sizeof(expected));
+
+  downscaleBgr(bgr, 4, 2, 2, luma, 1);
+  TEST_ASSERT_EQUAL((32 + 2 * 21 + 11) >> 2, luma[0]);
+  TEST_ASSERT_EQUAL(191, luma[1]);
+}
+
+// A partial block at the right and bottom edge is dropped
+void test_downscale_drops_edges() {
+  Plane bgr(5 * 3 * 3, 7);
+  bgr[(2 * 5 + 4) * 3] = 255;  // Bottom-right pixel, outside any 2x2 block
+  uint8_t out[2 + 1] = { 0, 0, 99 };
+  downscaleBgr(bgr.data(), 5, 3, 2, out, 1);
+  TEST_ASSERT_EQUAL(7, out[0]);
+  TEST_ASSERT_EQUAL(7, out[1]);
+  TEST_ASSERT_EQUAL(99, out[2]);  // Nothing written past 2x1
+}
+
+// The hash comes out the same whichever decode scale the upload shared:
+// full scale / 8 vs a 1/4-scale decode / 2 vs the plane itself
+void test_downscale_hash_matches_across_scales() {
+  const int W = HASH_W * 8, H = HASH_H * 8;
+  Plane full = toBgr(addNoise(scene(W, H, 160, 80, 240, 240), 4));
+
+  Plane eighth(HASH_W * HASH_H);
+  downscaleBgr(full.data(), W, H, 8, eighth.data(), 1);
+
+  Plane quarter(W / 4 * H / 4 * 3), viaQuarter(HASH_W * HASH_H);
+  downscaleBgr(full.data(), W, H, 4, quarter.data(), 3);
+  downscaleBgr(quarter.data(), W / 4, H / 4, 2, viaQuarter.data(), 1);
+
+  uint64_t a, b, c;
+  TEST_ASSERT_TRUE(differenceHash(eighth.data(), HASH_W, HASH_H, &a));
+  TEST_ASSERT_TRUE(differenceHash(viaQuarter.data(), HASH_W, HASH_H, &b));
+  TEST_ASSERT_TRUE(differenceHash(scene(HASH_W, HASH_H, 20, 10, 30, 30).data(), HASH_W, HASH_H, &c));
+  TEST_ASSERT_TRUE(hashDistance(a, b) <= 1);
+  TEST_ASSERT_TRUE(hashDistance(a, c) <= UNCHANGED_MAX_BITS);
+}
+
+// Host timing per call, for comparing kernel changes (the ESP32 runs at
+// a fraction of this; the device logs its own burst time)
+template <typename F>
+static double nsPerCall(F fn, int calls) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+}
+
+void test_benchmark() {
+  Plane score = addNoise(scene(SCORE_W, SCORE_H, 50, 30, 60, 60), 4);
+  Plane hash = addNoise(scene(HASH_W, HASH_H, 20, 10, 30, 30), 4);
+  volatile uint32_t sink = 0;
+  uint64_t h;
+
+  double energyNs = nsPerCall([&] { sink += gradientEnergy(score.data(), SCORE_W, SCORE_H); }, 2000);
+  double hashNs = nsPerCall([&] { differenceHash(hash.data(), HASH_W, HASH_H, &h); sink += (uint32_t)h; }, 20000);
+
+  // The upload's shared decode down to the hash plane: a full-scale VGA
+  // ROI crop, and a 1/2-scale (thumbnail) decode
+  Plane vga = toBgr(scene(640, 480, 200, 120, 240, 240));
+  Plane half = toBgr(scene(320, 240, 100, 60, 120, 120));
+  Plane plane(HASH_W * HASH_H);
+  double fromFullNs = nsPerCall([&] { downscaleBgr(vga.data(), 640, 480, 8, plane.data(), 1); sink += plane[0]; }, 200);
+  double fromHalfNs = nsPerCall([&] { downscaleBgr(half.data(), 320, 240, 4, plane.data(), 1); sink += plane[0]; }, 1000);
+
+  char line[128];
+  snprintf(line, sizeof(line), "gradientEnergy %dx%d: %.1f us/call", SCORE_W, SCORE_H, energyNs / 1000);
+  TEST_MESSAGE(line);
+  snprintf(line, sizeof(line), "differenceHash %dx%d: %.1f us/call", HASH_W, HASH_H, hashNs / 1000);
+  TEST_MESSAGE(line);
+  snprintf(line, sizeof(line), "downscaleBgr 640x480 /8: %.1f us/call, 320x240 /4: %.1f us/call",
+           fromFullNs / 1000, fromHalfNs / 1000);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(energyNs > 0 && hashNs > 0 && fromFullNs > 0 && fromHalfNs > 0);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_gradient_flat_is_zero);
+  RUN_TEST(test_gradient_exact);
+  RUN_TEST(test_gradient_too_small);
+  RUN_TEST(test_gradient_ranks_burst);
+  RUN_TEST(test_hash_deterministic);
+  RUN_TEST(test_hash_tolerates_noise_and_exposure);
+  RUN_TEST(test_hash_sees_different_contents);
+  RUN_TEST(test_hash_too_small);
+  RUN_TEST(test_hash_distance);
+  RUN_TEST(test_downscale_exact);
+  RUN_TEST(test_downscale_drops_edges);
+  RUN_TEST(test_downscale_hash_matches_across_scales);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,159 @@
+/*
+ * Host tests for lib/Multipart: the streamed upload body must be byte
+ * for byte what the original sendToServer() built in one PSRAM buffer
+ * (header + JPEG + footer), read the way HTTPClient reads a Stream.
+ *
+ *   pio test -e native
+ */
+#include <unity.h>
+#include <Multipart.h>
+#include <string.h>
+#include <vector>
+
+// The original sendToServer() framing, spelled out
+static const char BASELINE_START[] =
+    "------BumpBoxESP32Boundary\r\n"
+    "Content-Disposition: form-data; name=\"image\"; filename=\"capture.jpg\"\r\n"
+    "Content-Type: image/jpeg\r\n\r\n";
+static const char BASELINE_END[] = "\r\n------BumpBoxESP32Boundary--\r\n";
+
+static const size_t HTTP_TCP_BUFFER_SIZE = 1460;  // HTTPClient::sendRequest(Stream*) chunk
+
+// A JPEG-shaped frame: SOI, JFIF APP0, pseudo-random scan data (with NULs
+// and stray 0xFF bytes — the framing must not care), EOI
+static std::vector<uint8_t> makeJpeg(size_t len, uint32_t seed) {
+  static const uint8_t head[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+                                  0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+  std::vector<uint8_t> jpg(head, head + sizeof(head));
+  while (jpg.size() < len - 2) {
+    seed = seed * 1664525u + 1013904223u;
+    jpg.push_back((uint8_t)(seed >> 24));
+  }
+  jpg.push_back(0xFF);
+  jpg.push_back(0xD9);
+  return jpg;
+}
+
+// What the original code put on the wire: one malloc'd buffer
+static std::vector<uint8_t> baselineBody(const std::vector<uint8_t>& jpg) {
+  std::vector<uint8_t> body(BASELINE_START, BASELINE_START + sizeof(BASELINE_START) - 1);
+  body.reserve(body.size() + jpg.size() + sizeof(BASELINE_END) - 1);
+  body.insert(body.end(), jpg.begin(), jpg.end());
+  body.insert(body.end(), BASELINE_END, BASELINE_END + sizeof(BASELINE_END) - 1);
+  return body;
+}
+
+// HTTPClient's send loop: available(), then readBytes() up to a buffer.
+// Checks available() is exactly the bytes left before every read.
+static std::vector<uint8_t> drainLikeHttpClient(MultipartBody& body) {
+  std::vector<uint8_t> wire;
+  uint8_t buff[HTTP_TCP_BUFFER_SIZE];
+  size_t left = body.size();
+  for (;;) {
+    size_t avail = body.available();
+    TEST_ASSERT_EQUAL_size_t(left, avail);
+    if (!avail) break;
+    size_t want = avail > sizeof(buff) ? sizeof(buff) : avail;
+    size_t n = body.read(buff, want);
+    TEST_ASSERT_EQUAL_size_t(want, n);
+    wire.insert(wire.end(), buff, buff + n);
+    left -= n;
+  }
+  return wire;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_framing_matches_baseline_strings() {
+  TEST_ASSERT_EQUAL_STRING(BASELINE_START, MULTIPART_JPEG_HEAD("image"));
+  TEST_ASSERT_EQUAL_STRING(BASELINE_END, MULTIPART_TAIL);
+}
+
+void test_single_image_matches_baseline_body() {
+  std::vector<uint8_t> jpg = makeJpeg(42387, 1);
+  std::vector<uint8_t> expected = baselineBody(jpg);
+
+  MultipartBody body;
+  body.add(MULTIPART_JPEG_HEAD("image"));
+  body.add(jpg.data(), jpg.size());
+  body.add(MULTIPART_TAIL);
+  TEST_ASSERT_EQUAL_size_t(expected.size(), body.size());
+
+  std::vector<uint8_t> wire = drainLikeHttpClient(body);
+  TEST_ASSERT_EQUAL_size_t(expected.size(), wire.size());
+  TEST_ASSERT_EQUAL_MEMORY(expected.data(), wire.data(), expected.size());
+  TEST_ASSERT_EQUAL(-1, body.peek());
+  TEST_ASSERT_EQUAL(-1, body.read());
+  TEST_ASSERT_EQUAL_size_t(0, body.read(wire.data(), 16));
+}
+
+// Odd chunk sizes and single-byte reads across segment boundaries
+void test_uneven_reads_cross_segments() {
+  std::vector<uint8_t> jpg = makeJpeg(3000, 7);
+  std::vector<uint8_t> expected = baselineBody(jpg);
+
+  MultipartBody body;
+  body.add(MULTIPART_JPEG_HEAD("image"));
+  body.add(jpg.data(), jpg.size());
+  body.add(MULTIPART_TAIL);
+
+  static const size_t CHUNKS[] = { 1, 7, 100, 13, 1460, 2, 4096 };
+  std::vector<uint8_t> wire;
+  uint8_t buff[4096];
+  for (int i = 0; body.available(); i++) {
+    TEST_ASSERT_EQUAL_size_t(expected.size() - wire.size(), body.available());
+    if (i % 3 == 2) {
+      int peeked = body.peek();
+      int b = body.read();
+      TEST_ASSERT_EQUAL(peeked, b);
+      wire.push_back((uint8_t)b);
+      continue;
+    }
+    size_t n = body.read(buff, CHUNKS[i % 7]);
+    wire.insert(wire.end(), buff, buff + n);
+  }
+  TEST_ASSERT_EQUAL_size_t(expected.size(), wire.size());
+  TEST_ASSERT_EQUAL_MEMORY(expected.data(), wire.data(), expected.size());
+}
+
+// Batch body as sendBatch() builds it: part head, JPEG, separator + head, ..., tail
+void test_batch_body() {
+  std::vector<uint8_t> jpgs[3] = { makeJpeg(5000, 2), makeJpeg(24, 3), makeJpeg(9000, 4) };
+  const char* head = MULTIPART_JPEG_HEAD("images");
+  const char* sep  = MULTIPART_SEPARATOR MULTIPART_JPEG_HEAD("images");
+
+  MultipartBody body;
+  std::vector<uint8_t> expected;
+  for (int i = 0; i < 3; i++) {
+    const char* h = i ? sep : head;
+    body.add(h);
+    body.add(jpgs[i].data(), jpgs[i].size());
+    expected.insert(expected.end(), h, h + strlen(h));
+    expected.insert(expected.end(), jpgs[i].begin(), jpgs[i].end());
+  }
+  body.add(MULTIPART_TAIL);
+  expected.insert(expected.end(), MULTIPART_TAIL, MULTIPART_TAIL + strlen(MULTIPART_TAIL));
+
+  std::vector<uint8_t> wire = drainLikeHttpClient(body);
+  TEST_ASSERT_EQUAL_size_t(expected.size(), wire.size());
+  TEST_ASSERT_EQUAL_MEMORY(expected.data(), wire.data(), expected.size());
+}
+
+void test_segment_limit() {
+  static const uint8_t byte = 'x';
+  MultipartBody body;
+  for (int i = 0; i < MultipartBody::MAX_SEGMENTS; i++) TEST_ASSERT_TRUE(body.add(&byte, 1));
+  TEST_ASSERT_FALSE(body.add(&byte, 1));
+  TEST_ASSERT_EQUAL_size_t(MultipartBody::MAX_SEGMENTS, body.size());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_framing_matches_baseline_strings);
+  RUN_TEST(test_single_image_matches_baseline_body);
+  RUN_TEST(test_uneven_reads_cross_segments);
+  RUN_TEST(test_batch_body);
+  RUN_TEST(test_segment_limit);
+  return UNITY_END();
+}
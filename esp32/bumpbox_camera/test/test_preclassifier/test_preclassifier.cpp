@@ -0,0 +1,186 @@
+/*
+ * Host tests and a benchmark for lib/Preclassifier: the model input fill
+ * from a 1/8-scale VGA decode (80x60 BGR), the score readout, and the
+ * committed placeholder model header.
+ *
+ *   pio test -e native
+ */
+#include <unity.h>
+#include <Preclassifier.h>
+#include "../../src/preclassifier_model.h"
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static const int SRC_W = 80, SRC_H = 60;
+static const PreclassQuant UNIT_INPUT = { 1 / 255.0f, -128 };  // [0,1] -> -128..127
+
+typedef std::vector<uint8_t> Frame;
+
+static uint32_t seed;
+static uint8_t next() {
+  seed = seed * 1664525u + 1013904223u;
+  return seed >> 24;
+}
+
+static Frame randomFrame(int w, int h) {
+  Frame f(w * h * 3);
+  for (size_t i = 0; i < f.size(); i++) f[i] = next();
+  return f;
+}
+
+// The per-element version preclassify() used before the lookup table
+static void referenceFill(const uint8_t* bgr, int srcW, int srcH,
+                          int8_t* in, int inW, int inH, int inC, PreclassQuant q) {
+  for (int y = 0; y < inH; y++) {
+    const uint8_t* row = bgr + (y * srcH / inH) * srcW * 3;
+    for (int x = 0; x < inW; x++) {
+      const uint8_t* px = row + (x * srcW / inW) * 3;
+      for (int c = 0; c < inC; c++) {
+        int v = inC == 1 ? (px[2] + 2 * px[1] + px[0]) >> 2 : px[2 - c];
+        long n = lroundf(v / 255.0f / q.scale) + q.zeroPoint;
+        *in++ = (int8_t)(n < -128 ? -128 : n > 127 ? 127 : n);
+      }
+    }
+  }
+}
+
+void setUp() {
+  seed = 12345;
+}
+
+void tearDown() {}
+
+// 0 and 255 land on the ends of the int8 range, mid-grey near zero
+void test_fill_normalises_to_unit_range() {
+  uint8_t px[3 * 3] = { 0, 0, 0,  128, 128, 128,  255, 255, 255 };
+  int8_t in[3];
+  preclassFillInput(px, 3, 1, in, 3, 1, 1, UNIT_INPUT);
+  TEST_ASSERT_EQUAL_INT8(-128, in[0]);
+  TEST_ASSERT_EQUAL_INT8(0, in[1]);
+  TEST_ASSERT_EQUAL_INT8(127, in[2]);
+}
+
+void test_fill_rgb_order() {
+  uint8_t px[3] = { 10, 20, 30 };  // B, G, R
+  int8_t in[3];
+  preclassFillInput(px, 1, 1, in, 1, 1, 3, UNIT_INPUT);
+  TEST_ASSERT_EQUAL_INT8(30 - 128, in[0]);
+  TEST_ASSERT_EQUAL_INT8(20 - 128, in[1]);
+  TEST_ASSERT_EQUAL_INT8(10 - 128, in[2]);
+}
+
+void test_fill_gray_is_luma() {
+  uint8_t px[3] = { 40, 100, 200 };
+  int8_t in[1];
+  preclassFillInput(px, 1, 1, in, 1, 1, 1, UNIT_INPUT);
+  TEST_ASSERT_EQUAL_INT8(((200 + 2 * 100 + 40) >> 2) - 128, in[0]);
+}
+
+// A coarser input scale saturates instead of wrapping
+void test_fill_clamps() {
+  uint8_t px[3 * 2] = { 0, 0, 0,  255, 255, 255 };
+  int8_t in[2];
+  PreclassQuant half = { 1 / 127.0f, 0 };
+  preclassFillInput(px, 2, 1, in, 2, 1, 1, half);
+  TEST_ASSERT_EQUAL_INT8(0, in[0]);
+  TEST_ASSERT_EQUAL_INT8(127, in[1]);
+}
+
+// Nearest neighbour: input (x, y) takes source (x * srcW / inW, y * srcH / inH)
+void test_fill_samples_nearest() {
+  Frame f = randomFrame(SRC_W, SRC_H);
+  int8_t in[16 * 16];
+  preclassFillInput(f.data(), SRC_W, SRC_H, in, 16, 16, 1, UNIT_INPUT);
+  int checks[][2] = { { 0, 0 }, { 15, 0 }, { 0, 15 }, { 7, 9 }, { 15, 15 } };
+  for (auto& c : checks) {
+    const uint8_t* px = &f[((c[1] * SRC_H / 16) * SRC_W + c[0] * SRC_W / 16) * 3];
+    TEST_ASSERT_EQUAL_INT8(((px[2] + 2 * px[1] + px[0]) >> 2) - 128, in[c[1] * 16 + c[0]]);
+  }
+}
+
+// The lookup table gives exactly what the per-element rounding did
+void test_fill_matches_reference() {
+  Frame f = randomFrame(SRC_W, SRC_H);
+  PreclassQuant quants[] = { UNIT_INPUT, { 0.0078125f, 0 }, { 0.0123f, -3 } };
+  for (auto& q : quants) {
+    for (int c = 1; c <= 3; c += 2) {
+      std::vector<int8_t> a(48 * 48 * c), b(48 * 48 * c);
+      preclassFillInput(f.data(), SRC_W, SRC_H, a.data(), 48, 48, c, q);
+      referenceFill(f.data(), SRC_W, SRC_H, b.data(), 48, 48, c, q);
+      TEST_ASSERT_EQUAL_INT8_ARRAY(b.data(), a.data(), a.size());
+    }
+  }
+}
+
+void test_best_picks_first_highest() {
+  int8_t scores[] = { -100, 90, 20, 90 };
+  PreclassQuant q = { 1 / 256.0f, -128 };
+  float confidence;
+  TEST_ASSERT_EQUAL(1, preclassBest(scores, 4, q, &confidence));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, (90 + 128) / 256.0f, confidence);
+}
+
+// The committed model is a placeholder: valid flatbuffer, priceMap labels,
+// and its all-zero scores (the output zero point) never reach PRECLASS_MIN_CONF
+void test_placeholder_model() {
+  TEST_ASSERT_TRUE(g_preclassifier_model_len > 8);
+  TEST_ASSERT_EQUAL_MEMORY("TFL3", g_preclassifier_model + 4, 4);
+  TEST_ASSERT_EQUAL(0, (uintptr_t)g_preclassifier_model % 16);
+  TEST_ASSERT_TRUE(PRECLASSIFIER_LABEL_COUNT > 0);
+  for (int i = 0; i < PRECLASSIFIER_LABEL_COUNT; i++) TEST_ASSERT_TRUE(strlen(PRECLASSIFIER_LABELS[i]) > 0);
+
+  std::vector<int8_t> scores(PRECLASSIFIER_LABEL_COUNT, -128);
+  PreclassQuant q = { 1 / 256.0f, -128 };
+  float confidence;
+  preclassBest(scores.data(), PRECLASSIFIER_LABEL_COUNT, q, &confidence);
+  TEST_ASSERT_TRUE(confidence < 0.80f);
+}
+
+// Host timing per call, for comparing kernel changes (the ESP32 runs at
+// a fraction of this; the device logs its own inference time)
+template <typename F>
+static double nsPerCall(F fn, int calls) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+}
+
+void test_benchmark() {
+  Frame f = randomFrame(SRC_W, SRC_H);
+  std::vector<int8_t> in(96 * 96 * 3);
+  volatile int8_t sink = 0;
+
+  struct { int w, h, c; } shapes[] = { { 16, 16, 1 }, { 96, 96, 1 }, { 96, 96, 3 } };
+  for (auto& s : shapes) {
+    double lutNs = nsPerCall([&] {
+      preclassFillInput(f.data(), SRC_W, SRC_H, in.data(), s.w, s.h, s.c, UNIT_INPUT); sink += in[0];
+    }, 2000);
+    double refNs = nsPerCall([&] {
+      referenceFill(f.data(), SRC_W, SRC_H, in.data(), s.w, s.h, s.c, UNIT_INPUT); sink += in[0];
+    }, 2000);
+
+    char line[128];
+    snprintf(line, sizeof(line), "preclassFillInput %dx%dx%d: %.1f us/call (per-element rounding %.1f us)",
+             s.w, s.h, s.c, lutNs / 1000, refNs / 1000);
+    TEST_MESSAGE(line);
+    TEST_ASSERT_TRUE(lutNs > 0 && refNs > 0);
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_fill_normalises_to_unit_range);
+  RUN_TEST(test_fill_rgb_order);
+  RUN_TEST(test_fill_gray_is_luma);
+  RUN_TEST(test_fill_clamps);
+  RUN_TEST(test_fill_samples_nearest);
+  RUN_TEST(test_fill_matches_reference);
+  RUN_TEST(test_best_picks_first_highest);
+  RUN_TEST(test_placeholder_model);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
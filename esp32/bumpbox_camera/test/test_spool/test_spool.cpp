@@ -0,0 +1,410 @@
+/*
+ * Host tests for lib/Spool against an in-memory filesystem that can
+ * lose power mid-write and have its files corrupted: reboot recovery,
+ * oldest-first eviction, retry vs drop, and bad entries.
+ *
+ *   pio test -e native
+ */
+#include <unity.h>
+#include <Spool.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+static const char* DIR_ = "/spool";
+static const uint32_t MAX_FILES = 4;
+static const size_t MAX_BYTES = 4096;
+
+// Flat map of path → contents; directories are implied by the paths
+class MemFs : public SpoolFs {
+public:
+  std::map<std::string, std::vector<uint8_t> > files;
+  size_t capacity = 1 << 20;
+  bool powerCutBeforeRename = false;  // Write lands, rename never happens
+  bool shortWrite = false;            // Flash full mid-write
+
+  bool mkdir(const char*) override { return true; }
+
+  void list(const char* dir, ListFn fn, void* ctx) override {
+    std::string prefix = std::string(dir) + "/";
+    std::map<std::string, std::vector<uint8_t> > snapshot = files;  // fn may remove
+    for (auto& f : snapshot) {
+      if (f.first.compare(0, prefix.size(), prefix) == 0) {
+        fn(ctx, f.first.c_str() + prefix.size(), f.second.size());
+      }
+    }
+  }
+
+  bool exists(const char* path) override { return files.count(path) != 0; }
+
+  long size(const char* path) override {
+    auto f = files.find(path);
+    return f == files.end() ? -1 : (long)f->second.size();
+  }
+
+  bool remove(const char* path) override { return files.erase(path) != 0; }
+
+  bool rename(const char* from, const char* to) override {
+    if (powerCutBeforeRename || !files.count(from)) return false;
+    files[to] = files[from];
+    files.erase(from);
+    return true;
+  }
+
+  bool write(const char* path, const uint8_t* head, size_t headLen,
+             const uint8_t* data, size_t dataLen) override {
+    std::vector<uint8_t>& f = files[path];
+    f.assign(head, head + headLen);
+    if (shortWrite) {
+      f.insert(f.end(), data, data + dataLen / 2);
+      return false;
+    }
+    f.insert(f.end(), data, data + dataLen);
+    return true;
+  }
+
+  size_t read(const char* path, size_t offset, uint8_t* out, size_t len) override {
+    auto f = files.find(path);
+    if (f == files.end() || offset >= f->second.size()) return 0;
+    size_t n = f->second.size() - offset;
+    if (n > len) n = len;
+    memcpy(out, f->second.data() + offset, n);
+    return n;
+  }
+
+  size_t usedBytes() override {
+    size_t used = 0;
+    for (auto& f : files) used += f.second.size();
+    return used;
+  }
+
+  size_t totalBytes() override { return capacity; }
+};
+
+// A frame whose bytes all carry its id, so order is checkable
+static std::vector<uint8_t> frame(uint8_t id, size_t len = 100) {
+  return std::vector<uint8_t>(len, id);
+}
+
+static MemFs* fs;
+static Spool* spool;
+
+// What the sender saw, one vector of frame ids per request
+static std::vector<std::vector<uint8_t> > sent;
+static SpoolResult nextResult;
+static std::vector<std::pair<SpoolDrop, uint32_t> > drops;
+
+static SpoolResult recordSend(void*, const SpoolEntry* entries, int count) {
+  std::vector<uint8_t> ids;
+  for (int i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL_UINT32(SPOOL_MAGIC, entries[i].header.magic);
+    ids.push_back(entries[i].jpg[0]);
+  }
+  sent.push_back(ids);
+  return nextResult;
+}
+
+static void onDrop(SpoolDrop why, uint32_t seq) {
+  drops.push_back(std::make_pair(why, seq));
+}
+
+static const uint32_t BOOT_ID = 0x5eed;
+
+static SpoolStamp stampAt(uint32_t ms) {
+  SpoolStamp stamp = { BOOT_ID, ms, 0 };
+  return stamp;
+}
+
+static void push(uint8_t id, size_t len = 100) {
+  std::vector<uint8_t> f = frame(id, len);
+  TEST_ASSERT_TRUE(spool->push(stampAt(1000u * id), 640, 480, f.data(), f.size()));
+}
+
+// Simulated reboot: a fresh Spool over the same files
+static void reboot() {
+  delete spool;
+  spool = new Spool(*fs, DIR_, MAX_FILES, MAX_BYTES);
+  spool->setDropListener(onDrop);
+  spool->begin();
+}
+
+void setUp() {
+  fs = new MemFs();
+  spool = NULL;
+  sent.clear();
+  drops.clear();
+  nextResult = SPOOL_SENT;
+  reboot();
+}
+
+void tearDown() {
+  delete spool;
+  delete fs;
+}
+
+void test_push_and_drain_in_order() {
+  push(1);
+  push(2);
+  push(3);
+  TEST_ASSERT_EQUAL_UINT32(3, spool->count());
+  TEST_ASSERT_EQUAL_size_t(3 * (sizeof(SpoolHeader) + 100), spool->bytes());
+
+  while (spool->count()) TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(3, sent.size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+  TEST_ASSERT_EQUAL(2, sent[1][0]);
+  TEST_ASSERT_EQUAL(3, sent[2][0]);
+  TEST_ASSERT_EQUAL_size_t(0, spool->bytes());
+  TEST_ASSERT_EQUAL_size_t(0, fs->files.size());
+}
+
+// The queue, its order and its byte count survive a reboot; a temp
+// file from a write cut short by power loss is cleaned up, not queued
+void test_reboot_recovery() {
+  push(1);
+  push(2);
+  fs->powerCutBeforeRename = true;
+  std::vector<uint8_t> f = frame(3);
+  TEST_ASSERT_FALSE(spool->push(stampAt(3000), 640, 480, f.data(), f.size()));
+  fs->files["/spool/00000002.cap.tmp"] = frame(3);  // As the cut left it
+  fs->powerCutBeforeRename = false;
+
+  size_t bytes = spool->bytes();
+  reboot();
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+  TEST_ASSERT_EQUAL_size_t(bytes, spool->bytes());
+  TEST_ASSERT_EQUAL_UINT32(0, spool->head());
+  TEST_ASSERT_EQUAL_UINT32(2, spool->tail());
+  TEST_ASSERT_FALSE(fs->exists("/spool/00000002.cap.tmp"));
+
+  push(4);  // Queues behind what was left
+  while (spool->count()) TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(3, sent.size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+  TEST_ASSERT_EQUAL(2, sent[1][0]);
+  TEST_ASSERT_EQUAL(4, sent[2][0]);
+}
+
+// Numbering carries on from the highest file after a reboot, even with
+// the queue drained part way
+void test_reboot_keeps_numbering() {
+  push(1);
+  push(2);
+  push(3);
+  TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  reboot();
+  TEST_ASSERT_EQUAL_UINT32(1, spool->head());
+  TEST_ASSERT_EQUAL_UINT32(3, spool->tail());
+  push(4);
+  TEST_ASSERT_TRUE(fs->exists("/spool/00000003.cap"));
+}
+
+static SpoolStamp lastStamp;
+
+static SpoolResult recordStamp(void*, const SpoolEntry* entries, int) {
+  lastStamp = entries[0].header.stamp;
+  return SPOOL_SENT;
+}
+
+// The capture stamp survives a restart, and the age of a frame from an
+// earlier boot comes from the wall clock or is unknown, never from uptime
+void test_age_across_reboot() {
+  std::vector<uint8_t> f = frame(1);
+  SpoolStamp taken = { BOOT_ID, 90000, 1700000000000LL };
+  TEST_ASSERT_TRUE(spool->push(taken, 640, 480, f.data(), f.size()));
+  reboot();
+  TEST_ASSERT_TRUE(spool->drainOne(recordStamp, NULL));
+  TEST_ASSERT_EQUAL_UINT32(BOOT_ID, lastStamp.bootId);
+  TEST_ASSERT_EQUAL_UINT32(90000, lastStamp.capturedMs);
+  TEST_ASSERT_EQUAL_INT64(1700000000000LL, lastStamp.capturedWallMs);
+
+  SpoolStamp sameBoot = { BOOT_ID, 150000, 0 };
+  TEST_ASSERT_EQUAL_INT64(60000, spoolAgeMs(lastStamp, sameBoot));
+  SpoolStamp nextBoot = { BOOT_ID + 1, 150000, 0 };  // Clock not set yet
+  TEST_ASSERT_EQUAL_INT64(-1, spoolAgeMs(lastStamp, nextBoot));
+  nextBoot.capturedWallMs = 1700000300000LL;
+  TEST_ASSERT_EQUAL_INT64(300000, spoolAgeMs(lastStamp, nextBoot));
+  lastStamp.capturedWallMs = 0;                      // Taken before SNTP synced
+  TEST_ASSERT_EQUAL_INT64(-1, spoolAgeMs(lastStamp, nextBoot));
+}
+
+void test_evicts_oldest_past_file_limit() {
+  for (uint8_t id = 1; id <= MAX_FILES + 2; id++) push(id);
+  TEST_ASSERT_EQUAL_UINT32(MAX_FILES, spool->count());
+  TEST_ASSERT_EQUAL_size_t(2, drops.size());
+  TEST_ASSERT_EQUAL(SPOOL_EVICTED, drops[0].first);
+  TEST_ASSERT_EQUAL_UINT32(0, drops[0].second);
+  TEST_ASSERT_EQUAL_UINT32(1, drops[1].second);
+
+  TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL(3, sent[0][0]);
+}
+
+void test_evicts_oldest_past_byte_limit() {
+  push(1, 1500);
+  push(2, 1500);
+  push(3, 1500);  // 3 × (1500 + header) > 4096: frame 1 goes
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+  TEST_ASSERT_TRUE(spool->bytes() <= MAX_BYTES);
+  TEST_ASSERT_EQUAL_size_t(1, drops.size());
+  TEST_ASSERT_EQUAL_UINT32(0, drops[0].second);
+
+  std::vector<uint8_t> huge = frame(9, MAX_BYTES);
+  TEST_ASSERT_FALSE(spool->push(stampAt(0), 640, 480, huge.data(), huge.size()));  // Never fits
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+}
+
+// Leaves SPOOL_FS_RESERVE free on a nearly full filesystem
+void test_evicts_for_filesystem_space() {
+  fs->capacity = SPOOL_FS_RESERVE + 2 * (sizeof(SpoolHeader) + 100);
+  push(1);
+  push(2);
+  push(3);
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+  TEST_ASSERT_EQUAL_size_t(1, drops.size());
+}
+
+void test_retry_keeps_entry() {
+  push(1);
+  push(2);
+  nextResult = SPOOL_RETRY;
+  TEST_ASSERT_FALSE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_FALSE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+  TEST_ASSERT_EQUAL_size_t(0, drops.size());
+
+  nextResult = SPOOL_SENT;
+  TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(3, sent.size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+  TEST_ASSERT_EQUAL(1, sent[2][0]);  // Same frame until it went through
+  TEST_ASSERT_EQUAL_UINT32(1, spool->count());
+}
+
+void test_rejected_entry_dropped() {
+  push(1);
+  push(2);
+  nextResult = SPOOL_REJECTED;
+  TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_UINT32(1, spool->count());
+  TEST_ASSERT_EQUAL_size_t(1, drops.size());
+  TEST_ASSERT_EQUAL(SPOOL_DROPPED_REJECTED, drops[0].first);
+  TEST_ASSERT_EQUAL_UINT32(0, drops[0].second);
+}
+
+// Truncated file, wrong magic, length field that disagrees with the
+// file: each is dropped unsent and the queue moves on
+void test_corrupt_entries_dropped() {
+  push(1);
+  push(2);
+  push(3);
+  push(4);
+  fs->files["/spool/00000000.cap"].resize(sizeof(SpoolHeader) + 40);  // Truncated payload
+  fs->files["/spool/00000001.cap"][0] ^= 0xFF;                         // Magic
+  fs->files["/spool/00000002.cap"].resize(sizeof(SpoolHeader) - 3);    // Truncated header
+
+  while (spool->count()) TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(1, sent.size());
+  TEST_ASSERT_EQUAL(4, sent[0][0]);
+  TEST_ASSERT_EQUAL_size_t(3, drops.size());
+  for (size_t i = 0; i < drops.size(); i++) {
+    TEST_ASSERT_EQUAL(SPOOL_UNREADABLE, drops[i].first);
+    TEST_ASSERT_EQUAL_UINT32(i, drops[i].second);
+  }
+  TEST_ASSERT_EQUAL_size_t(0, spool->bytes());
+}
+
+// A failed write leaves nothing behind, and its number is reused
+void test_failed_write_cleaned_up() {
+  push(1);
+  fs->shortWrite = true;
+  std::vector<uint8_t> f = frame(2);
+  TEST_ASSERT_FALSE(spool->push(stampAt(2000), 640, 480, f.data(), f.size()));
+  fs->shortWrite = false;
+  TEST_ASSERT_EQUAL_UINT32(1, spool->count());
+  TEST_ASSERT_FALSE(fs->exists("/spool/00000001.cap.tmp"));
+  push(3);
+  TEST_ASSERT_TRUE(fs->exists("/spool/00000001.cap"));
+
+  while (spool->count()) TEST_ASSERT_TRUE(spool->drainOne(recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(2, sent.size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+  TEST_ASSERT_EQUAL(3, sent[1][0]);
+}
+
+void test_batch_drain() {
+  push(1);
+  push(2);
+  push(3);
+  TEST_ASSERT_TRUE(spool->drainBatch(2, 1 << 20, recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(1, sent.size());
+  TEST_ASSERT_EQUAL_size_t(2, sent[0].size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+  TEST_ASSERT_EQUAL(2, sent[0][1]);
+
+  TEST_ASSERT_TRUE(spool->drainBatch(2, 1 << 20, recordSend, NULL));  // One left: single
+  TEST_ASSERT_EQUAL_size_t(1, sent[1].size());
+  TEST_ASSERT_EQUAL(3, sent[1][0]);
+  TEST_ASSERT_EQUAL_UINT32(0, spool->count());
+}
+
+void test_batch_retry_keeps_all() {
+  push(1);
+  push(2);
+  nextResult = SPOOL_RETRY;
+  TEST_ASSERT_FALSE(spool->drainBatch(4, 1 << 20, recordSend, NULL));
+  TEST_ASSERT_EQUAL_UINT32(2, spool->count());
+}
+
+// The batch stops at a bad entry; with only one good frame before it,
+// that one goes alone, the next drain drops the bad one, and the one
+// after sends what follows
+void test_batch_stops_at_corrupt_entry() {
+  push(1);
+  push(2);
+  push(3);
+  fs->files["/spool/00000001.cap"].resize(10);
+  TEST_ASSERT_TRUE(spool->drainBatch(4, 1 << 20, recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(1, sent.size());
+  TEST_ASSERT_EQUAL_size_t(1, sent[0].size());
+  TEST_ASSERT_EQUAL(1, sent[0][0]);
+
+  TEST_ASSERT_TRUE(spool->drainBatch(4, 1 << 20, recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(1, drops.size());
+  TEST_ASSERT_EQUAL(SPOOL_UNREADABLE, drops[0].first);
+  TEST_ASSERT_EQUAL_size_t(1, sent.size());
+
+  TEST_ASSERT_TRUE(spool->drainBatch(4, 1 << 20, recordSend, NULL));
+  TEST_ASSERT_EQUAL(3, sent[1][0]);
+  TEST_ASSERT_EQUAL_UINT32(0, spool->count());
+}
+
+void test_batch_byte_limit() {
+  push(1, 300);
+  push(2, 300);
+  push(3, 300);
+  TEST_ASSERT_TRUE(spool->drainBatch(4, 650, recordSend, NULL));
+  TEST_ASSERT_EQUAL_size_t(2, sent[0].size());
+  TEST_ASSERT_EQUAL_UINT32(1, spool->count());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_push_and_drain_in_order);
+  RUN_TEST(test_reboot_recovery);
+  RUN_TEST(test_reboot_keeps_numbering);
+  RUN_TEST(test_age_across_reboot);
+  RUN_TEST(test_evicts_oldest_past_file_limit);
+  RUN_TEST(test_evicts_oldest_past_byte_limit);
+  RUN_TEST(test_evicts_for_filesystem_space);
+  RUN_TEST(test_retry_keeps_entry);
+  RUN_TEST(test_rejected_entry_dropped);
+  RUN_TEST(test_corrupt_entries_dropped);
+  RUN_TEST(test_failed_write_cleaned_up);
+  RUN_TEST(test_batch_drain);
+  RUN_TEST(test_batch_retry_keeps_all);
+  RUN_TEST(test_batch_stops_at_corrupt_entry);
+  RUN_TEST(test_batch_byte_limit);
+  return UNITY_END();
+}
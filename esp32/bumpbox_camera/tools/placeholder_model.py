@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""
+Writes src/preclassifier_model.h with a placeholder pre-classifier, so the
+esp32cam-preclassifier env builds and runs end to end without a trained
+model.
+
+The model is one int8 FULLY_CONNECTED layer from a 16x16 grayscale input
+to one score per label, with all weights and biases zero. Every score
+therefore dequantizes to 0, which is below PRECLASS_MIN_CONF, so every
+frame still goes to Vision. Only the decode, input fill and Invoke path
+(and their timings in the serial log) are exercised.
+
+The input follows the README model contract: pixels normalised to [0,1],
+quantized with scale 1/255 and zero point -128.
+
+No flatbuffers or TensorFlow install is needed; the TFLite schema fields
+used here are encoded by hand.
+
+    python3 tools/placeholder_model.py   # from esp32/bumpbox_camera
+"""
+import os
+import struct
+
+INPUT_W, INPUT_H, INPUT_C = 16, 16, 1
+LABELS = ["Smartphone", "Laptop", "Headphones", "Book"]  # priceMap keys
+
+INPUT_SCALE, INPUT_ZERO = 1 / 255, -128    # [0,1] -> int8
+WEIGHT_SCALE = 1 / 128
+OUTPUT_SCALE, OUTPUT_ZERO = 1 / 256, -128  # Score in [0,1)
+
+# TFLite schema values
+TENSOR_INT32, TENSOR_INT8 = 2, 9
+FULLY_CONNECTED = 9
+OPTIONS_FULLY_CONNECTED = 8
+
+
+def f32(x):
+    return struct.unpack("<f", struct.pack("<f", x))[0]
+
+
+class Builder:
+    """Front-to-back flatbuffer writer: a table is written before the
+    objects it points to, and its offset fields are patched once they
+    land (uoffsets always point forward)."""
+
+    def __init__(self, ident):
+        self.buf = bytearray(struct.pack("<I", 0) + ident)
+
+    def pad(self, align, extra=0):
+        while (len(self.buf) + extra) % align:
+            self.buf.append(0)
+
+    def patch(self, at, target):
+        struct.pack_into("<I", self.buf, at, target - at)
+
+    # fields: {index: (fmt, value)}; fmt "off" takes an emit function
+    def table(self, fields):
+        order = sorted(fields, key=lambda i: -struct.calcsize("I" if fields[i][0] == "off" else fields[i][0]))
+        layout, size = {}, 4
+        for i in order:
+            fmt = fields[i][0]
+            width = 4 if fmt == "off" else struct.calcsize(fmt)
+            size += (-size) % width
+            layout[i] = size
+            size += width
+        size += (-size) % 4
+
+        count = max(fields) + 1 if fields else 0
+        vtable = struct.pack("<HH", 4 + 2 * count, size)
+        vtable += b"".join(struct.pack("<H", layout.get(i, 0)) for i in range(count))
+        self.pad(4, len(vtable))
+        vt = len(self.buf)
+        self.buf += vtable
+        start = len(self.buf)
+        self.buf += bytes(size)
+        struct.pack_into("<i", self.buf, start, start - vt)
+
+        children = []
+        for i, (fmt, value) in fields.items():
+            if fmt == "off":
+                children.append((start + layout[i], value))
+            else:
+                struct.pack_into("<" + fmt, self.buf, start + layout[i], value)
+        for at, emit in children:
+            self.patch(at, emit())
+        return start
+
+    def string(self, s):
+        data = s.encode()
+        self.pad(4)
+        start = len(self.buf)
+        self.buf += struct.pack("<I", len(data)) + data + b"\0"
+        return start
+
+    def vector(self, fmt, values, align=4):
+        self.pad(max(align, 4), 4)
+        start = len(self.buf)
+        self.buf += struct.pack("<I", len(values))
+        self.buf += b"".join(struct.pack("<" + fmt, v) for v in values)
+        return start
+
+    def tables(self, emits):
+        self.pad(4)
+        start = len(self.buf)
+        self.buf += struct.pack("<I", len(emits)) + bytes(4 * len(emits))
+        for n, emit in enumerate(emits):
+            self.patch(start + 4 + 4 * n, emit())
+        return start
+
+    def finish(self, root):
+        self.patch(0, root)
+        self.pad(16)
+        return bytes(self.buf)
+
+
+def build():
+    b = Builder(b"TFL3")
+    labels = len(LABELS)
+    features = INPUT_W * INPUT_H * INPUT_C
+    bias_scale = f32(INPUT_SCALE) * f32(WEIGHT_SCALE)
+
+    def quant(scale, zero):
+        return lambda: b.table({
+            2: ("off", lambda: b.vector("f", [scale])),
+            3: ("off", lambda: b.vector("q", [zero], 8)),
+        })
+
+    def tensor(name, shape, kind, buffer, q):
+        return lambda: b.table({
+            0: ("off", lambda: b.vector("i", shape)),
+            1: ("b", kind),
+            2: ("I", buffer),
+            3: ("off", lambda: b.string(name)),
+            4: ("off", q),
+        })
+
+    def buffer(data):
+        if data is None:
+            return lambda: b.table({})
+        return lambda: b.table({0: ("off", lambda: b.vector("B", data, 16))})
+
+    subgraph = lambda: b.table({
+        0: ("off", lambda: b.tables([
+            tensor("input", [1, INPUT_H, INPUT_W, INPUT_C], TENSOR_INT8, 0, quant(INPUT_SCALE, INPUT_ZERO)),
+            tensor("weights", [labels, features], TENSOR_INT8, 1, quant(WEIGHT_SCALE, 0)),
+            tensor("bias", [labels], TENSOR_INT32, 2, quant(bias_scale, 0)),
+            tensor("scores", [1, labels], TENSOR_INT8, 0, quant(OUTPUT_SCALE, OUTPUT_ZERO)),
+        ])),
+        1: ("off", lambda: b.vector("i", [0])),
+        2: ("off", lambda: b.vector("i", [3])),
+        3: ("off", lambda: b.tables([lambda: b.table({
+            0: ("I", 0),
+            1: ("off", lambda: b.vector("i", [0, 1, 2])),
+            2: ("off", lambda: b.vector("i", [3])),
+            3: ("B", OPTIONS_FULLY_CONNECTED),
+            4: ("off", lambda: b.table({0: ("b", 0)})),  # No fused activation
+        })])),
+        4: ("off", lambda: b.string("main")),
+    })
+
+    root = b.table({
+        0: ("I", 3),
+        1: ("off", lambda: b.tables([lambda: b.table({
+            0: ("b", FULLY_CONNECTED),  # Field read by older TFLite Micro
+            2: ("i", 1),
+            3: ("i", FULLY_CONNECTED),
+        })])),
+        2: ("off", lambda: b.tables([subgraph])),
+        3: ("off", lambda: b.string("BumpBox placeholder pre-classifier (zero weights)")),
+        4: ("off", lambda: b.tables([
+            buffer(None),  # Buffer 0: the empty sentinel
+            buffer(bytes(labels * features)),
+            buffer(bytes(4 * labels)),
+        ])),
+    })
+    return b.finish(root)
+
+
+def header(model):
+    lines = []
+    for i in range(0, len(model), 12):
+        lines.append("  " + ", ".join("0x%02x" % c for c in model[i:i + 12]) + ",")
+    labels = ",\n".join('  "%s"' % label for label in LABELS)
+    return f"""/*
+ * PLACEHOLDER pre-classifier model, written by tools/placeholder_model.py.
+ * One int8 fully connected layer, {INPUT_W}x{INPUT_H}x{INPUT_C} input to {len(LABELS)} scores, all
+ * weights zero: every score is 0, so nothing is ever reported and every
+ * frame still goes to Vision. It only lets the esp32cam-preclassifier
+ * env build and time its decode and Invoke path. Replace this file with
+ * a trained model that follows the contract in esp32/README.md.
+ */
+#pragma once
+
+alignas(16) const unsigned char g_preclassifier_model[] = {{
+{chr(10).join(lines)}
+}};
+const unsigned int g_preclassifier_model_len = {len(model)};
+
+// Spelled exactly as the server/data/priceMap.json keys
+const char* const PRECLASSIFIER_LABELS[] = {{
+{labels}
+}};
+const int PRECLASSIFIER_LABEL_COUNT = {len(LABELS)};
+"""
+
+
+if __name__ == "__main__":
+    here = os.path.dirname(os.path.abspath(__file__))
+    out = os.path.join(here, "..", "src", "preclassifier_model.h")
+    model = build()
+    with open(out, "w") as f:
+        f.write(header(model))
+    print("Wrote %s (%d-byte model)" % (os.path.normpath(out), len(model)))
@@ -0,0 +1,345 @@
+#include "WifiManager.h"
+
+#include <WiFi.h>
+#include <Preferences.h>
+#include <sys/time.h>
+#include <esp_netif.h>
+#include <esp_netif_net_stack.h>  // esp_netif_get_netif_impl
+#include <lwip/dhcp.h>
+
+/*
+ * Last good AP (BSSID + channel) and DHCP lease, kept in NVS so a
+ * reconnect or reboot can skip the channel scan and DHCP: a directed
+ * connect with a static IP takes a few hundred ms instead of seconds.
+ * If the cached AP doesn't answer within WIFI_FAST_MS (WIFI_FAST_DHCP_MS
+ * when DHCP runs) the cache is dropped and the full scan + DHCP path runs.
+ *
+ * Only DHCP renews the lease, and the router may hand the address to
+ * someone else once it runs out. So the cached lease is used only while
+ * it's known to be younger than half its lease time (when a DHCP client
+ * would renew anyway). Its age is known from millis() when it was taken
+ * this boot, or else from the SNTP clock (kept across a soft reset, not
+ * across a power cycle). A lease of unknown age or past half its time is
+ * dropped but the AP isn't: the first connect after power-up still goes
+ * straight to the cached BSSID and channel, skipping the scan, and runs
+ * DHCP there.
+ * No DHCP client runs on a link brought up with the cached lease, so
+ * once that lease is half spent the interface goes back to DHCP
+ * (WIFI_RENEW) while staying associated.
+ */
+struct WiFiCache {
+  char ssid[33];
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip, gateway, subnet, dns;
+  int64_t leaseAt;     // Epoch ms the lease was obtained, 0 = clock wasn't synced
+  uint32_t leaseSecs;  // Lease time the DHCP server granted
+};
+
+/*
+ * Link manager. WiFi.onEvent hands driver events over a queue, and
+ * wifiService() drives the connect state machine from them without ever
+ * waiting on the link: cached AP first, then scan + DHCP, then a retry
+ * after an exponential backoff with jitter (so a row of lockers doesn't
+ * hammer a rebooting AP in step).
+ */
+enum WiFiPhase { WIFI_IDLE, WIFI_FAST, WIFI_FULL, WIFI_UP, WIFI_RENEW };
+
+// What a connect can reuse from the cache
+enum CacheUse { CACHE_NONE, CACHE_AP, CACHE_AP_LEASE };
+
+struct WiFiEventMsg {
+  WiFiEvent_t event;
+  uint8_t reason;  // Disconnects: wifi_err_reason_t
+};
+
+static const char* wifiSsid;
+static const char* wifiPassword;
+static const char* wifiNamespace;
+static const char* ntpServer1;
+static const char* ntpServer2;
+
+static QueueHandle_t wifiEvents;
+static volatile WiFiPhase wifiPhase = WIFI_IDLE;  // Read by wifiLinkUp() from any task
+static WiFiCache wifiCache;
+static WiFiStats stats;
+static unsigned long wifiConnectStart = 0;  // First attempt of this connect (fast + full)
+static unsigned long wifiAttemptAt = 0;
+static unsigned long wifiRetryAt = 0;
+static uint32_t wifiBackoffMs = WIFI_RETRY_MIN_MS;
+static LinkListener linkListeners[4];
+static int linkListenerCount = 0;
+static bool leaseThisBoot = false;          // The cached lease came from DHCP since boot...
+static unsigned long leaseMillis = 0;       // ...at this millis()
+static bool staticLease = false;            // Up on the cached lease, no DHCP client running
+static bool fastLease = false;              // The WIFI_FAST attempt uses the cached lease
+
+int64_t wallClockMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < 1577836800) return 0;  // 2020-01-01
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Lease time from the last DHCP exchange, or WIFI_LEASE_DEFAULT_S if lwIP has none
+static uint32_t dhcpLeaseSecs() {
+  esp_netif_t* sta = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  struct netif* netif = sta ? (struct netif*)esp_netif_get_netif_impl(sta) : NULL;
+  struct dhcp* dhcp = netif ? netif_dhcp_data(netif) : NULL;
+  return dhcp && dhcp->offered_t0_lease ? dhcp->offered_t0_lease : WIFI_LEASE_DEFAULT_S;
+}
+
+// Age of the cached lease in ms, or -1 if it can't be known
+static int64_t leaseAgeMs(const WiFiCache* cache) {
+  if (leaseThisBoot) return millis() - leaseMillis;
+  int64_t now = wallClockMs();
+  if (!now || !cache->leaseAt) return -1;
+  return now - cache->leaseAt;
+}
+
+static CacheUse loadWiFiCache(WiFiCache* cache) {
+  Preferences prefs;
+  if (!prefs.begin(wifiNamespace, true)) return CACHE_NONE;
+  bool ok = prefs.getBytes("wifi", cache, sizeof(*cache)) == sizeof(*cache);
+  prefs.end();
+  if (!ok || strcmp(cache->ssid, wifiSsid) != 0 || !cache->channel) return CACHE_NONE;
+  if (!cache->ip) return CACHE_AP;
+
+  int64_t age = leaseAgeMs(cache);
+  if (age >= 0 && age < (int64_t)cache->leaseSecs * 500) return CACHE_AP_LEASE;
+  Serial.println(age < 0 ? "[WiFi] Cached lease has unknown age — cached AP with DHCP"
+                         : "[WiFi] Cached lease is past half its time — cached AP with DHCP");
+  return CACHE_AP;
+}
+
+static void writeWiFiCache() {
+  Preferences prefs;
+  if (prefs.begin(wifiNamespace, false)) {
+    prefs.putBytes("wifi", &wifiCache, sizeof(wifiCache));
+    prefs.end();
+  }
+}
+
+// renewed: the lease just came from DHCP; otherwise keep the cached one's times
+static void saveWiFiCache(bool renewed) {
+  WiFiCache cache = {};
+  strlcpy(cache.ssid, wifiSsid, sizeof(cache.ssid));
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.ip      = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet  = WiFi.subnetMask();
+  cache.dns     = WiFi.dnsIP();
+  if (renewed) {
+    leaseThisBoot = true;
+    leaseMillis = millis();
+    cache.leaseAt = wallClockMs();
+    cache.leaseSecs = dhcpLeaseSecs();
+  } else {
+    cache.leaseAt = wifiCache.leaseAt;
+    cache.leaseSecs = wifiCache.leaseSecs;
+  }
+  wifiCache = cache;
+  writeWiFiCache();
+}
+
+static void forgetWiFiCache() {
+  leaseThisBoot = false;
+  Preferences prefs;
+  if (prefs.begin(wifiNamespace, false)) {
+    prefs.remove("wifi");
+    prefs.end();
+  }
+}
+
+// WiFi event task: just queue it for wifiService()
+static void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  if (event != ARDUINO_EVENT_WIFI_STA_GOT_IP && event != ARDUINO_EVENT_WIFI_STA_DISCONNECTED) return;
+  WiFiEventMsg msg = { event, 0 };
+  if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) msg.reason = info.wifi_sta_disconnected.reason;
+  xQueueSend(wifiEvents, &msg, 0);
+}
+
+void onLinkChange(LinkListener listener) {
+  if (linkListenerCount < (int)(sizeof(linkListeners) / sizeof(linkListeners[0]))) {
+    linkListeners[linkListenerCount++] = listener;
+  }
+}
+
+static void notifyLink(LinkEvent event) {
+  for (int i = 0; i < linkListenerCount; i++) linkListeners[i](event);
+}
+
+static void startConnect(CacheUse use) {
+  if (use == CACHE_AP_LEASE) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // Back to DHCP
+  }
+  if (use != CACHE_NONE) {
+    WiFi.begin(wifiSsid, wifiPassword, wifiCache.channel, wifiCache.bssid);
+  } else {
+    WiFi.begin(wifiSsid, wifiPassword);
+  }
+  wifiPhase = use != CACHE_NONE ? WIFI_FAST : WIFI_FULL;
+  fastLease = use == CACHE_AP_LEASE;
+  wifiAttemptAt = millis();
+}
+
+// The attempt in progress timed out: fall back to a full connect, or back off
+static void connectTimedOut() {
+  WiFi.disconnect();
+  if (wifiPhase == WIFI_FAST) {
+    Serial.println("[WiFi] Cached AP didn't answer — full scan");
+    forgetWiFiCache();
+    startConnect(CACHE_NONE);
+    return;
+  }
+  if (wifiPhase == WIFI_RENEW) {
+    Serial.println("[WiFi] DHCP didn't answer the renew — reconnecting");
+    wifiConnectStart = millis();
+    startConnect(CACHE_NONE);
+    return;
+  }
+
+  uint32_t waitMs = wifiBackoffMs / 2 + esp_random() % (wifiBackoffMs / 2 + 1);
+  wifiBackoffMs = min(wifiBackoffMs * 2, (uint32_t)WIFI_RETRY_MAX_MS);
+  wifiRetryAt = millis() + waitMs;
+  wifiPhase = WIFI_IDLE;
+  Serial.printf("[WiFi] Connection timed out! Retrying in %u ms\n", (unsigned)waitMs);
+  Serial.println("[WiFi] Check SSID/password. ESP32 only supports 2.4GHz WiFi.");
+}
+
+// Mean connect time of one path so far, for the log
+static uint32_t meanConnectMs(uint64_t totalMs, uint32_t count) {
+  return count ? (uint32_t)(totalMs / count) : 0;
+}
+
+static void linkEstablished() {
+  bool directed = wifiPhase == WIFI_FAST;
+  wifiPhase = WIFI_UP;
+  wifiBackoffMs = WIFI_RETRY_MIN_MS;
+  staticLease = directed && fastLease;
+  stats.connectMs = millis() - wifiConnectStart;
+  stats.connects++;
+  const char* path;
+  if (staticLease) {
+    path = "cached AP + lease";
+    stats.fastConnects++;
+    stats.fastConnectMsTotal += stats.connectMs;
+  } else if (directed) {
+    path = "cached AP + DHCP";
+    stats.apConnects++;
+    stats.apConnectMsTotal += stats.connectMs;
+  } else {
+    path = "scan + DHCP";
+    stats.fullConnectMsTotal += stats.connectMs;
+  }
+  saveWiFiCache(!staticLease);
+  uint32_t fullConnects = stats.connects - stats.fastConnects - stats.apConnects;
+  Serial.printf("[WiFi] Connected in %u ms (%s; mean %u ms over %u cached AP + lease, %u ms over %u cached AP + DHCP, "
+                "%u ms over %u scan + DHCP)! IP: ",
+                (unsigned)stats.connectMs, path,
+                (unsigned)meanConnectMs(stats.fastConnectMsTotal, stats.fastConnects), (unsigned)stats.fastConnects,
+                (unsigned)meanConnectMs(stats.apConnectMsTotal, stats.apConnects), (unsigned)stats.apConnects,
+                (unsigned)meanConnectMs(stats.fullConnectMsTotal, fullConnects), (unsigned)fullConnects);
+  Serial.println(WiFi.localIP());
+
+  // SNTP runs in the background from here; wall-clock timestamps stay
+  // unavailable until the first sync lands
+  configTime(0, 0, ntpServer1, ntpServer2);
+  notifyLink(LINK_UP);
+}
+
+/*
+ * Up on a cached lease that's now half spent: nothing will renew it, so
+ * hand the interface back to DHCP without dropping the association. The
+ * address is cleared until DHCP answers, so listeners see the link go
+ * down and come back (usually with the same address).
+ */
+static void renewLease() {
+  Serial.println("[WiFi] Cached lease is past half its time — renewing over DHCP");
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  staticLease = false;
+  wifiPhase = WIFI_RENEW;
+  wifiAttemptAt = millis();
+  stats.leaseRenewals++;
+  notifyLink(LINK_DOWN);
+}
+
+static void leaseRenewed() {
+  uint32_t oldIp = wifiCache.ip;
+  wifiPhase = WIFI_UP;
+  saveWiFiCache(true);
+  Serial.printf("[WiFi] Lease renewed in %lu ms%s IP: ", millis() - wifiAttemptAt,
+                wifiCache.ip == oldIp ? "," : " — new address!");
+  Serial.println(WiFi.localIP());
+  notifyLink(LINK_UP);
+}
+
+void wifiService() {
+  // A lease taken before the first SNTP sync gets its wall-clock time
+  // once the clock is set, so it stays usable after a soft reset
+  if (wifiPhase == WIFI_UP && leaseThisBoot && !wifiCache.leaseAt) {
+    int64_t now = wallClockMs();
+    if (now) {
+      wifiCache.leaseAt = now - (int64_t)(millis() - leaseMillis);
+      writeWiFiCache();
+    }
+  }
+
+  WiFiEventMsg msg;
+  while (xQueueReceive(wifiEvents, &msg, 0) == pdTRUE) {
+    if (msg.event == ARDUINO_EVENT_WIFI_STA_GOT_IP && wifiPhase == WIFI_RENEW) {
+      leaseRenewed();
+    } else if (msg.event == ARDUINO_EVENT_WIFI_STA_GOT_IP && wifiPhase != WIFI_UP) {
+      linkEstablished();
+    } else if (msg.event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED &&
+               (wifiPhase == WIFI_UP || wifiPhase == WIFI_RENEW)) {
+      // Disconnects while connecting are left to the attempt timeout:
+      // our own disconnect() before a retry would show up here too
+      Serial.printf("[WiFi] Link lost (reason %u) — reconnecting\n", msg.reason);
+      if (wifiPhase == WIFI_UP) notifyLink(LINK_DOWN);  // A renew already told them
+      wifiPhase = WIFI_IDLE;
+      wifiRetryAt = millis();
+    }
+  }
+
+  unsigned long now = millis();
+  if (wifiPhase == WIFI_UP && staticLease) {
+    int64_t age = leaseAgeMs(&wifiCache);
+    if (age < 0 || age >= (int64_t)wifiCache.leaseSecs * 500) renewLease();
+  }
+
+  if (wifiPhase == WIFI_IDLE && (long)(now - wifiRetryAt) >= 0) {
+    Serial.printf("[WiFi] Connecting to %s\n", wifiSsid);
+    wifiConnectStart = now;
+    startConnect(loadWiFiCache(&wifiCache));
+  } else if ((wifiPhase == WIFI_FAST && now - wifiAttemptAt > (fastLease ? WIFI_FAST_MS : WIFI_FAST_DHCP_MS)) ||
+             ((wifiPhase == WIFI_FULL || wifiPhase == WIFI_RENEW) && now - wifiAttemptAt > WIFI_TIMEOUT_MS)) {
+    connectTimedOut();
+  }
+}
+
+void wifiBegin(const char* ssid, const char* password, const char* nvsNamespace,
+               const char* ntp1, const char* ntp2) {
+  wifiSsid = ssid;
+  wifiPassword = password;
+  wifiNamespace = nvsNamespace;
+  ntpServer1 = ntp1;
+  ntpServer2 = ntp2;
+
+  wifiEvents = xQueueCreate(8, sizeof(WiFiEventMsg));
+  WiFi.onEvent(onWiFiEvent);
+  WiFi.setAutoReconnect(false);  // Reconnects are wifiService()'s, with backoff
+  WiFi.mode(WIFI_STA);
+  wifiService();
+}
+
+bool wifiLinkUp() {
+  return wifiPhase == WIFI_UP;
+}
+
+const WiFiStats& wifiStats() {
+  return stats;
+}
@@ -0,0 +1,71 @@
+/*
+ * WiFi link manager shared by the BumpBox firmwares (camera and S3).
+ *
+ * Connects in the background and never blocks the caller: wifiService()
+ * drives the connect state machine from WiFi driver events, tries the
+ * cached AP first (with its DHCP lease while that is still good, else
+ * with DHCP), falls back to a full scan + DHCP, and
+ * backs off with jitter between failed connects. A cached lease is handed
+ * back to DHCP once half of it has passed. Link transitions go to
+ * listeners registered with onLinkChange(). SNTP starts on every link up.
+ *
+ * Pulled into each project with lib_extra_dirs = ../lib.
+ */
+#pragma once
+
+#include <Arduino.h>
+
+// -- Timing (override with build_flags) --
+#ifndef WIFI_TIMEOUT_MS
+#define WIFI_TIMEOUT_MS   15000  // Full scan + DHCP connect attempt
+#endif
+#ifndef WIFI_FAST_MS
+#define WIFI_FAST_MS      3000   // Directed reconnect to the cached AP/lease; full scan + DHCP after this
+#endif
+#ifndef WIFI_FAST_DHCP_MS
+#define WIFI_FAST_DHCP_MS 6000   // The same when the lease can't be reused and DHCP runs
+#endif
+#ifndef WIFI_LEASE_DEFAULT_S
+#define WIFI_LEASE_DEFAULT_S 3600  // Assumed DHCP lease time when lwIP doesn't report one
+#endif
+#ifndef WIFI_RETRY_MIN_MS
+#define WIFI_RETRY_MIN_MS 1000   // Backoff after a failed connect: doubles per failure...
+#endif
+#ifndef WIFI_RETRY_MAX_MS
+#define WIFI_RETRY_MAX_MS 60000  // ...up to this (jittered)
+#endif
+
+// WiFi link transitions, for listeners registered with onLinkChange()
+enum LinkEvent { LINK_UP, LINK_DOWN };
+typedef void (*LinkListener)(LinkEvent event);
+
+struct WiFiStats {
+  uint32_t connects;      // First connect plus reconnects
+  uint32_t fastConnects;  // Of those, via the cached AP and lease
+  uint32_t apConnects;    // Of those, via the cached AP with DHCP
+  uint32_t connectMs;     // Duration of the last connect
+  uint64_t fastConnectMsTotal;  // Summed durations, per path, so the
+  uint64_t apConnectMsTotal;    // three can be compared
+  uint64_t fullConnectMsTotal;  // (cached AP + lease, cached AP + DHCP, scan + DHCP)
+  uint32_t leaseRenewals;       // Cached leases handed back to DHCP while up
+};
+
+// Starts the first connect. The cache lives under key "wifi" in the
+// given NVS (Preferences) namespace. Strings must outlive the manager.
+void wifiBegin(const char* ssid, const char* password, const char* nvsNamespace,
+               const char* ntpServer1, const char* ntpServer2 = nullptr);
+
+// Non-blocking; call often, always from the same task. Link listeners
+// run from here.
+void wifiService();
+
+// At most 4 listeners; register before wifiBegin()
+void onLinkChange(LinkListener listener);
+
+// The one link check: true only once wifiService() has the link up, so a
+// lease renewal in progress counts as down. Safe to call from any task.
+bool wifiLinkUp();
+const WiFiStats& wifiStats();
+
+// Epoch ms, or 0 if SNTP hasn't synced yet (clock still near 1970)
+int64_t wallClockMs();
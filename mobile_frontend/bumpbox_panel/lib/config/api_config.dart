@@ -9,9 +9,15 @@ class ApiConfig {
   /// Endpoint to trigger ESP32 camera capture
   static const String triggerCaptureEndpoint = '/api/locker/trigger-capture';
 
+  /// Endpoint to pre-arm the ESP32 camera (flash on, sensor streaming)
+  static const String armCaptureEndpoint = '/api/locker/arm-capture';
+
   /// Endpoint to fetch latest detection result
   static const String latestDetectionEndpoint = '/api/detections/latest';
 
+  /// Endpoint to reject the latest detection (kiosk "wrong item")
+  static const String rejectDetectionEndpoint = '/api/detections/reject';
+
   /// Endpoint to fetch latest captured image
   static const String latestImageEndpoint = '/api/detections/latest-image';
 
@@ -33,12 +39,22 @@ class ApiConfig {
   /// Polling interval for checking item sold status (in seconds)
   static const int statusPollIntervalSeconds = 15;
 
+  /// How long the server may hold the photo request for the camera's
+  /// full-resolution frame before serving the thumbnail (in seconds)
+  static const int fullImageWaitSeconds = 10;
+
   /// Full URL for trigger capture
   static String get triggerCaptureUrl => '$baseUrl$triggerCaptureEndpoint';
 
+  /// Full URL for arm capture
+  static String get armCaptureUrl => '$baseUrl$armCaptureEndpoint';
+
   /// Full URL for latest detection
   static String get latestDetectionUrl => '$baseUrl$latestDetectionEndpoint';
 
+  /// Full URL for rejecting a detection
+  static String get rejectDetectionUrl => '$baseUrl$rejectDetectionEndpoint';
+
   /// Full URL for latest image
   static String get latestImageUrl => '$baseUrl$latestImageEndpoint';
 
@@ -20,6 +20,7 @@ class _SellScreenState extends State<SellScreen> {
   // State management
   _ScreenState _currentState = _ScreenState.ready;
   DetectionResult? _detectionResult;
+  String? _imageUrl; // Built once per detection, so rebuilds don't refetch
   String? _errorMessage;
   Timer? _pollingTimer;
   DateTime? _pollingStartTime;
@@ -41,6 +42,8 @@ class _SellScreenState extends State<SellScreen> {
     _descriptionController = TextEditingController();
     _priceController = TextEditingController();
     _phoneController = TextEditingController();
+    // The seller is about to place an item and capture it: light the camera now
+    DetectionService.armCapture();
   }
 
   @override
@@ -102,11 +105,17 @@ class _SellScreenState extends State<SellScreen> {
         );
         setState(() {
           _detectionResult = result;
+          // Wait for the full frame; the detection's timestamp keeps the
+          // URL clear of an earlier detection's cached photo
+          _imageUrl =
+              '${ApiConfig.latestImageUrl}?wait=${ApiConfig.fullImageWaitSeconds}'
+              '&t=${result.timestamp.millisecondsSinceEpoch}';
           _currentState = _ScreenState.showingResults;
           _populateFormWithDetection(result);
         });
       } else {
         print('[SellScreen] Detection timed out - no result found');
+        DetectionService.armCapture(); // Ready for the retry
         setState(() {
           _currentState = _ScreenState.ready;
           _errorMessage =
@@ -115,6 +124,7 @@ class _SellScreenState extends State<SellScreen> {
       }
     } catch (e) {
       _pollingTimer?.cancel();
+      DetectionService.armCapture(); // Ready for the retry
       setState(() {
         _currentState = _ScreenState.ready;
         _errorMessage = 'Failed to trigger detection: $e';
@@ -192,10 +202,17 @@ class _SellScreenState extends State<SellScreen> {
     }
   }
 
+  Future<void> _rejectDetection() async {
+    await DetectionService.rejectDetection();
+    _retryDetection();
+  }
+
   void _retryDetection() {
+    DetectionService.armCapture(); // The last capture disarmed the camera
     setState(() {
       _currentState = _ScreenState.ready;
       _detectionResult = null;
+      _imageUrl = null;
       _errorMessage = null;
       _isEditing = false;
       _itemNameController.clear();
@@ -379,7 +396,7 @@ class _SellScreenState extends State<SellScreen> {
                   ),
                   padding: const EdgeInsets.all(16),
                   child: Image.network(
-                    '${ApiConfig.latestImageUrl}?t=${DateTime.now().millisecondsSinceEpoch}',
+                    _imageUrl!,
                     height: 250,
                     fit: BoxFit.contain,
                     errorBuilder: (context, error, stackTrace) {
@@ -636,6 +653,24 @@ class _SellScreenState extends State<SellScreen> {
 
                     const SizedBox(height: 32),
 
+                    // Wrong Item Button
+                    OutlinedButton.icon(
+                      onPressed: _rejectDetection,
+                      icon: const Icon(Icons.replay),
+                      label: const Text(
+                        'Wrong item? Retake photo',
+                        style: TextStyle(fontSize: 16),
+                      ),
+                      style: OutlinedButton.styleFrom(
+                        padding: const EdgeInsets.symmetric(vertical: 14),
+                        shape: RoundedRectangleBorder(
+                          borderRadius: BorderRadius.circular(8),
+                        ),
+                      ),
+                    ),
+
+                    const SizedBox(height: 12),
+
                     // List My Item Button
                     ElevatedButton(
                       onPressed: _createListing,
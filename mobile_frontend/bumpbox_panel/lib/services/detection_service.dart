@@ -33,6 +33,47 @@ class DetectionService {
     }
   }
 
+  /// Pre-arm the ESP32 camera for a capture that's about to come
+  ///
+  /// The camera turns its flash on and keeps the sensor streaming, so the
+  /// next trigger takes an already-lit frame instead of waiting for the
+  /// flash to settle. It disarms after that capture or after 60 s.
+  /// Best effort: on failure the capture just takes the slower cold path.
+  static Future<void> armCapture({String? lockerId}) async {
+    try {
+      final response = await http.post(
+        Uri.parse(ApiConfig.armCaptureUrl),
+        headers: {'Content-Type': 'application/json'},
+        body: jsonEncode({'lockerId': lockerId ?? ApiConfig.defaultLockerId}),
+      );
+      if (response.statusCode != 200) {
+        print('[DetectionService] Arm request failed: ${response.statusCode}');
+      }
+    } catch (e) {
+      print('[DetectionService] Arm request failed: $e');
+    }
+  }
+
+  /// Tell the backend the latest detection named the wrong item
+  ///
+  /// The backend discards it and forgets the cached labels it came from,
+  /// so the retake is labelled afresh instead of matching the same photo.
+  /// Best effort: on failure a retake may get the same answer back.
+  static Future<void> rejectDetection({String? lockerId}) async {
+    try {
+      final response = await http.post(
+        Uri.parse(ApiConfig.rejectDetectionUrl),
+        headers: {'Content-Type': 'application/json'},
+        body: jsonEncode({'lockerId': lockerId ?? ApiConfig.defaultLockerId}),
+      );
+      if (response.statusCode != 200) {
+        print('[DetectionService] Reject request failed: ${response.statusCode}');
+      }
+    } catch (e) {
+      print('[DetectionService] Reject request failed: $e');
+    }
+  }
+
   /// Fetch latest detection result from backend
   ///
   /// Returns null if no detection is available or if the detection
@@ -0,0 +1,259 @@
+// Synthetic hit-rate and latency benchmark for services/detectionCache.js.
+//
+//   npm run bench
+//
+// There is no recorded camera traffic to replay, so this generates a day of
+// seeded synthetic sell flows and reports, for a grid of Hamming thresholds
+// and perceptual TTLs, how many retakes the cache answers and how many
+// lookups it answers with another item's labels. It also replays the trace
+// through the real module at the shipped settings, and times lookupLabels().
+// Everything but the timing is deterministic: same seed, same numbers.
+//
+// How the shipped settings were chosen:
+//  - MAX_HAMMING_DISTANCE = 6 is the camera's UNCHANGED_MAX_BITS, so the
+//    server and the device agree on what "same contents" means. It was not
+//    tuned on real frames.
+//  - PERCEPTUAL_MAX_AGE_MS = 10 min is roughly one sell flow: the kiosk gives
+//    up on a detection after 30 s (ApiConfig.detectionTimeout) and a seller
+//    retakes within a couple of minutes. Past that, a similar hash more
+//    likely means a new, similar-looking item than the same one.
+// The grid below shows what those choices buy under the model's
+// assumptions; it does not prove them. Rerun it with other MODEL values if
+// the assumptions change.
+//
+// Model (all assumptions, none measured on the device):
+//  - Each locker has a fixed background dHash. An item replaces a rectangle
+//    of 2-6 x 2-6 of the 8x8 gradient cells with its own random bits, so a
+//    small item can change only a handful of bits.
+//  - Every capture flips each bit with probability MODEL.noiseBitFlip
+//    (sensor noise, slight shifts).
+//  - Sell flows arrive per locker with exponential gaps; the mean is
+//    MODEL.meanFlowGapMin. Within a flow the item may be captured again
+//    (retake) and the same bytes may be re-uploaded (HTTP retry).
+//  - On a miss the cache stores the labels (the Vision call); hits store
+//    nothing, as in server.js.
+
+import { lookupLabels, storeLabels } from '../services/detectionCache.js';
+
+const MODEL = {
+  seed: 42,
+  lockers: 4,
+  hours: 24,
+  meanFlowGapMin: 20,
+  noiseBitFlip: 0.03,
+  retakeChance: 0.35,       // per flow, second capture of the same item
+  secondRetakeChance: 0.1,  // per flow, third capture
+  retakeDelayS: [10, 120],
+  reuploadChance: 0.05,     // per flow, same bytes sent again
+  reuploadDelayS: [1, 5],
+  imageBytes: 12 * 1024,    // about a 320 px thumbnail
+};
+
+const THRESHOLDS = [2, 4, 6, 8, 10, 12];
+const TTLS_MIN = [2, 5, 10, 30, 60, 24 * 60];
+const SHIPPED = { threshold: 6, ttlMin: 10 };
+const DAY_MS = 24 * 60 * 60 * 1000; // exact-match lifetime, as in the module
+
+// mulberry32: small seeded PRNG, so the trace is the same on every run
+function prng(seed) {
+  let a = seed >>> 0;
+  return () => {
+    a = (a + 0x6d2b79f5) >>> 0;
+    let t = a;
+    t = Math.imul(t ^ (t >>> 15), t | 1);
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  };
+}
+
+const random = prng(MODEL.seed);
+const uniform = ([lo, hi]) => lo + random() * (hi - lo);
+const randomInt = (lo, hi) => lo + Math.floor(random() * (hi - lo + 1));
+const randomBits = () => (BigInt(Math.floor(random() * 2 ** 32)) << 32n) | BigInt(Math.floor(random() * 2 ** 32));
+
+function withNoise(hash) {
+  for (let bit = 0n; bit < 64n; bit++) {
+    if (random() < MODEL.noiseBitFlip) hash ^= 1n << bit;
+  }
+  return hash;
+}
+
+function popcount(x) {
+  let count = 0;
+  while (x) {
+    x &= x - 1n;
+    count++;
+  }
+  return count;
+}
+
+function randomImage() {
+  const bytes = Buffer.alloc(MODEL.imageBytes);
+  for (let i = 0; i < bytes.length; i += 4) bytes.writeUInt32LE(Math.floor(random() * 2 ** 32), i);
+  return bytes;
+}
+
+// Item placed in a locker: its rectangle of cells takes the item's bits
+function placeItem(background) {
+  const w = randomInt(2, 6);
+  const h = randomInt(2, 6);
+  const x0 = randomInt(0, 8 - w);
+  const y0 = randomInt(0, 8 - h);
+  let mask = 0n;
+  for (let y = y0; y < y0 + h; y++) {
+    for (let x = x0; x < x0 + w; x++) mask |= 1n << BigInt(y * 8 + x);
+  }
+  return (background & ~mask) | (randomBits() & mask);
+}
+
+// One day of captures, time-ordered: { at, item, hash, image, kind }
+function generateTrace() {
+  const captures = [];
+  let nextItem = 0;
+  for (let locker = 0; locker < MODEL.lockers; locker++) {
+    const background = randomBits();
+    let at = 0;
+    for (;;) {
+      at += -Math.log(1 - random()) * MODEL.meanFlowGapMin * 60 * 1000;
+      if (at >= MODEL.hours * 60 * 60 * 1000) break;
+      const item = nextItem++;
+      const itemHash = placeItem(background);
+      const first = { at, item, hash: withNoise(itemHash), image: randomImage(), kind: 'first' };
+      captures.push(first);
+      if (random() < MODEL.reuploadChance) {
+        captures.push({ ...first, at: at + uniform(MODEL.reuploadDelayS) * 1000, kind: 'reupload' });
+      }
+      let retakeAt = at;
+      for (const chance of [MODEL.retakeChance, MODEL.secondRetakeChance]) {
+        if (random() >= chance) break;
+        retakeAt += uniform(MODEL.retakeDelayS) * 1000;
+        captures.push({ at: retakeAt, item, hash: withNoise(itemHash), image: randomImage(), kind: 'retake' });
+      }
+    }
+  }
+  return captures.sort((a, b) => a.at - b.at);
+}
+
+// The module's matching rule with the threshold and TTL as parameters:
+// exact bytes within a day, else the nearest hash within the threshold and
+// TTL. No LRU eviction; a day of this trace never fills the older entries
+// back into play. Cross-checked against the real module below.
+function simulate(trace, threshold, ttlMs) {
+  const stored = [];
+  const result = { lookups: 0, hits: 0, exact: 0, retakes: 0, retakeHits: 0, falseHits: 0 };
+  for (const capture of trace) {
+    result.lookups++;
+    if (capture.kind === 'retake') result.retakes++;
+
+    let best = stored.find((e) => e.image === capture.image && capture.at - e.at <= DAY_MS);
+    if (best) {
+      result.exact++;
+    } else {
+      let bestDistance = Infinity;
+      for (const entry of stored) {
+        if (capture.at - entry.at > ttlMs) continue;
+        const distance = popcount(capture.hash ^ entry.hash);
+        if (distance <= threshold && distance < bestDistance) {
+          best = entry;
+          bestDistance = distance;
+        }
+      }
+    }
+
+    if (!best) {
+      stored.push(capture);
+      continue;
+    }
+    result.hits++;
+    if (best.item !== capture.item) result.falseHits++;
+    else if (capture.kind === 'retake') result.retakeHits++;
+  }
+  return result;
+}
+
+// The shipped settings through the real module, with Date.now() on the
+// trace clock
+function replay(trace) {
+  const realNow = Date.now;
+  const start = realNow();
+  const result = { lookups: 0, hits: 0, exact: 0, falseHits: 0 };
+  try {
+    for (const capture of trace) {
+      Date.now = () => start + capture.at;
+      const frameHash = capture.hash.toString(16).padStart(16, '0');
+      result.lookups++;
+      const hit = lookupLabels(capture.image, frameHash);
+      if (!hit) {
+        storeLabels(capture.image, frameHash, [{ description: `item ${capture.item}`, score: 0.9 }], 800);
+        continue;
+      }
+      result.hits++;
+      if (hit.match === 'exact') result.exact++;
+      if (hit.labels[0].description !== `item ${capture.item}`) result.falseHits++;
+    }
+  } finally {
+    Date.now = realNow;
+  }
+  return result;
+}
+
+// lookupLabels() latency on a full cache: a miss scans every entry, so it
+// is the worst case
+function lookupLatency() {
+  const images = [];
+  for (let i = 0; i < 256; i++) {
+    const image = randomImage();
+    const frameHash = randomBits().toString(16).padStart(16, '0');
+    storeLabels(image, frameHash, [{ description: 'bench', score: 0.9 }], 800);
+    images.push({ image, frameHash });
+  }
+  const time = (lookup) => {
+    const samples = [];
+    for (let i = 0; i < 2000; i++) {
+      const started = process.hrtime.bigint();
+      lookup(i);
+      samples.push(Number(process.hrtime.bigint() - started) / 1000);
+    }
+    samples.sort((a, b) => a - b);
+    return { p50: samples[1000], p99: samples[1980] };
+  };
+  const probe = randomImage();
+  time(() => lookupLabels(probe, null)); // warm-up
+  return {
+    miss: time(() => lookupLabels(probe, randomBits().toString(16).padStart(16, '0'))),
+    exactHit: time((i) => lookupLabels(images[i % 256].image, null)),
+  };
+}
+
+const percent = (part, whole) => (whole ? `${((100 * part) / whole).toFixed(1)}%` : '-');
+const pad = (text, width) => String(text).padStart(width);
+
+const trace = generateTrace();
+const firsts = trace.filter((c) => c.kind === 'first').length;
+console.log(`Synthetic day: ${MODEL.lockers} lockers, ${firsts} sell flows, ${trace.length} captures (seed ${MODEL.seed})`);
+console.log('retake hits: retakes answered with their own item\'s labels');
+console.log('false hits: lookups answered with another item\'s labels\n');
+console.log(`${pad('bits', 4)} ${pad('TTL', 6)} ${pad('hit rate', 9)} ${pad('retake hits', 12)} ${pad('false hits', 11)}`);
+for (const threshold of THRESHOLDS) {
+  for (const ttlMin of TTLS_MIN) {
+    const r = simulate(trace, threshold, ttlMin * 60 * 1000);
+    const mark = threshold === SHIPPED.threshold && ttlMin === SHIPPED.ttlMin ? '  <- shipped' : '';
+    const ttl = ttlMin >= 60 ? `${ttlMin / 60} h` : `${ttlMin} min`;
+    console.log(`${pad(threshold, 4)} ${pad(ttl, 6)} ${pad(percent(r.hits, r.lookups), 9)} ` +
+      `${pad(percent(r.retakeHits, r.retakes), 12)} ${pad(percent(r.falseHits, r.lookups), 11)}${mark}`);
+  }
+}
+
+const model = simulate(trace, SHIPPED.threshold, SHIPPED.ttlMin * 60 * 1000);
+const module = replay(trace);
+console.log(`\ndetectionCache.js on the same trace: ${module.hits}/${module.lookups} hits ` +
+  `(${module.exact} exact), ${module.falseHits} false`);
+if (module.hits !== model.hits || module.falseHits !== model.falseHits) {
+  console.error(`Model disagrees with the module: ${model.hits} hits, ${model.falseHits} false`);
+  process.exitCode = 1;
+}
+
+const latency = lookupLatency();
+console.log('\nlookupLabels() on a full cache (256 entries, 12 KB images), microseconds:');
+console.log(`  miss (full scan):  p50 ${latency.miss.p50.toFixed(1)}  p99 ${latency.miss.p99.toFixed(1)}`);
+console.log(`  exact hit:         p50 ${latency.exactHit.p50.toFixed(1)}  p99 ${latency.exactHit.p99.toFixed(1)}`);
@@ -1,12 +1,26 @@
 import { Router } from 'express';
 import multer from 'multer';
 import { writeFileSync } from 'fs';
-import { detectLabels, detectLabelsMock } from '../services/visionService.js';
-import { estimatePrice } from '../services/pricingService.js';
-import { storeDetection } from '../storage.js';
+import { detectLabels, detectLabelsBatch, detectLabelsMock, MAX_BATCH_IMAGES } from '../services/visionService.js';
+import { estimatePrice, hasPriceFor } from '../services/pricingService.js';
+import { lookupLabels, storeLabels, getCacheStats } from '../services/detectionCache.js';
+import { traceFromRequest, completeTrace } from '../services/traceLog.js';
+import { dedupeUploads } from '../services/uploadDedup.js';
+import { storeDetection, getDetectionForFrame, attachFullImage } from '../storage.js';
 
 const router = Router();
 
+// ESP32 on-device classifier results (X-Device-Label) at or above this
+// confidence are priced directly, without a Vision call
+const DEVICE_LABEL_MIN_CONFIDENCE = Number(process.env.DEVICE_LABEL_MIN_CONFIDENCE || 0.8);
+
+function deviceLabels(req) {
+  const label = req.get('X-Device-Label');
+  const confidence = Number(req.get('X-Device-Confidence'));
+  if (!label || !hasPriceFor(label) || !(confidence >= DEVICE_LABEL_MIN_CONFIDENCE)) return null;
+  return [{ description: label, score: Math.min(confidence, 1) }];
+}
+
 const upload = multer({
   storage: multer.memoryStorage(),
   limits: { fileSize: 1 * 1024 * 1024 },
@@ -19,8 +33,19 @@ const upload = multer({
   },
 });
 
-router.post('/detect-object', upload.single('image'), async (req, res) => {
+function toDetection(priceEstimate) {
+  return {
+    label: priceEstimate.label,
+    category: priceEstimate.category,
+    minPrice: priceEstimate.minPrice,
+    maxPrice: priceEstimate.maxPrice,
+    confidence: priceEstimate.confidence,
+  };
+}
+
+router.post('/detect-object', upload.single('image'), dedupeUploads, async (req, res) => {
   try {
+    const trace = traceFromRequest(req, Date.now());
     if (!req.file) {
       return res.status(400).json({ error: 'No image file provided. Send a multipart form with field name "image".' });
     }
@@ -31,10 +56,32 @@ router.post('/detect-object', upload.single('image'), async (req, res) => {
     console.log(`[detect-object] Saved debug image: ${debugPath} (${req.file.buffer.length} bytes)`);
 
     const useMock = process.env.USE_MOCK_VISION === 'true' || req.query.mock === 'true';
+    const frameHash = req.get('X-Frame-Hash') || null;
 
-    const labels = useMock
-      ? detectLabelsMock()
-      : await detectLabels(req.file.buffer);
+    // ESP32 per-stage spans for this capture so far, e.g. "settle=412.0;frame=530.2;..."
+    const captureTiming = req.get('X-Capture-Timing');
+    if (captureTiming) {
+      console.log(`[detect-object] Device timing (ms): ${captureTiming}`);
+    }
+
+    let labels;
+    const fromDevice = deviceLabels(req);
+    if (useMock) {
+      labels = detectLabelsMock();
+    } else if (fromDevice) {
+      labels = fromDevice;
+      console.log(`[detect-object] On-device label ${fromDevice[0].description} (${Math.round(fromDevice[0].score * 100)}%) — skipped Vision API`);
+    } else {
+      const cached = lookupLabels(req.file.buffer, frameHash);
+      if (cached) {
+        labels = cached.labels;
+        console.log(`[detect-object] Cache hit (${cached.match}, distance ${cached.distance}) — skipped Vision API`);
+      } else {
+        const start = performance.now();
+        labels = await detectLabels(req.file.buffer);
+        storeLabels(req.file.buffer, frameHash, labels, performance.now() - start);
+      }
+    }
 
     const priceEstimate = estimatePrice(labels);
 
@@ -42,17 +89,14 @@ router.post('/detect-object', upload.single('image'), async (req, res) => {
     labels.forEach((l, i) => console.log(`  ${i+1}. ${l.description} (${Math.round(l.score * 100)}%)`));
     console.log(`[detect-object] Result: ${priceEstimate.label} (${priceEstimate.confidence}%) | ${priceEstimate.category} | $${priceEstimate.minPrice}-$${priceEstimate.maxPrice}`);
 
-    const detection = {
-      label: priceEstimate.label,
-      category: priceEstimate.category,
-      minPrice: priceEstimate.minPrice,
-      maxPrice: priceEstimate.maxPrice,
-      confidence: priceEstimate.confidence,
-    };
+    const detection = toDetection(priceEstimate);
 
-    // Store detection result for Flutter app polling
+    // Store detection result for Flutter app polling. A thumbnail (progressive
+    // upload) is replaced by the full frame via /detect-object/full-image.
     const lockerId = req.query.lockerId || req.body.lockerId || 'locker1';
-    storeDetection(detection, lockerId, req.file.buffer);
+    const isThumbnail = req.query.stage === 'thumbnail';
+    storeDetection(detection, lockerId, req.file.buffer, frameHash, !isThumbnail, trace?.traceId);
+    completeTrace(trace, lockerId, Date.now());
 
     return res.status(200).json({
       success: true,
@@ -65,4 +109,127 @@ router.post('/detect-object', upload.single('image'), async (req, res) => {
   }
 });
 
+// Several frames in one request (ESP32 catching up after an outage or a
+// burst). Cache misses go to Vision in a single images:annotate call.
+// X-Frame-Hashes: comma-separated device hashes, in image order.
+// Results are per image; they're stored in order, so the last is latest.
+router.post('/detect-object/batch', upload.array('images', MAX_BATCH_IMAGES), dedupeUploads, async (req, res) => {
+  try {
+    const files = req.files || [];
+    if (files.length === 0) {
+      return res.status(400).json({ error: 'No image files provided. Send a multipart form with field name "images".' });
+    }
+
+    const useMock = process.env.USE_MOCK_VISION === 'true' || req.query.mock === 'true';
+    const frameHashes = (req.get('X-Frame-Hashes') || '').split(',').map(h => h.trim() || null);
+
+    // Per image: { labels, cached } or { error }
+    const results = files.map(() => ({}));
+    const misses = [];
+    files.forEach((file, i) => {
+      if (useMock) {
+        results[i].labels = detectLabelsMock();
+        return;
+      }
+      const cached = lookupLabels(file.buffer, frameHashes[i]);
+      if (cached) {
+        results[i].labels = cached.labels;
+        results[i].cached = true;
+      } else {
+        misses.push(i);
+      }
+    });
+
+    if (misses.length > 0) {
+      const start = performance.now();
+      const labelled = await detectLabelsBatch(misses.map(i => files[i].buffer));
+      const elapsedMs = performance.now() - start;
+      labelled.forEach((result, k) => {
+        const i = misses[k];
+        if (result.error) {
+          results[i].error = result.error;
+        } else {
+          results[i].labels = result.labels;
+          storeLabels(files[i].buffer, frameHashes[i], result.labels, elapsedMs / misses.length);
+        }
+      });
+      console.log(`[detect-object] Batch: ${misses.length} image(s) in one Vision call (${Math.round(elapsedMs)} ms)`);
+    }
+
+    const lockerId = req.query.lockerId || req.body.lockerId || 'locker1';
+    const response = results.map((result, i) => {
+      if (result.error) {
+        console.log(`[detect-object] Batch image ${i}: Vision error: ${result.error}`);
+        return { index: i, success: false, error: result.error };
+      }
+      const detection = toDetection(estimatePrice(result.labels));
+      storeDetection(detection, lockerId, files[i].buffer, frameHashes[i]);
+      console.log(`[detect-object] Batch image ${i}: ${detection.label} (${detection.confidence}%)${result.cached ? ' [cache]' : ''}`);
+      return { index: i, success: true, cached: !!result.cached, detection };
+    });
+
+    return res.status(200).json({ success: true, count: files.length, results: response });
+  } catch (error) {
+    console.error('[detect-object] Error:', error.message);
+    return res.status(500).json({ error: 'Detection failed', details: error.message });
+  }
+});
+
+// Detection cache counters (hits/misses and Vision latency saved)
+router.get('/detect-object/cache-stats', (req, res) => {
+  return res.status(200).json(getCacheStats());
+});
+
+// ESP32 change detection: the new frame matches the one it last uploaded
+// (X-Frame-Hash), so reuse that detection instead of another Vision call.
+// 409 tells the device we no longer have it and it should send the image.
+router.post('/detect-object/unchanged', dedupeUploads, (req, res) => {
+  try {
+    const trace = traceFromRequest(req, Date.now());
+    const lockerId = req.query.lockerId || 'locker1';
+    const frameHash = req.get('X-Frame-Hash');
+    const previous = getDetectionForFrame(lockerId, frameHash);
+    if (!previous) {
+      console.log(`[detect-object] Unchanged frame ${frameHash} for ${lockerId}, but no matching detection — asking for image`);
+      return res.status(409).json({ error: 'No detection for this frame. Send the image.' });
+    }
+
+    // Re-store so the Flutter app sees a fresh timestamp
+    storeDetection(previous.result, lockerId, previous.imageBuffer, frameHash, previous.fullImage, trace?.traceId);
+    completeTrace(trace, lockerId, Date.now());
+    console.log(`[detect-object] Unchanged frame for ${lockerId}, reusing: ${previous.result.label}`);
+
+    return res.status(200).json({
+      success: true,
+      unchanged: true,
+      detection: previous.result,
+    });
+  } catch (error) {
+    console.error('[detect-object] Error:', error.message);
+    return res.status(500).json({ error: 'Detection failed', details: error.message });
+  }
+});
+
+// Progressive upload, second stage: the full-resolution frame for a detection
+// already made from its thumbnail (same X-Frame-Hash). No detection runs.
+router.post('/detect-object/full-image', upload.single('image'), dedupeUploads, (req, res) => {
+  try {
+    if (!req.file) {
+      return res.status(400).json({ error: 'No image file provided. Send a multipart form with field name "image".' });
+    }
+
+    const lockerId = req.query.lockerId || 'locker1';
+    const frameHash = req.get('X-Frame-Hash');
+    if (!attachFullImage(lockerId, frameHash, req.file.buffer)) {
+      console.log(`[detect-object] Full image for ${frameHash} (${lockerId}) has no matching detection`);
+      return res.status(409).json({ error: 'No detection for this frame.' });
+    }
+
+    return res.status(200).json({ success: true });
+  } catch (error) {
+    console.error('[detect-object] Error:', error.message);
+    return res.status(500).json({ error: 'Failed to attach image', details: error.message });
+  }
+});
+
 export default router;
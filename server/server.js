@@ -12,7 +12,9 @@ import db from "./dbConnection.js";
 import Stripe from "stripe";
 import cors from "cors";
 import { addDaysAndFormat } from "./utils/helperfunctions.js";
-import { setCaptureTrigger, getAndResetCaptureTrigger, getLatestDetection, storeDetection, latestDetection } from './storage.js';
+import { markDelivered, captureLatencySummary } from './services/traceLog.js';
+import { forgetLabels } from './services/detectionCache.js';
+import { setCaptureTrigger, getAndResetCaptureTrigger, waitForCaptureTrigger, subscribeCaptureTrigger, armCaptureStreams, getLatestDetection, rejectLatestDetection, storeDetection, latestDetection, waitForFullImage, solenoid, setSolenoidState, getSolenoidState, subscribeSolenoidState, ackSolenoidState } from './storage.js';
 
 const app = express();
 const __dirname = resolve(); 
@@ -28,8 +30,7 @@ const scheduleCapture = (paymentIntentId) => {
     captureTimeout = setTimeout(async () => {
         try {
             await stripe.paymentIntents.capture(paymentIntentId);
-            solenoidState = false; // Lock door after test period expires
-            console.log("[solenoid] Test period expired, locking door");
+            setSolenoidState(false, "test period expired"); // Lock door after test period expires
         } catch (err) {
             console.error("Capture failed:", err);
         }
@@ -44,23 +45,54 @@ const cancelCapture = () => {
 }
  
 let testing_intent;
-let solenoidState = false; // Global state for solenoid control
 
-// Get solenoid state
+// Get solenoid state (S3 controller reconciliation poll; the stream below is the fast path)
 app.get("/api/solenoid/state", (req, res) => {
-    res.status(200).json({ solenoidOn: solenoidState });
+    res.status(200).json(getSolenoidState());
 });
 
 // Toggle solenoid state
 app.post("/api/solenoid/toggle", (req, res) => {
-    solenoidState = !solenoidState;
-    console.log(`[solenoid] Toggled manually to: ${solenoidState ? 'ON' : 'OFF'}`);
-    res.status(200).json({ solenoidOn: solenoidState });
+    setSolenoidState(!solenoid.on, "manual toggle");
+    res.status(200).json(getSolenoidState());
+});
+
+// S3 controller push channel for solenoid state (Server-Sent Events).
+// Sends the current state on connect, then every change.
+app.get("/api/solenoid/stream", (req, res) => {
+    res.set({
+        'Content-Type': 'text/event-stream',
+        'Cache-Control': 'no-cache',
+        'X-Accel-Buffering': 'no', // stop the EB nginx proxy from buffering events
+    });
+    res.flushHeaders();
+    res.socket.setNoDelay(true);
+
+    const unsubscribe = subscribeSolenoidState((event) => {
+        res.write(`data: ${JSON.stringify(event)}\n\n`);
+    });
+    // Heartbeat keeps the load balancer from idling the stream out and lets the S3 detect a dead link
+    const heartbeat = setInterval(() => res.write(': ping\n\n'), 15000);
+    console.log('[solenoid-stream] Controller connected');
+
+    res.on('close', () => {
+        clearInterval(heartbeat);
+        unsubscribe();
+        console.log('[solenoid-stream] Controller disconnected');
+    });
+});
+
+// S3 controller acknowledges a state change once the relay has switched (latency logging)
+app.post("/api/solenoid/ack", json(), (req, res) => {
+    const { seq, relayAt, eventToRelayMs } = req.body || {};
+    const logged = ackSolenoidState(Number(seq), Number(relayAt) || 0, Number(eventToRelayMs) || 0);
+    res.status(200).json({ success: true, logged });
 });
 
 //webhook endpoint for stripe
 //update item to sold when payment is successful
 app.post("/webhook", raw({ type: "application/json" }), async (req, res) => {
+    const receivedAt = Date.now(); // Unlock latency is measured from here to the relay edge
     const signature = req.headers["stripe-signature"];
     if (!signature) {
         const parsed = JSON.parse(req.body.toString());
@@ -83,8 +115,7 @@ app.post("/webhook", raw({ type: "application/json" }), async (req, res) => {
         await db.execute(query, [rows[0].itemid]);
         await stripe.paymentLinks.update(rows[0].paymentLinkid, { active: false }); //disable payment link after successful payment
         
-        solenoidState = false; // Lock door after final payment success
-        console.log("[solenoid] Payment succeeded, locking door");
+        setSolenoidState(false, "payment succeeded", receivedAt); // Lock door after final payment success
 
         // store the successful transaction in database for paynow to seller purpose
         const amount = event.data.object.amount_received;
@@ -107,8 +138,7 @@ app.post("/webhook", raw({ type: "application/json" }), async (req, res) => {
         //     })
         // );
 
-        solenoidState = true; // Unlock door for buyer to retrieve item
-        console.log("[solenoid] Checkout completed, unlocking door");
+        setSolenoidState(true, "checkout completed", receivedAt); // Unlock door for buyer to retrieve item
 
         if (testing_intent === true) {
             console.log("Using testing intent for scheduling capture:", testing_intent);
@@ -147,8 +177,7 @@ app.get("/api/return", async (req, res) => {
         const query = `UPDATE items SET sale_status = 0 WHERE itemid = ?`;
         await db.execute(query, [itemid]);
 
-        solenoidState = false; // Lock door after item is returned
-        console.log("[solenoid] Item returned, locking door");
+        setSolenoidState(false, "item returned"); // Lock door after item is returned
 
         res.status(200).json({ message: "item returned", status: false });
     } catch (error) {
@@ -161,18 +190,54 @@ app.get("/api/return", async (req, res) => {
 app.post('/api/locker/trigger-capture', (req, res) => {
     try {
         const lockerId = req.body.lockerId || 'locker1';
-        setCaptureTrigger(lockerId);
-        console.log(`[trigger-capture] Capture triggered for ${lockerId}`);
-        return res.status(200).json({ success: true, message: 'Capture triggered', lockerId });
+        const traceId = setCaptureTrigger(lockerId);
+        console.log(`[trigger-capture] Capture triggered for ${lockerId} (trace ${traceId})`);
+        return res.status(200).json({ success: true, message: 'Capture triggered', lockerId, traceId });
     } catch (error) {
         console.error('[trigger-capture] Error:', error.message);
         return res.status(500).json({ error: 'Failed to trigger capture' });
     }
 });
 
-// ESP32 polling endpoint to check if capture should be triggered
-app.get('/api/locker/capture-trigger', (req, res) => {
+// Pre-arm the ESP32 camera when a sell flow is about to capture (called by Flutter app)
+app.post('/api/locker/arm-capture', (req, res) => {
+    try {
+        const lockerId = req.body.lockerId || 'locker1';
+        const notified = armCaptureStreams(lockerId);
+        console.log(`[arm-capture] Arm request for ${lockerId} (${notified} stream(s))`);
+        return res.status(200).json({ success: true, armed: notified > 0, lockerId });
+    } catch (error) {
+        console.error('[arm-capture] Error:', error.message);
+        return res.status(500).json({ error: 'Failed to arm capture' });
+    }
+});
+
+// Armed vs cold trigger -> frame latency over recent capture traces, to check
+// what arming from the sell flow buys
+app.get('/api/traces/capture-latency', (req, res) => {
+    return res.status(200).json(captureLatencySummary());
+});
+
+// ESP32 polling endpoint to check if capture should be triggered.
+// With ?wait=<seconds> it becomes a long poll: the request is held open until a
+// trigger arrives for ?lockerId or the wait expires.
+const MAX_TRIGGER_WAIT_S = 30;
+
+app.get('/api/locker/capture-trigger', async (req, res) => {
     try {
+        const waitSeconds = Math.min(Number(req.query.wait) || 0, MAX_TRIGGER_WAIT_S);
+        if (waitSeconds > 0) {
+            const lockerId = req.query.lockerId || 'locker1';
+            const controller = new AbortController();
+            res.on('close', () => controller.abort()); // ESP32 hung up early
+            const result = await waitForCaptureTrigger(lockerId, waitSeconds * 1000, controller.signal);
+            if (controller.signal.aborted) return;
+            if (result.shouldCapture) {
+                console.log(`[capture-trigger] ESP32 long poll picked up capture trigger for ${lockerId}`);
+            }
+            return res.status(200).json(result);
+        }
+
         const result = getAndResetCaptureTrigger();
         if (result.shouldCapture) {
             console.log(`[capture-trigger] ESP32 acknowledged capture trigger for ${result.lockerId}`);
@@ -184,12 +249,40 @@ app.get('/api/locker/capture-trigger', (req, res) => {
     }
 });
 
+// ESP32 push channel for capture triggers (Server-Sent Events).
+// The camera keeps this open; /api/locker/capture-trigger polling is the fallback.
+app.get('/api/locker/trigger-stream', (req, res) => {
+    const lockerId = req.query.lockerId || 'locker1';
+    res.set({
+        'Content-Type': 'text/event-stream',
+        'Cache-Control': 'no-cache',
+        'X-Accel-Buffering': 'no', // stop the EB nginx proxy from buffering events
+    });
+    res.flushHeaders();
+    res.socket.setNoDelay(true);
+
+    const unsubscribe = subscribeCaptureTrigger(lockerId, (event) => {
+        console.log(`[trigger-stream] Pushed ${event.arm ? 'arm request' : 'capture trigger'} to ${lockerId}`);
+        res.write(`data: ${JSON.stringify(event)}\n\n`);
+    });
+    // Heartbeat keeps the load balancer from idling the stream out and lets the ESP32 detect a dead link
+    const heartbeat = setInterval(() => res.write(': ping\n\n'), 15000);
+    console.log(`[trigger-stream] ${lockerId} connected`);
+
+    res.on('close', () => {
+        clearInterval(heartbeat);
+        unsubscribe();
+        console.log(`[trigger-stream] ${lockerId} disconnected`);
+    });
+});
+
 // Get latest detection result (polled by Flutter app)
 app.get('/api/detections/latest', (req, res) => {
     try {
         const sinceTimestamp = req.query.since;
         console.log(`[detections/latest] Request with since=${sinceTimestamp}`);
         const result = getLatestDetection(sinceTimestamp);
+        if (result.detection) markDelivered(result.traceId); // closes the capture trace (kiosk hop)
         console.log(`[detections/latest] Returning: ${result.detection ? result.detection.label : 'null'}`);
         return res.status(200).json(result);
     } catch (error) {
@@ -198,15 +291,42 @@ app.get('/api/detections/latest', (req, res) => {
     }
 });
 
-// Get latest captured image (polled by Flutter app)
-app.get('/api/detections/latest-image', (req, res) => {
+// Kiosk "wrong item": discard the latest detection and the cached Vision labels
+// behind it, so the retake is labelled afresh instead of hitting the cache
+app.post('/api/detections/reject', (req, res) => {
     try {
-        if (!latestDetection.imageBuffer) {
+        const lockerId = req.body.lockerId || 'locker1';
+        const rejected = rejectLatestDetection(lockerId);
+        const forgotten = rejected ? forgetLabels(rejected.imageBuffer, rejected.imageHash) : 0;
+        console.log(`[detections/reject] ${lockerId}: ${rejected ? 'detection discarded' : 'no detection'}, ${forgotten} cache entr${forgotten === 1 ? 'y' : 'ies'} dropped`);
+        return res.status(200).json({ success: true, rejected: rejected !== null, forgotten });
+    } catch (error) {
+        console.error('[detections/reject] Error:', error.message);
+        return res.status(500).json({ error: 'Failed to reject detection' });
+    }
+});
+
+// Get latest captured image (polled by Flutter app).
+// The detection usually lands while only its thumbnail is stored (progressive
+// upload), so the kiosk's listing photo would be ~320px. With ?wait=<seconds>
+// the request is held until the camera's full frame arrives, then served,
+// else the thumbnail. Without it, whatever is stored is served at once.
+const MAX_FULL_IMAGE_WAIT_S = 30;
+
+app.get('/api/detections/latest-image', async (req, res) => {
+    try {
+        const waitSeconds = Math.min(Number(req.query.wait) || 0, MAX_FULL_IMAGE_WAIT_S);
+        const controller = new AbortController();
+        res.on('close', () => controller.abort()); // Kiosk gave up
+        const image = await waitForFullImage(waitSeconds * 1000, controller.signal);
+        if (controller.signal.aborted) return;
+        if (!image) {
             return res.status(404).json({ error: 'No image available' });
-        } 
+        }
         res.set('Content-Type', 'image/jpeg');
         res.set('Cache-Control', 'no-cache, no-store, must-revalidate');
-        return res.send(latestDetection.imageBuffer);
+        res.set('X-Full-Image', String(latestDetection.fullImage));
+        return res.send(image);
     } catch (error) {
         console.error('[detections/latest-image] Error:', error.message);
         return res.status(500).json({ error: 'Failed to fetch image' });
@@ -341,8 +461,7 @@ app.post("/api/item", async (req, res) => {
             paymentLink.id
         ]);
 
-        solenoidState = true; // Unlock door for seller to deposit item
-        console.log("[solenoid] Item listed, unlocking door for seller");
+        setSolenoidState(true, "item listed"); // Unlock door for seller to deposit item
 
         return res.status(201).json({
             message: "Item created successfully",
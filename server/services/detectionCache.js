@@ -0,0 +1,162 @@
+import { createHash } from 'crypto';
+
+// LRU cache of Vision labels keyed by image hash, so a re-photographed item
+// skips the Google Vision round trip.
+//
+// Keys:
+//  - frameHash: 64-bit perceptual dHash from the ESP32 (X-Frame-Hash, 16 hex
+//    chars). Matched by Hamming distance, so a slightly different shot of the
+//    same contents still hits.
+//  - digest: SHA-1 of the image bytes, for uploads without a device hash.
+//    Exact re-uploads only.
+//
+// A perceptual hit is a guess that the locker still holds the same item, so
+// it is only trusted for a few minutes (the same sell flow); an exact match
+// is the same photo and keeps its labels for a day. The kiosk's "wrong item"
+// button calls forgetLabels() so a retake goes back to Vision.
+
+const MAX_ENTRIES = 256;
+const MAX_AGE_MS = 24 * 60 * 60 * 1000;
+const PERCEPTUAL_MAX_AGE_MS = 10 * 60 * 1000;
+const MAX_HAMMING_DISTANCE = 6; // of 64 bits, same threshold as the device
+// How these two were picked, and what they give on synthetic traffic:
+// bench/detectionCache.bench.js (npm run bench)
+
+// Map iteration order is insertion order: oldest first, re-inserted on hit
+const entries = new Map();
+
+const stats = {
+  hits: 0,
+  misses: 0,
+  forgotten: 0,
+  visionCalls: 0,
+  visionMsTotal: 0,
+  savedMs: 0,
+};
+
+function parseFrameHash(frameHash) {
+  return /^[0-9a-f]{16}$/i.test(frameHash || '') ? BigInt(`0x${frameHash}`) : null;
+}
+
+function hammingDistance(a, b) {
+  let x = a ^ b;
+  let count = 0;
+  while (x) {
+    x &= x - 1n;
+    count++;
+  }
+  return count;
+}
+
+function digestOf(imageBuffer) {
+  return createHash('sha1').update(imageBuffer).digest('hex');
+}
+
+function averageVisionMs() {
+  return stats.visionCalls ? stats.visionMsTotal / stats.visionCalls : 0;
+}
+
+/**
+ * Look up cached labels for an image. Returns { labels, match, distance } on a
+ * hit (and counts the Vision latency it saved), or null on a miss.
+ */
+export function lookupLabels(imageBuffer, frameHash) {
+  const now = Date.now();
+  const phash = parseFrameHash(frameHash);
+  const digest = digestOf(imageBuffer);
+
+  let best = null;
+  let bestDistance = Infinity;
+  for (const [key, entry] of entries) {
+    if (now - entry.storedAt > MAX_AGE_MS) {
+      entries.delete(key);
+      continue;
+    }
+    if (entry.digest === digest) {
+      best = entry;
+      bestDistance = 0;
+      break;
+    }
+    if (phash !== null && entry.phash !== null && now - entry.storedAt <= PERCEPTUAL_MAX_AGE_MS) {
+      const distance = hammingDistance(phash, entry.phash);
+      if (distance <= MAX_HAMMING_DISTANCE && distance < bestDistance) {
+        best = entry;
+        bestDistance = distance;
+      }
+    }
+  }
+
+  if (!best) {
+    stats.misses++;
+    return null;
+  }
+
+  // Refresh LRU position
+  entries.delete(best.digest);
+  entries.set(best.digest, best);
+
+  stats.hits++;
+  stats.savedMs += averageVisionMs();
+  return {
+    labels: best.labels,
+    match: bestDistance === 0 && best.digest === digest ? 'exact' : 'perceptual',
+    distance: bestDistance,
+  };
+}
+
+/**
+ * Cache labels from a real Vision call and record how long it took.
+ */
+export function storeLabels(imageBuffer, frameHash, labels, visionMs) {
+  stats.visionCalls++;
+  stats.visionMsTotal += visionMs;
+
+  const digest = digestOf(imageBuffer);
+  entries.delete(digest);
+  entries.set(digest, {
+    digest,
+    phash: parseFrameHash(frameHash),
+    labels,
+    storedAt: Date.now(),
+  });
+
+  // Evict least recently used
+  while (entries.size > MAX_ENTRIES) {
+    entries.delete(entries.keys().next().value);
+  }
+}
+
+/**
+ * Drop the labels behind a detection the kiosk user rejected: the entry for
+ * these exact bytes and every entry a lookup with this frame hash could hit.
+ * Returns the number of entries removed.
+ */
+export function forgetLabels(imageBuffer, frameHash) {
+  const phash = parseFrameHash(frameHash);
+  const digest = imageBuffer ? digestOf(imageBuffer) : null;
+  let removed = 0;
+  for (const [key, entry] of entries) {
+    const similar = phash !== null && entry.phash !== null &&
+      hammingDistance(phash, entry.phash) <= MAX_HAMMING_DISTANCE;
+    if (entry.digest === digest || similar) {
+      entries.delete(key);
+      removed++;
+    }
+  }
+  stats.forgotten += removed;
+  return removed;
+}
+
+export function getCacheStats() {
+  const lookups = stats.hits + stats.misses;
+  return {
+    size: entries.size,
+    hits: stats.hits,
+    misses: stats.misses,
+    forgotten: stats.forgotten,
+    hitRate: lookups ? stats.hits / lookups : 0,
+    visionCalls: stats.visionCalls,
+    avgVisionMs: Math.round(averageVisionMs()),
+    savedMs: Math.round(stats.savedMs),
+  };
+}
@@ -7,6 +7,11 @@ const priceMap = JSON.parse(
   readFileSync(resolve(__dirname, '..', 'data', 'priceMap.json'), 'utf-8')
 );
 
+// True if the label has its own priceMap entry (not the Uncategorized fallback)
+export function hasPriceFor(label) {
+  return Object.prototype.hasOwnProperty.call(priceMap, label);
+}
+
 export function estimatePrice(labels) {
   for (const label of labels) {
     const key = label.description;
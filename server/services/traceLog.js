@@ -0,0 +1,150 @@
+import { randomUUID } from 'crypto';
+
+// End-to-end capture traces. A trace ID is minted when the kiosk triggers a
+// capture, handed to the ESP32 with the trigger, and comes back on the upload
+// (X-Trace-Id) along with the device's SNTP wall-clock timestamps. Each
+// finished trace is logged as one "[trace] {json}" line of per-hop durations
+// (ms) so tail latency can be charted from the logs:
+//
+//   trigger  kiosk trigger -> ESP32 received it   (push / long poll delivery)
+//   capture  received -> frame captured           (settle + exposure)
+//   device   captured -> upload started           (crop, hash, encode, queue)
+//   network  upload started -> request parsed    (Wi-Fi + internet)
+//   server   request parsed -> detection stored  (cache / Vision / pricing)
+//   kiosk    stored -> kiosk fetched it           (Flutter poll interval)
+//
+// Hops that cross devices rely on both clocks being NTP-synced; a device that
+// hasn't synced yet sends no timestamps and those hops are null.
+//
+// The capture hop also depends on whether the camera was armed (flash already
+// on, sensor streaming) when the trigger came in: the device sends
+// X-Capture-Path, each line carries it as "path", and the recent capture hops
+// are kept per path for captureLatencySummary().
+
+const MAX_TRACES = 100;
+const MAX_AGE_MS = 10 * 60 * 1000;
+const CAPTURE_SAMPLES = 200;  // Per path
+
+// path -> recent capture hops (ms), oldest first
+const captureSamples = { armed: [], cold: [] };
+
+// traceId -> { lockerId, triggeredAt, hops, storedAt, delivered }
+const traces = new Map();
+
+function prune(now) {
+  for (const [traceId, trace] of traces) {
+    if (traces.size <= MAX_TRACES && now - trace.triggeredAt <= MAX_AGE_MS) break;
+    traces.delete(traceId);
+  }
+}
+
+function span(from, to) {
+  return from && to ? to - from : null;
+}
+
+function log(traceId, trace) {
+  console.log(`[trace] ${JSON.stringify({ traceId, lockerId: trace.lockerId, path: trace.path, ...trace.hops })}`);
+}
+
+function recordCapture(path, ms) {
+  const samples = captureSamples[path];
+  if (!samples || ms == null || ms < 0) return;
+  samples.push(ms);
+  if (samples.length > CAPTURE_SAMPLES) samples.shift();
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p / 100))];
+}
+
+/**
+ * Start a trace for a kiosk-initiated capture. Returns { traceId, triggeredAt }
+ * (epoch ms) to send to the ESP32 with the trigger.
+ */
+export function startTrace(lockerId) {
+  const now = Date.now();
+  prune(now);
+  const traceId = randomUUID();
+  traces.set(traceId, { lockerId, triggeredAt: now, hops: null, storedAt: null, delivered: false });
+  return { traceId, triggeredAt: now };
+}
+
+/**
+ * Read trace headers from an ESP32 upload. receivedAt is when the server had
+ * the whole request. Returns null for uploads without a trace ID.
+ */
+export function traceFromRequest(req, receivedAt) {
+  const traceId = req.get('X-Trace-Id');
+  if (!traceId) return null;
+  const epochMs = (name) => Number(req.get(name)) || null;
+  return {
+    traceId,
+    triggerReceivedAt: epochMs('X-Trigger-Received-At'),
+    capturedAt: epochMs('X-Captured-At'),
+    sentAt: epochMs('X-Sent-At'),
+    path: req.get('X-Capture-Path') || null,
+    receivedAt,
+  };
+}
+
+/**
+ * The upload for a trace has been turned into a stored detection. Device-made
+ * traces (button or serial captures) have no kiosk trigger, so their trigger
+ * hop is null and they're logged right away; kiosk traces are logged once the
+ * kiosk fetches the detection (markDelivered).
+ */
+export function completeTrace(trace, lockerId, storedAt) {
+  if (!trace) return;
+  const known = traces.get(trace.traceId);
+  const hops = {
+    trigger: span(known?.triggeredAt, trace.triggerReceivedAt),
+    capture: span(trace.triggerReceivedAt, trace.capturedAt),
+    device: span(trace.capturedAt, trace.sentAt),
+    network: span(trace.sentAt, trace.receivedAt),
+    server: storedAt - trace.receivedAt,
+    kiosk: null,
+    total: null,
+  };
+  recordCapture(trace.path, hops.capture);
+
+  if (!known) {
+    hops.total = span(trace.triggerReceivedAt, storedAt);
+    log(trace.traceId, { lockerId, path: trace.path, hops });
+    return;
+  }
+  known.path = trace.path;
+  known.hops = hops;
+  known.storedAt = storedAt;
+}
+
+/**
+ * The kiosk has fetched the detection for this trace: log it, once.
+ */
+export function markDelivered(traceId) {
+  const trace = traceId && traces.get(traceId);
+  if (!trace || !trace.hops || trace.delivered) return;
+  const now = Date.now();
+  trace.delivered = true;
+  trace.hops.kiosk = now - trace.storedAt;
+  trace.hops.total = now - trace.triggeredAt;
+  log(traceId, trace);
+}
+
+/**
+ * Trigger received -> frame captured (the capture hop) over the recent
+ * traces, armed vs cold: { armed: { n, meanMs, p50Ms, p90Ms }, cold: ... }.
+ * Stats are null for a path with no samples yet.
+ */
+export function captureLatencySummary() {
+  const summary = {};
+  for (const [path, samples] of Object.entries(captureSamples)) {
+    const sorted = [...samples].sort((a, b) => a - b);
+    summary[path] = sorted.length ? {
+      n: sorted.length,
+      meanMs: Math.round(sorted.reduce((sum, ms) => sum + ms, 0) / sorted.length),
+      p50Ms: percentile(sorted, 50),
+      p90Ms: percentile(sorted, 90),
+    } : { n: 0, meanMs: null, p50Ms: null, p90Ms: null };
+  }
+  return summary;
+}
@@ -0,0 +1,66 @@
+// Idempotent ESP32 uploads. The camera retries a POST when its keep-alive
+// socket drops mid-request, and re-sends spooled frames after an outage. The
+// server may already have processed the first copy, only for the response to
+// be lost. Each upload carries X-Upload-Id (a CRC of the image bytes, or the
+// trace id for an unchanged notice; the same on every retry), and a repeat
+// gets the first copy's response replayed rather than a second detection
+// stored.
+//
+// Only 200s are kept; a failed request can be retried for real. A repeat that
+// arrives while the first copy is still being processed waits for it.
+
+const TTL_MS = 10 * 60 * 1000;
+const MAX_ENTRIES = 200;
+
+// "<path>|<lockerId>|<uploadId>" -> { at, done: Promise<body | null> }
+const uploads = new Map();
+
+function prune(now) {
+  for (const [key, entry] of uploads) {
+    if (uploads.size <= MAX_ENTRIES && now - entry.at <= TTL_MS) break;
+    uploads.delete(key);
+  }
+}
+
+/**
+ * Express middleware for the upload routes. Mount it after the body parser,
+ * so a replayed request has still been read in full.
+ */
+export function dedupeUploads(req, res, next) {
+  const uploadId = req.get('X-Upload-Id');
+  if (!uploadId) return next();
+
+  const now = Date.now();
+  prune(now);
+  const key = `${req.path}|${req.query.lockerId || 'locker1'}|${uploadId}`;
+  const seen = uploads.get(key);
+  if (seen) {
+    seen.done.then((body) => {
+      if (!body) return next(); // First copy failed: process this one
+      console.log(`[upload-dedup] Repeat of ${req.path} upload ${uploadId} — replaying the first response`);
+      res.status(200).json(body);
+    });
+    return;
+  }
+
+  let settle;
+  const done = new Promise((resolve) => { settle = resolve; });
+  uploads.set(key, { at: now, done });
+
+  // Settled by the route's response, even one written after the camera hung
+  // up: that is exactly the lost-response case its retry needs replayed
+  let replayable = false;
+  const json = res.json.bind(res);
+  res.json = (body) => {
+    replayable = res.statusCode === 200;
+    if (!replayable) uploads.delete(key);
+    settle(replayable ? body : null);
+    return json(body);
+  };
+  res.on('finish', () => {
+    if (replayable) return;
+    uploads.delete(key);
+    settle(null); // No-op once settled
+  });
+  next();
+}
@@ -1,16 +1,31 @@
 import "dotenv/config";
 
+// images:annotate accepts at most this many images per call
+export const MAX_BATCH_IMAGES = 16;
+
 export async function detectLabels(imageBuffer) {
+  const [result] = await detectLabelsBatch([imageBuffer]);
+  return result.labels || [];
+}
+
+/**
+ * Label several images in one images:annotate call. Returns one entry per
+ * image, in order: { labels } or { error } (Vision fails images separately).
+ */
+export async function detectLabelsBatch(imageBuffers) {
   const apiKey = process.env.GOOGLE_VISION_API_KEY;
   if (!apiKey) {
     throw new Error('GOOGLE_VISION_API_KEY environment variable is not set');
   }
+  if (imageBuffers.length > MAX_BATCH_IMAGES) {
+    throw new Error(`At most ${MAX_BATCH_IMAGES} images per Vision call`);
+  }
 
   const body = {
-    requests: [{
+    requests: imageBuffers.map(imageBuffer => ({
       image: { content: imageBuffer.toString('base64') },
       features: [{ type: 'LABEL_DETECTION', maxResults: 10 }],
-    }],
+    })),
   };
 
   const response = await fetch(
@@ -28,7 +43,11 @@ export async function detectLabels(imageBuffer) {
   }
 
   const data = await response.json();
-  return data.responses[0]?.labelAnnotations || [];
+  return imageBuffers.map((_, i) => {
+    const result = data.responses?.[i];
+    if (result?.error) return { error: result.error.message };
+    return { labels: result?.labelAnnotations || [] };
+  });
 }
 
 export function detectLabelsMock() {
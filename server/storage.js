@@ -3,19 +3,34 @@
  * Used to coordinate between Flutter app, backend, and ESP32 camera
  */
 
+import { startTrace } from './services/traceLog.js';
+
 // Capture trigger state (set by Flutter, read by ESP32)
 export const captureTrigger = {
   triggered: false,
   lockerId: null,
-  triggeredAt: null
+  triggeredAt: null,
+  traceId: null     // End-to-end trace for this capture (services/traceLog.js)
 };
 
+// Push subscribers for capture triggers (ESP32 trigger streams), keyed by lockerId
+const triggerSubscribers = new Map();
+
+// Long-poll requests waiting for a capture trigger, FIFO queue per lockerId
+const triggerWaiters = new Map();
+
+// Image requests waiting for the full frame behind a thumbnail detection
+const fullImageWaiters = new Set();
+
 // Latest detection result (set by detectObject route, read by Flutter)
 export const latestDetection = {
   result: null,
   timestamp: null,
   lockerId: null,
-  imageBuffer: null
+  imageBuffer: null,
+  imageHash: null,  // Device-side frame hash (X-Frame-Hash), for change detection
+  fullImage: false, // false while imageBuffer is still the detection thumbnail
+  traceId: null     // Trace of the capture this came from (X-Trace-Id), if any
 };
 
 /**
@@ -25,6 +40,108 @@ export function setCaptureTrigger(lockerId) {
   captureTrigger.triggered = true;
   captureTrigger.lockerId = lockerId;
   captureTrigger.triggeredAt = new Date().toISOString();
+  captureTrigger.traceId = startTrace(lockerId).traceId;
+  pushCaptureTrigger(lockerId);
+  return captureTrigger.traceId;
+}
+
+/**
+ * Deliver a pending trigger to whoever is listening for this locker:
+ * every open push stream, or else the oldest waiting long poll.
+ * A delivered trigger is consumed, so plain polling won't fire it again.
+ */
+function pushCaptureTrigger(lockerId) {
+  if (!captureTrigger.triggered || captureTrigger.lockerId !== lockerId) {
+    return false;
+  }
+
+  const trigger = { shouldCapture: true, lockerId, traceId: captureTrigger.traceId };
+  const subscribers = triggerSubscribers.get(lockerId);
+  if (subscribers?.size) {
+    captureTrigger.triggered = false;
+    for (const send of subscribers) {
+      send(trigger);
+    }
+    return true;
+  }
+
+  const queue = triggerWaiters.get(lockerId);
+  const waiter = queue?.shift();
+  if (queue?.length === 0) triggerWaiters.delete(lockerId);
+  if (waiter) {
+    captureTrigger.triggered = false;
+    waiter(trigger);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Wait for a capture trigger for a locker (long poll).
+ * Resolves with { shouldCapture: true } as soon as one is set, or
+ * { shouldCapture: false } after timeoutMs or when signal aborts.
+ */
+export function waitForCaptureTrigger(lockerId, timeoutMs, signal) {
+  return new Promise((resolve) => {
+    let timer;
+    const waiter = (trigger) => {
+      clearTimeout(timer);
+      signal?.removeEventListener('abort', cancel);
+      resolve(trigger);
+    };
+    const cancel = () => {
+      const queue = triggerWaiters.get(lockerId);
+      const index = queue ? queue.indexOf(waiter) : -1;
+      if (index !== -1) queue.splice(index, 1);
+      if (queue?.length === 0) triggerWaiters.delete(lockerId);
+      waiter({ shouldCapture: false, lockerId });
+    };
+
+    if (!triggerWaiters.has(lockerId)) {
+      triggerWaiters.set(lockerId, []);
+    }
+    triggerWaiters.get(lockerId).push(waiter);
+    timer = setTimeout(cancel, timeoutMs);
+    signal?.addEventListener('abort', cancel);
+
+    // A trigger may already be pending
+    pushCaptureTrigger(lockerId);
+  });
+}
+
+/**
+ * Tell open push streams for a locker to arm the camera (flash on, sensor
+ * streaming) because a capture is expected soon. Best effort: there is
+ * no polling fallback, an unarmed camera just takes the slower path.
+ * Returns the number of streams notified.
+ */
+export function armCaptureStreams(lockerId) {
+  const subscribers = triggerSubscribers.get(lockerId);
+  if (!subscribers) return 0;
+
+  for (const send of subscribers) {
+    send({ shouldCapture: false, arm: true, lockerId });
+  }
+  return subscribers.size;
+}
+
+/**
+ * Subscribe to capture triggers for a locker (push channel).
+ * A trigger that arrived while no stream was open is delivered immediately.
+ * Returns an unsubscribe function.
+ */
+export function subscribeCaptureTrigger(lockerId, send) {
+  if (!triggerSubscribers.has(lockerId)) {
+    triggerSubscribers.set(lockerId, new Set());
+  }
+  triggerSubscribers.get(lockerId).add(send);
+  pushCaptureTrigger(lockerId);
+
+  return () => {
+    const subscribers = triggerSubscribers.get(lockerId);
+    subscribers?.delete(send);
+    if (subscribers?.size === 0) triggerSubscribers.delete(lockerId);
+  };
 }
 
 /**
@@ -37,6 +154,7 @@ export function getAndResetCaptureTrigger() {
 
   if (captureTrigger.triggered) {
     captureTrigger.triggered = false;
+    return { shouldCapture, lockerId, traceId: captureTrigger.traceId };
   }
   
   return { shouldCapture, lockerId };
@@ -44,26 +162,105 @@ export function getAndResetCaptureTrigger() {
 
 /**
  * Store a detection result with optional image buffer
+ * (fullImage = false when the buffer is a thumbnail, see attachFullImage)
  */
-export function storeDetection(detection, lockerId = 'locker1', imageBuffer = null) {
+export function storeDetection(detection, lockerId = 'locker1', imageBuffer = null, imageHash = null, fullImage = true, traceId = null) {
   const timestamp = new Date().toISOString();
   latestDetection.result = detection;
   latestDetection.timestamp = timestamp;
   latestDetection.lockerId = lockerId;
   latestDetection.imageBuffer = imageBuffer;
+  latestDetection.imageHash = imageHash;
+  latestDetection.fullImage = fullImage;
+  latestDetection.traceId = traceId;
   console.log(`[storage] Detection stored at ${timestamp} for ${lockerId}: ${detection.label}`);
+  wakeFullImageWaiters(); // A newer detection replaces the one they waited on
   
   // Optional: Add TTL to clear old detections after 5 minutes
   setTimeout(() => {
     if (latestDetection.timestamp === timestamp) {
-      latestDetection.result = null;
-      latestDetection.timestamp = null;
-      latestDetection.lockerId = null;
-      latestDetection.imageBuffer = null;
+      clearLatestDetection();
     }
   }, 5 * 60 * 1000); // 5 minutes
 }
 
+function clearLatestDetection() {
+  latestDetection.result = null;
+  latestDetection.timestamp = null;
+  latestDetection.lockerId = null;
+  latestDetection.imageBuffer = null;
+  latestDetection.imageHash = null;
+  latestDetection.fullImage = false;
+  latestDetection.traceId = null;
+}
+
+/**
+ * Discard the latest detection for a locker because the kiosk user said it
+ * named the wrong item. The ESP32's unchanged-frame notice can then no
+ * longer reuse it. Returns { imageBuffer, imageHash } of the discarded
+ * detection (to clear the label cache with), or null if there was none.
+ */
+export function rejectLatestDetection(lockerId) {
+  if (!latestDetection.result || latestDetection.lockerId !== lockerId) return null;
+  const { imageBuffer, imageHash } = latestDetection;
+  console.log(`[storage] Detection rejected for ${lockerId}: ${latestDetection.result.label}`);
+  clearLatestDetection();
+  wakeFullImageWaiters();
+  return { imageBuffer, imageHash };
+}
+
+/**
+ * Get the stored detection if it came from this locker's frame with this hash
+ * (ESP32 change detection). Returns null when there is nothing to reuse.
+ */
+export function getDetectionForFrame(lockerId, imageHash) {
+  if (!latestDetection.result || !imageHash) return null;
+  if (latestDetection.lockerId !== lockerId || latestDetection.imageHash !== imageHash) return null;
+  return latestDetection;
+}
+
+/**
+ * Replace a thumbnail-based detection's image with the full-resolution
+ * frame (progressive upload). Keeps the detection and its timestamp.
+ * Returns false if the stored detection isn't from this frame.
+ */
+export function attachFullImage(lockerId, imageHash, imageBuffer) {
+  if (!getDetectionForFrame(lockerId, imageHash)) return false;
+  latestDetection.imageBuffer = imageBuffer;
+  latestDetection.fullImage = true;
+  console.log(`[storage] Full image attached for ${lockerId} (${imageBuffer.length} bytes)`);
+  wakeFullImageWaiters();
+  return true;
+}
+
+function wakeFullImageWaiters() {
+  for (const wake of [...fullImageWaiters]) wake();
+}
+
+/**
+ * Wait until the stored image is the full frame (progressive upload), or
+ * timeoutMs passes, or signal aborts. Resolves at once when there is no
+ * image or it is already full. Resolves with the image buffer to serve
+ * (the thumbnail if the full frame never came), or null.
+ */
+export function waitForFullImage(timeoutMs, signal) {
+  return new Promise((resolve) => {
+    if (!latestDetection.imageBuffer || latestDetection.fullImage) {
+      return resolve(latestDetection.imageBuffer);
+    }
+    let timer;
+    const wake = () => {
+      clearTimeout(timer);
+      fullImageWaiters.delete(wake);
+      signal?.removeEventListener('abort', wake);
+      resolve(latestDetection.imageBuffer);
+    };
+    fullImageWaiters.add(wake);
+    timer = setTimeout(wake, timeoutMs);
+    signal?.addEventListener('abort', wake);
+  });
+}
+
 /**
  * Get latest detection result
  * Optionally filter by timestamp (return null if not newer than 'since')
@@ -91,6 +288,74 @@ export function getLatestDetection(sinceTimestamp = null) {
     detection: latestDetection.result,
     timestamp: latestDetection.timestamp,
     lockerId: latestDetection.lockerId,
-    hasImage: latestDetection.imageBuffer !== null
+    hasImage: latestDetection.imageBuffer !== null,
+    fullImage: latestDetection.fullImage,
+    traceId: latestDetection.traceId
   };
 }
+
+// Locker door solenoid state (set by payment/listing flows, read by the S3 controller).
+// seq increments on every change so the controller can acknowledge it.
+export const solenoid = {
+  on: false,
+  seq: 0,
+  reason: null,
+  changedAt: null,  // Epoch ms the change was received (e.g. Stripe webhook arrival)
+  acked: true
+};
+
+// Push subscribers for solenoid state (S3 controller streams)
+const solenoidSubscribers = new Set();
+
+function solenoidEvent() {
+  return { solenoidOn: solenoid.on, seq: solenoid.seq };
+}
+
+/**
+ * Set the solenoid state and push it to every open controller stream.
+ * receivedAt is when the request behind the change arrived, so unlock
+ * latency can be measured from there to the relay edge.
+ */
+export function setSolenoidState(on, reason, receivedAt = Date.now()) {
+  if (solenoid.on === on) return;
+  solenoid.on = on;
+  solenoid.seq++;
+  solenoid.reason = reason;
+  solenoid.changedAt = receivedAt;
+  solenoid.acked = false;
+
+  const event = solenoidEvent();
+  for (const send of solenoidSubscribers) {
+    send(event);
+  }
+  console.log(`[solenoid] ${on ? 'ON' : 'OFF'} (${reason}), seq ${solenoid.seq}, pushed to ${solenoidSubscribers.size} stream(s)`);
+}
+
+export function getSolenoidState() {
+  return solenoidEvent();
+}
+
+/**
+ * Subscribe to solenoid state changes (push channel). The current state
+ * is sent immediately, so a reconnecting controller resyncs.
+ * Returns an unsubscribe function.
+ */
+export function subscribeSolenoidState(send) {
+  solenoidSubscribers.add(send);
+  send(solenoidEvent());
+  return () => solenoidSubscribers.delete(send);
+}
+
+/**
+ * Controller acknowledgement of a state change. relayAt is the relay edge
+ * in epoch ms (0 if the controller's clock hasn't synced); eventToRelayMs
+ * is the controller's own receive→relay time. Logs the unlock latency once.
+ */
+export function ackSolenoidState(seq, relayAt, eventToRelayMs) {
+  if (seq !== solenoid.seq || solenoid.acked) return false;
+  solenoid.acked = true;
+  const ackMs = Date.now() - solenoid.changedAt;
+  const relayMs = relayAt ? relayAt - solenoid.changedAt : null;
+  console.log(`[solenoid] seq ${seq} (${solenoid.reason}): received→relay ${relayMs ?? 'n/a'} ms, received→ack ${ackMs} ms, controller ${eventToRelayMs} ms`);
+  return true;
+}
@@ -0,0 +1,70 @@
+// Label cache lifetimes and the kiosk "wrong item" invalidation
+// (services/detectionCache.js, rejectLatestDetection in storage.js).
+//
+//   npm test
+
+import { test } from 'node:test';
+import assert from 'node:assert/strict';
+import { lookupLabels, storeLabels, forgetLabels } from '../services/detectionCache.js';
+import { storeDetection, getDetectionForFrame, getLatestDetection, rejectLatestDetection } from '../storage.js';
+
+const MINUTE = 60 * 1000;
+const labels = (description) => [{ description, score: 0.9 }];
+
+// Each test gets its own images; the cache is module state
+let imageCount = 0;
+const image = () => Buffer.from(`jpeg ${++imageCount}`);
+
+// Move Date.now() forward by ms from here on
+function advance(t, ms) {
+  const now = Date.now() + ms;
+  t.mock.method(Date, 'now', () => now);
+}
+
+test('a similar frame hash hits within a few minutes', () => {
+  storeLabels(image(), 'a0a0a0a0a0a0a0a0', labels('Laptop'), 800);
+  const hit = lookupLabels(image(), 'a0a0a0a0a0a0a0a1');
+  assert.equal(hit.match, 'perceptual');
+  assert.equal(hit.distance, 1);
+  assert.equal(hit.labels[0].description, 'Laptop');
+});
+
+test('a perceptual hit expires long before an exact one', (t) => {
+  const photo = image();
+  storeLabels(photo, 'b0b0b0b0b0b0b0b0', labels('Book'), 800);
+  advance(t, 11 * MINUTE);
+  assert.equal(lookupLabels(image(), 'b0b0b0b0b0b0b0b1'), null);
+  assert.equal(lookupLabels(photo, 'b0b0b0b0b0b0b0b0').match, 'exact');
+});
+
+test('nothing hits after a day', (t) => {
+  const photo = image();
+  storeLabels(photo, 'c0c0c0c0c0c0c0c0', labels('Headphones'), 800);
+  advance(t, 25 * 60 * MINUTE);
+  assert.equal(lookupLabels(photo, 'c0c0c0c0c0c0c0c0'), null);
+});
+
+test('forgetLabels drops the exact photo and everything the hash could hit', () => {
+  const photo = image();
+  storeLabels(photo, 'd0d0d0d0d0d0d0d0', labels('Smartphone'), 800);
+  storeLabels(image(), 'd0d0d0d0d0d0d0d3', labels('Smartphone'), 800);
+  storeLabels(image(), '2f2f2f2f2f2f2f2f', labels('Lamp'), 800);
+
+  assert.equal(forgetLabels(photo, 'd0d0d0d0d0d0d0d0'), 2);
+  assert.equal(lookupLabels(photo, 'd0d0d0d0d0d0d0d0'), null);
+  assert.equal(lookupLabels(image(), '2f2f2f2f2f2f2f2f').labels[0].description, 'Lamp');
+});
+
+test('a rejected detection is gone for the kiosk and the unchanged notice', (t) => {
+  t.mock.timers.enable({ apis: ['setTimeout'] }); // storeDetection's 5 min clear
+  const photo = image();
+  storeDetection({ label: 'Book' }, 'locker1', photo, 'e0e0e0e0e0e0e0e0');
+  assert.equal(rejectLatestDetection('locker2'), null);
+
+  const rejected = rejectLatestDetection('locker1');
+  assert.equal(rejected.imageBuffer, photo);
+  assert.equal(rejected.imageHash, 'e0e0e0e0e0e0e0e0');
+  assert.equal(getLatestDetection().detection, null);
+  assert.equal(getDetectionForFrame('locker1', 'e0e0e0e0e0e0e0e0'), null);
+  assert.equal(rejectLatestDetection('locker1'), null);
+});
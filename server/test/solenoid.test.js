@@ -0,0 +1,92 @@
+// Solenoid state push and acknowledgement ordering (storage.js): what the S3
+// controller's stream sees, and which acks count toward unlock latency.
+//
+//   npm test
+
+import { test } from 'node:test';
+import assert from 'node:assert/strict';
+import {
+  solenoid,
+  setSolenoidState,
+  getSolenoidState,
+  subscribeSolenoidState,
+  ackSolenoidState,
+} from '../storage.js';
+
+// Solenoid state is module-wide; each test starts from the door locked and acked
+function reset() {
+  setSolenoidState(false, 'test reset');
+  ackSolenoidState(solenoid.seq, 0, 0);
+}
+
+test('every change bumps seq and is pushed in order', () => {
+  reset();
+  const events = [];
+  const unsubscribe = subscribeSolenoidState((event) => events.push(event));
+  const start = solenoid.seq;
+
+  setSolenoidState(true, 'payment');
+  setSolenoidState(false, 'test period expired');
+  setSolenoidState(true, 'return');
+  unsubscribe();
+  setSolenoidState(false, 'after unsubscribe');
+
+  assert.deepEqual(events, [
+    { solenoidOn: false, seq: start },  // current state on subscribe
+    { solenoidOn: true, seq: start + 1 },
+    { solenoidOn: false, seq: start + 2 },
+    { solenoidOn: true, seq: start + 3 },
+  ]);
+  assert.deepEqual(getSolenoidState(), { solenoidOn: false, seq: start + 4 });
+});
+
+test('setting the state it already has is not a change', () => {
+  reset();
+  const events = [];
+  const unsubscribe = subscribeSolenoidState((event) => events.push(event));
+  const start = solenoid.seq;
+
+  setSolenoidState(false, 'already locked');
+  unsubscribe();
+
+  assert.equal(solenoid.seq, start);
+  assert.equal(events.length, 1);
+  assert.equal(ackSolenoidState(start, 0, 0), false); // still acked from reset()
+});
+
+test('the current seq is acked once', () => {
+  reset();
+  setSolenoidState(true, 'payment', Date.now() - 120);
+  const seq = solenoid.seq;
+
+  assert.equal(ackSolenoidState(seq, Date.now(), 40), true);
+  assert.equal(ackSolenoidState(seq, Date.now(), 40), false); // retried ack
+});
+
+test('a stale ack for a superseded change is ignored', () => {
+  reset();
+  setSolenoidState(true, 'payment');
+  const unlockSeq = solenoid.seq;
+  setSolenoidState(false, 'test period expired'); // before the controller acked
+  const lockSeq = solenoid.seq;
+
+  assert.equal(ackSolenoidState(unlockSeq, Date.now(), 40), false);
+  assert.equal(solenoid.acked, false);
+  assert.equal(ackSolenoidState(lockSeq, Date.now(), 40), true);
+});
+
+test('an ack from the future (controller ahead after a server restart) is ignored', () => {
+  reset();
+  setSolenoidState(true, 'payment');
+  assert.equal(ackSolenoidState(solenoid.seq + 1, Date.now(), 40), false);
+  assert.equal(ackSolenoidState(solenoid.seq, Date.now(), 40), true);
+});
+
+test('a controller that reconnects resyncs to the latest state', () => {
+  reset();
+  setSolenoidState(true, 'payment'); // while no stream is open
+  let event;
+  const unsubscribe = subscribeSolenoidState((e) => { event = e; });
+  unsubscribe();
+  assert.deepEqual(event, { solenoidOn: true, seq: solenoid.seq });
+});
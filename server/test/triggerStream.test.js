@@ -0,0 +1,166 @@
+// Trigger push channel against a local stand-in server: a plain node:http
+// server wiring the trigger endpoints to storage.js the way server.js does,
+// and a client standing in for the camera, reading one "data:" event at a
+// time off the stream. No Express or hardware needed.
+//
+//   npm test
+
+import { test, before, after } from 'node:test';
+import assert from 'node:assert/strict';
+import http from 'node:http';
+import {
+  setCaptureTrigger,
+  getAndResetCaptureTrigger,
+  waitForCaptureTrigger,
+  subscribeCaptureTrigger,
+} from '../storage.js';
+
+let server;
+let baseUrl;
+
+// The three routes from server.js, minus logging and Express
+function standIn(req, res) {
+  const url = new URL(req.url, 'http://standin');
+  const lockerId = url.searchParams.get('lockerId') || 'locker1';
+  const json = (body) => {
+    res.writeHead(200, { 'Content-Type': 'application/json' });
+    res.end(JSON.stringify(body));
+  };
+
+  if (req.method === 'POST' && url.pathname === '/api/locker/trigger-capture') {
+    return json({ success: true, lockerId, traceId: setCaptureTrigger(lockerId) });
+  }
+  if (req.method === 'GET' && url.pathname === '/api/locker/capture-trigger') {
+    const waitSeconds = Number(url.searchParams.get('wait')) || 0;
+    if (waitSeconds > 0) {
+      const controller = new AbortController();
+      res.on('close', () => controller.abort());
+      return waitForCaptureTrigger(lockerId, waitSeconds * 1000, controller.signal).then(json);
+    }
+    return json(getAndResetCaptureTrigger());
+  }
+  if (req.method === 'GET' && url.pathname === '/api/locker/trigger-stream') {
+    res.writeHead(200, { 'Content-Type': 'text/event-stream', 'Cache-Control': 'no-cache' });
+    res.flushHeaders();
+    res.socket.setNoDelay(true);
+    const unsubscribe = subscribeCaptureTrigger(lockerId, (event) => {
+      res.write(`data: ${JSON.stringify(event)}\n\n`);
+    });
+    res.on('close', unsubscribe);
+    return;
+  }
+  res.writeHead(404).end();
+}
+
+function request(method, path) {
+  return new Promise((resolve, reject) => {
+    http.request(`${baseUrl}${path}`, { method }, (res) => {
+      let body = '';
+      res.on('data', (chunk) => { body += chunk; });
+      res.on('end', () => resolve(JSON.parse(body)));
+    }).on('error', reject).end();
+  });
+}
+
+const triggerCapture = (lockerId) => request('POST', `/api/locker/trigger-capture?lockerId=${lockerId}`);
+const pollTrigger = () => request('GET', '/api/locker/capture-trigger');
+
+// Camera side of the stream: resolves once connected; next() gives each
+// "data:" payload in arrival order
+function openStream(lockerId) {
+  return new Promise((resolve, reject) => {
+    const events = [];
+    const waiting = [];
+    const req = http.get(`${baseUrl}/api/locker/trigger-stream?lockerId=${lockerId}`, (res) => {
+      let buffer = '';
+      res.setEncoding('utf8');
+      res.on('data', (chunk) => {
+        buffer += chunk;
+        let end;
+        while ((end = buffer.indexOf('\n\n')) !== -1) {
+          const line = buffer.slice(0, end);
+          buffer = buffer.slice(end + 2);
+          if (!line.startsWith('data: ')) continue;
+          const event = { at: performance.now(), ...JSON.parse(line.slice(6)) };
+          const next = waiting.shift();
+          if (next) next(event); else events.push(event);
+        }
+      });
+      resolve({
+        next: () => (events.length ? Promise.resolve(events.shift())
+                                   : new Promise((r) => waiting.push(r))),
+        // Resolves once the server has dropped the subscriber
+        close: () => new Promise((r) => { server.once('standin-close', r); req.destroy(); }),
+      });
+    });
+    req.on('error', (err) => { if (err.code !== 'ECONNRESET') reject(err); });
+  });
+}
+
+before(async () => {
+  server = http.createServer((req, res) => {
+    res.on('close', () => server.emit('standin-close'));
+    standIn(req, res);
+  });
+  await new Promise((resolve) => server.listen(0, '127.0.0.1', resolve));
+  baseUrl = `http://127.0.0.1:${server.address().port}`;
+});
+
+after(() => {
+  server.closeAllConnections();
+  server.close();
+});
+
+test('a trigger set while no stream is open is delivered on subscribe', async () => {
+  const { traceId } = await triggerCapture('locker1');
+  const stream = await openStream('locker1');
+  const event = await stream.next();
+  assert.equal(event.shouldCapture, true);
+  assert.equal(event.traceId, traceId);
+  await stream.close();
+});
+
+test('a live trigger is pushed to the open stream', async () => {
+  const stream = await openStream('locker1');
+  const sentAt = performance.now();
+  const { traceId } = await triggerCapture('locker1');
+  const event = await stream.next();
+  assert.equal(event.traceId, traceId);
+  const ms = event.at - sentAt;
+  assert.ok(ms < 500, `push took ${ms.toFixed(1)} ms`);
+  console.log(`trigger -> stream event: ${ms.toFixed(1)} ms`);
+
+  // Pushed triggers are consumed: the polling fallback doesn't fire again
+  assert.equal((await pollTrigger()).shouldCapture, false);
+  await stream.close();
+});
+
+test('only the locker the trigger is for gets it', async () => {
+  const other = await openStream('locker2');
+  const stream = await openStream('locker1');
+  await triggerCapture('locker1');
+  assert.equal((await stream.next()).lockerId, 'locker1');
+  const stray = await Promise.race([other.next(), new Promise((r) => setTimeout(r, 50, null))]);
+  assert.equal(stray, null);
+  await stream.close();
+  await other.close();
+});
+
+test('polling still picks triggers up once the stream is down', async () => {
+  const stream = await openStream('locker1');
+  await stream.close();
+  const { traceId } = await triggerCapture('locker1');
+  const polled = await pollTrigger();
+  assert.equal(polled.shouldCapture, true);
+  assert.equal(polled.traceId, traceId);
+  assert.equal((await pollTrigger()).shouldCapture, false);
+});
+
+test('a long poll waiting when the trigger arrives is answered at once', async () => {
+  const poll = request('GET', '/api/locker/capture-trigger?lockerId=locker1&wait=5');
+  await new Promise((r) => setTimeout(r, 20)); // let the poll register
+  const { traceId } = await triggerCapture('locker1');
+  const result = await poll;
+  assert.equal(result.shouldCapture, true);
+  assert.equal(result.traceId, traceId);
+});